@@ -21,6 +21,7 @@ cdef class RGBMatrixOptions:
     cdef bytes __py_encoded_panel_type
     cdef bytes __py_encoded_drop_priv_user
     cdef bytes __py_encoded_drop_priv_group
+    cdef bytes __py_encoded_telemetry_file
 
 # Local Variables:
 # mode: python
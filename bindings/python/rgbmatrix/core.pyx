@@ -134,6 +134,10 @@ cdef class RGBMatrixOptions:
         def __get__(self): return self.__options.pwm_bits
         def __set__(self, uint8_t value): self.__options.pwm_bits = value
 
+    property bit_planes:
+        def __get__(self): return self.__options.bit_planes
+        def __set__(self, uint8_t value): self.__options.bit_planes = value
+
     property pwm_lsb_nanoseconds:
         def __get__(self): return self.__options.pwm_lsb_nanoseconds
         def __set__(self, uint32_t value): self.__options.pwm_lsb_nanoseconds = value
@@ -166,6 +170,10 @@ cdef class RGBMatrixOptions:
         def __get__(self): return self.__options.inverse_colors
         def __set__(self, value): self.__options.inverse_colors = value
 
+    property packed_framebuffer:
+        def __get__(self): return self.__options.packed_framebuffer
+        def __set__(self, value): self.__options.packed_framebuffer = value
+
     property led_rgb_sequence:
         def __get__(self): return self.__options.led_rgb_sequence
         def __set__(self, value):
@@ -223,6 +231,14 @@ cdef class RGBMatrixOptions:
             self.__py_encoded_drop_priv_group = value.encode('utf-8')
             self.__runtime_options.drop_priv_group = self.__py_encoded_drop_priv_group
 
+    property telemetry_file:
+        def __get__(self):
+            if self.__runtime_options.telemetry_file == NULL: return None
+            return self.__runtime_options.telemetry_file
+        def __set__(self, value):
+            self.__py_encoded_telemetry_file = value.encode('utf-8')
+            self.__runtime_options.telemetry_file = self.__py_encoded_telemetry_file
+
 cdef class RGBMatrix(Canvas):
     def __cinit__(self, int rows = 0, int chains = 0, int parallel = 0,
         RGBMatrixOptions options = None):
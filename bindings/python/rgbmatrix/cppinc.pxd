@@ -39,6 +39,7 @@ cdef extern from "led-matrix.h" namespace "rgb_matrix":
       bool do_gpio_init
       const char *drop_priv_user
       const char *drop_priv_group
+      const char *telemetry_file
 
 
     RGBMatrix *CreateMatrixFromOptions(Options &options, RuntimeOptions runtime_options)
@@ -56,6 +57,7 @@ cdef extern from "led-matrix.h" namespace "rgb_matrix::RGBMatrix":
         int chain_length
         int parallel
         int pwm_bits
+        int bit_planes
         int pwm_lsb_nanoseconds
         int brightness
         int scan_mode
@@ -67,6 +69,7 @@ cdef extern from "led-matrix.h" namespace "rgb_matrix::RGBMatrix":
         bool disable_hardware_pulsing
         bool show_refresh_rate
         bool inverse_colors
+        bool packed_framebuffer
 
         const char *led_rgb_sequence
         const char *pixel_mapper_config
@@ -20,6 +20,7 @@
 #include <sys/types.h>
 
 #include <string>
+#include <vector>
 
 namespace rgb_matrix {
 class FrameCanvas;
@@ -92,7 +93,10 @@ private:
 class StreamWriter {
 public:
   // Does not take ownership of StreamIO
-  StreamWriter(StreamIO *io);
+  // With "delta_frames", frames only contain the parts that changed from the
+  // previous frame. Such streams can't be read by versions of this library
+  // before delta frames were introduced, so this is off by default.
+  StreamWriter(StreamIO *io, bool delta_frames = false);
 
   // Stream out given canvas at the given time. "hold_time_us" indicates
   // for how long this frame is to be shown in microseconds.
@@ -102,7 +106,10 @@ private:
   void WriteFileHeader(const FrameCanvas &frame, size_t len);
 
   StreamIO *const io_;
+  const bool delta_frames_;
   bool header_written_;
+  std::string previous_frame_;              // Last frame streamed.
+  std::vector<uint64_t> streamed_version_;  // Its FrameCanvas::band_version()
 };
 
 class StreamReader {
@@ -128,9 +135,12 @@ private:
 
   StreamIO *io_;
   size_t frame_buf_size_;
+  size_t band_size_;   // 0 if the stream does not have delta frames.
+  int band_count_;
   State state_;
 
-  char *header_frame_buffer_;
+  char *frame_buffer_;  // Current frame, delta frames are applied to it.
+  bool have_full_frame_;
 };
 // Helpers for external C bridge wrappers.
 bool StreamIOIsCompatibleWithCanvas(StreamIO* io, FrameCanvas* frame);
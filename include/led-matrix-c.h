@@ -158,6 +158,15 @@ struct RGBLedMatrixOptions {
    * processes when waiting and renders single core boards more responsive.
    */
   bool disable_busy_waiting;     /* Corresponding flag: --led-busy-waiting */
+
+  /* Keep frame canvases in a compact representation with one byte per
+   * parallel chain and column, expanded to GPIO words while refreshing.
+   */
+  bool packed_framebuffer;  /* Corresponding flag: --led-packed-framebuffer */
+
+  /* Number of bitplanes in the frame buffers, 1..16. Default 11.
+   */
+  int bit_planes;           /* Corresponding flag: --led-bit-planes */
 };
 
 /**
@@ -201,6 +210,13 @@ struct RGBLedRuntimeOptions {
   // to. Unless chosen otherwise, the default is "daemon" for user and group.
   const char *drop_priv_user;
   const char *drop_priv_group;
+
+  // If set, the file to export telemetry to, see RGBMatrix::ExportTelemetry().
+  const char *telemetry_file;  // Flag: --led-telemetry-file
+
+  // Experimental, not verified on hardware yet: RP1 PIO state machines
+  // taking turns by row, 1..4. Lowered until it divides the double rows.
+  int rp1_pio_sm;       // Flag: --led-rp1-pio-sm (not in --help)
 };
 
 /**
@@ -345,6 +361,14 @@ void led_canvas_subfill(struct LedCanvas *canvas, int x, int y,
  */
 struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *matrix);
 
+/**
+ * Like led_matrix_create_offscreen_canvas(), but drawing goes to a plain
+ * RGB buffer that is converted in a separate thread once the canvas is
+ * passed to led_matrix_swap_on_vsync(). Cheaper for random pixel access.
+ * Ownership of returned pointer stays with the matrix, don't free().
+ */
+struct LedCanvas *led_matrix_create_shadow_canvas(struct RGBLedMatrix *matrix);
+
 /**
  * Swap the given canvas (created with create_offscreen_canvas) with the
  * currently active canvas on vsync (blocks until vsync is reached).
@@ -360,6 +384,98 @@ struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *matrix
 struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
                                            struct LedCanvas *canvas);
 
+/**
+ * Queue the canvas to be shown at "present_at_usec" (CLOCK_MONOTONIC
+ * microseconds, 0 for as soon as possible) for at least "min_hold_usec",
+ * without waiting. Returns 0 if the queue is full.
+ * See RGBMatrix::QueueFrame() in led-matrix.h.
+ */
+int led_matrix_queue_frame(struct RGBLedMatrix *matrix,
+                           struct LedCanvas *canvas,
+                           uint64_t present_at_usec, uint32_t min_hold_usec);
+
+/**
+ * Returns a queued canvas that is no longer shown, to draw the next frame
+ * on, or NULL if there is none right now.
+ */
+struct LedCanvas *led_matrix_take_recycled_frame(struct RGBLedMatrix *matrix);
+
+/**
+ * Refresh timing, see RGBMatrix::VSyncInfo in led-matrix.h. Times are
+ * CLOCK_MONOTONIC microseconds.
+ */
+struct LedVSyncInfo {
+  uint64_t refreshes;
+  uint64_t vsyncs;
+  uint64_t vsync_usec;
+  uint64_t next_vsync_usec;
+  uint64_t frame_shown_usec;
+  uint32_t frame_refreshes;
+  uint32_t refresh_usec;
+};
+
+/**
+ * Fill "info" with the timing as of the latest refresh. Returns 0 if the
+ * refresh thread is not running.
+ */
+int led_matrix_get_vsync_info(struct RGBLedMatrix *matrix,
+                              struct LedVSyncInfo *info);
+
+/**
+ * Wait until refresh number "refresh" has started, at most "timeout_ms" if
+ * that is >= 0. Fills "info" if not NULL. Returns 0 on timeout.
+ */
+int led_matrix_await_refresh(struct RGBLedMatrix *matrix, uint64_t refresh,
+                             struct LedVSyncInfo *info, int timeout_ms);
+
+/**
+ * Call "callback" from its own thread once per frame, "lead_usec" before
+ * the estimated next vsync. A NULL callback stops the calls.
+ */
+typedef void (*LedVSyncCallback)(const struct LedVSyncInfo *info,
+                                 void *user_data);
+int led_matrix_set_vsync_callback(struct RGBLedMatrix *matrix,
+                                  LedVSyncCallback callback, void *user_data,
+                                  uint32_t lead_usec);
+
+/**
+ * Refresh loop telemetry, see RGBMatrix::Telemetry in led-matrix.h.
+ * Shared by all matrices of the process.
+ */
+#define LED_TELEMETRY_BUCKETS 20
+struct LedTelemetryHistogram {
+  uint64_t count;
+  uint64_t total_usec;
+  uint64_t max_usec;
+  uint64_t buckets[LED_TELEMETRY_BUCKETS];
+};
+struct LedTelemetry {
+  uint64_t refreshes;
+  uint64_t missed_refresh_targets;
+  uint64_t late_frames;
+  struct LedTelemetryHistogram refresh_period;
+  struct LedTelemetryHistogram clock_in;
+  struct LedTelemetryHistogram pulse_overshoot;
+  struct LedTelemetryHistogram swap_wait;
+};
+
+void led_matrix_get_telemetry(struct RGBLedMatrix *matrix,
+                              struct LedTelemetry *telemetry);
+
+/**
+ * Keep the telemetry in a shared memory file another process can poll.
+ * Returns 0 on failure. See RGBMatrix::ExportTelemetry().
+ */
+int led_matrix_export_telemetry(struct RGBLedMatrix *matrix, const char *path);
+
+/**
+ * Switch recording of trace events on or off, and write what was recorded
+ * as Chrome trace-event JSON. See RGBMatrix::SetTracing() in led-matrix.h.
+ * led_matrix_dump_trace() returns 0 if the file can't be written.
+ */
+void led_matrix_set_tracing(int on);
+int led_matrix_dump_trace(const char *filename);
+
 uint8_t led_matrix_get_brightness(struct RGBLedMatrix *matrix);
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix, uint8_t brightness);
 
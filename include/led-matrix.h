@@ -90,10 +90,16 @@ public:
 
     // Set PWM bits used for output. Default is 11, but if you only deal with
     // limited comic-colors, 1 might be sufficient. Lower require less CPU and
-    // increases refresh-rate.
+    // increases refresh-rate. At most bit_planes.
     // Flag: --led-pwm-bits
     int pwm_bits;
 
+    // Number of bitplanes in the frame buffers, 1..16. Default is 11. More
+    // planes allow finer steps at low brightness; unused planes don't take
+    // memory.
+    // Flag: --led-bit-planes
+    int bit_planes;
+
     // Change the base time-unit for the on-time in the lowest
     // significant bit in nanoseconds.
     // Higher numbers provide better quality (more accurate color, less
@@ -159,6 +165,13 @@ public:
     // Sleep instead of busy wait to free CPU cycles but get slightly less
     // accurate frame timing.
     bool disable_busy_waiting;   // Flag: --led-busy-waiting
+
+    // Store the frame canvases with one byte per parallel chain and column
+    // instead of a full GPIO word, and expand them to GPIO words while
+    // refreshing. Needs 2-8 times less memory and memory bandwidth for
+    // CopyFrom() and streaming, at the cost of a bit of CPU time in the
+    // refresh thread.
+    bool packed_framebuffer;     // Flag: --led-packed-framebuffer
   };
 
   // Factory to create a matrix. Additional functionality includes dropping
@@ -220,9 +233,28 @@ public:
   // when the RGBMatrix is deleted).
   FrameCanvas *CreateFrameCanvas();
 
+  // Like CreateFrameCanvas(), but the returned canvas keeps its content in a
+  // plain RGB buffer. Drawing on it is just a write into that buffer, which
+  // is a lot cheaper for code that accesses pixels in random order.
+  // The conversion into the internal representation happens in one pass
+  // once the canvas is passed to SwapOnVSync(), and it runs in a separate
+  // thread (see SwapOnVSync()).
+  //
+  // Brightness and luminance correction are applied at conversion time.
+  // Content loaded with Deserialize() or copied with CopyFrom() from a
+  // regular canvas is turned back into RGB: the colors are as close as the
+  // current brightness and luminance correction allow.
+  FrameCanvas *CreateShadowFrameCanvas();
+
   // This method waits to the next VSync and swaps the active buffer with the
   // supplied buffer. The formerly active buffer is returned.
   //
+  // If "other" was created with CreateShadowFrameCanvas(), this does not
+  // wait: the canvas is handed to a conversion thread which swaps it in on
+  // the next VSync, and the previous frame is returned right away (it is
+  // safe to draw on a shadow canvas while it is still on screen). Only one
+  // frame is in flight at a time; a subsequent call waits for it.
+  //
   // If you pass in NULL, the active buffer is returned, but it won't be
   // replaced with NULL. You can use the NULL-behavior to just wait on
   // VSync or to retrieve the initial buffer when preparing a multi-buffer
@@ -238,6 +270,118 @@ public:
   // time-correct animations.
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction = 1);
 
+  // -- Presentation queue.
+  // An alternative to SwapOnVSync() for producers that prepare frames ahead
+  // of time, e.g. to play back a stream or video: frames are queued without
+  // waiting, and the refresh thread swaps in the next one at the first
+  // refresh when it is due. Frames the refresh thread is done with, because
+  // they were replaced or skipped, come back through TakeRecycledFrame(),
+  // ready to be drawn on again.
+  //
+  // "present_at_usec" is the CLOCK_MONOTONIC time in microseconds at which
+  // the frame should be shown, 0 for as soon as possible. If several frames
+  // with a time are due at once, only the last of them is shown.
+  // "min_hold_usec" is how long the frame stays at least before the next
+  // queued frame replaces it.
+  //
+  // Returns false if kPresentationQueueSize frames are already waiting.
+  // Only one thread should queue frames, and not mix this with
+  // SwapOnVSync() or drawing on the RGBMatrix itself.
+  static const int kPresentationQueueSize = 16;
+  bool QueueFrame(FrameCanvas *frame, uint64_t present_at_usec = 0,
+                  uint32_t min_hold_usec = 0);
+
+  // A frame that was queued and is no longer shown, or NULL if there is none
+  // right now. Frames not taken back here stay with the matrix: once
+  // kPresentationQueueSize + 1 wait to be taken, further ones are not
+  // handed back.
+  FrameCanvas *TakeRecycledFrame();
+
+  // -- Refresh timing.
+  // Where the refresh thread is, for producers that want to render as late
+  // as possible. Times are CLOCK_MONOTONIC microseconds, like the ones of
+  // QueueFrame(). A "vsync" is a frame boundary: the point at which
+  // SwapOnVSync() swaps frames, every "framerate_fraction" refreshes.
+  struct VSyncInfo {
+    uint64_t refreshes;        // Refreshes started so far.
+    uint64_t vsyncs;           // Frame boundaries passed so far.
+    uint64_t vsync_usec;       // Start of the refresh after the last one.
+    uint64_t next_vsync_usec;  // Estimate for the next one.
+    uint64_t frame_shown_usec; // When the frame on screen went on.
+    uint32_t frame_refreshes;  // How often it has been refreshed since.
+    uint32_t refresh_usec;     // How long the last refresh took.
+  };
+
+  // Fill "info" with the state as of the latest refresh. Returns false if
+  // the refresh thread is not running.
+  bool GetVSyncInfo(VSyncInfo *info);
+
+  // Wait until refresh number "refresh" (see VSyncInfo::refreshes) has
+  // started or "timeout_ms" passed; a negative timeout waits forever.
+  // Fills "info" if not NULL. Returns true if the refresh was reached.
+  bool AwaitRefresh(uint64_t refresh, VSyncInfo *info = NULL,
+                    int timeout_ms = -1);
+
+  // Call "callback" once per frame, "lead_usec" before the estimated next
+  // vsync, e.g. to draw and SwapOnVSync() the next frame just in time. It
+  // runs in its own thread and gets the VSyncInfo as of the call; if it is
+  // late for one vsync it skips to the next. A NULL callback stops the
+  // calls. Don't call this from within the callback.
+  typedef void (*VSyncCallback)(const VSyncInfo &info, void *user_data);
+  bool SetVSyncCallback(VSyncCallback callback, void *user_data,
+                        uint32_t lead_usec);
+
+  // -- Telemetry.
+  // Counters and histograms of the refresh loop, to find out where flicker
+  // comes from. They are always recorded and shared by all matrices of the
+  // process. Values only ever grow; take two snapshots to look at a period.
+  //
+  // Histogram bucket 0 counts values below 1us, bucket i values from
+  // 2^(i-1) to 2^i - 1 us, and the last bucket everything above.
+  static const int kTelemetryBuckets = 20;
+  struct TelemetryHistogram {
+    uint64_t count;
+    uint64_t total_usec;
+    uint64_t max_usec;
+    uint64_t buckets[kTelemetryBuckets];
+  };
+  struct Telemetry {
+    uint64_t refreshes;
+    uint64_t missed_refresh_targets;  // Slower than limit_refresh_rate_hz.
+    uint64_t late_frames;             // QueueFrame()d, skipped as late.
+    TelemetryHistogram refresh_period;   // Start to start of refreshes.
+    TelemetryHistogram clock_in;         // Shifting in one bit plane of a row
+                                         // (GPIO output, one row a refresh).
+    TelemetryHistogram pulse_overshoot;  // OE pulse, or the wait for its
+                                         // end, longer than asked.
+    TelemetryHistogram swap_wait;        // SwapOnVSync() waiting for vsync.
+  };
+
+  // Fill "telemetry" with the values so far.
+  void GetTelemetry(Telemetry *telemetry);
+
+  // Keep the telemetry in a shared memory file from now on, so that another
+  // process can mmap() and poll it without involving this one. The file
+  // starts with "RGBTELEM", a uint32 version and a uint32 size of the
+  // Telemetry that follows. Flag: --led-telemetry-file
+  // Returns false if the file can't be created or telemetry is already
+  // exported.
+  bool ExportTelemetry(const char *path);
+
+  // -- Tracing.
+  // When the display stutters, a trace shows where the time went: refresh,
+  // row and bit plane phases, pulse waits, SwapOnVSync() waits, conversion
+  // and stream reads, each on the thread it happened on. (On a producer
+  // thread, the gaps between SwapOnVSync() are the time spent rendering.)
+  //
+  // While switched on, every thread keeps its last 65536 events, which is
+  // about half a second of the refresh thread; switch it on, reproduce the
+  // problem and dump right after. The file is Chrome trace-event JSON, to
+  // open in https://ui.perfetto.dev or chrome://tracing. Tracing is process
+  // wide. Compiled with -DDISABLE_TRACING, the trace stays empty.
+  static void SetTracing(bool on);
+  static bool DumpTrace(const char *filename);
+
   // -- Setting shape and behavior of matrix.
 
   // Apply a pixel mapper. This is used to re-map pixels according to some
@@ -374,9 +518,30 @@ public:
   // This method should only be called if FrameCanvas is off-screen.
   bool Deserialize(const char *data, size_t len);
 
+  // If the serialized representation is the one of a packed framebuffer
+  // (--led-packed-framebuffer).
+  bool is_packed() const;
+
   // Copy content from other FrameCanvas owned by the same RGBMatrix.
+  // Only the parts that differ are copied.
   void CopyFrom(const FrameCanvas &other);
 
+  //-- Change tracking, e.g. to only store or send what changed.
+  // The serialized representation consists of band_count() equally sized
+  // bands, one per pair of rows that are multiplexed together.
+
+  int band_count() const;
+
+  // Bitmask of the bitplanes of the band that have been modified since the
+  // last SwapOnVSync() of this canvas. 0 if untouched. CopyFrom() carries
+  // over the dirty_planes() and band_version() of the bands it copies.
+  uint32_t dirty_planes(int band) const;
+
+  // Identifies the content of the band as of the last SwapOnVSync(): if two
+  // canvases report the same band_version() for a band, it is identical in
+  // both - unless dirty_planes() shows later changes.
+  uint64_t band_version(int band) const;
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
@@ -387,7 +552,20 @@ public:
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
   virtual void SubFill(int x, int y, int width, int height, uint8_t red, uint8_t green, uint8_t blue);
-  
+
+  // Copy a rectangle of packed RGB (or BGR) pixels to position x, y;
+  // "row_stride" is the number of bytes between image rows. Pixels outside
+  // the canvas are clipped.
+  // This is the path SetImage() (see graphics.h) takes for a FrameCanvas.
+  // Large images are converted in parallel on the cores not used by the
+  // refresh thread.
+  void SetImageRect(int x, int y, int width, int height,
+                    const uint8_t *image, size_t row_stride, bool is_bgr);
+
+  // Microseconds the last bulk conversion of this canvas took: SetPixels(),
+  // SetImageRect() or, for a shadow canvas, the conversion when swapped.
+  uint32_t conversion_usec() const;
+
 private:
   friend class RGBMatrix;
 
@@ -441,6 +619,13 @@ struct RuntimeOptions {
   // to. Unless chosen otherwise, the default is "daemon" for user and group.
   const char *drop_priv_user;
   const char *drop_priv_group;
+
+  // If set, the file to export telemetry to, see RGBMatrix::ExportTelemetry().
+  const char *telemetry_file;  // Flag: --led-telemetry-file
+
+  // Experimental, not verified on hardware yet: RP1 PIO state machines
+  // taking turns by row, 1..4. Lowered until it divides the double rows.
+  int rp1_pio_sm;       // Flag: --led-rp1-pio-sm (not in --help)
 };
 
 // Convenience utility functions to read standard rgb-matrix flags and create
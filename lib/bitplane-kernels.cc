@@ -0,0 +1,212 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "bitplane-kernels.h"
+
+// The vector paths work on 32 bit GPIO words; the wide compute module
+// representation always takes the scalar path.
+#if !defined(ENABLE_WIDE_GPIO_COMPUTE_MODULE)
+#  if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#    include <arm_neon.h>
+#    define BITPLANE_SPAN_NEON 1
+#  elif defined(__AVX2__)
+#    include <immintrin.h>
+#    define BITPLANE_SPAN_AVX2 1
+#  elif defined(__SSE2__)
+#    include <emmintrin.h>
+#    define BITPLANE_SPAN_SSE2 1
+#  endif
+#endif
+
+namespace rgb_matrix {
+namespace internal {
+namespace {
+#if defined(BITPLANE_SPAN_AVX2)
+static constexpr int kLanes = 8;
+#elif defined(BITPLANE_SPAN_NEON) || defined(BITPLANE_SPAN_SSE2)
+static constexpr int kLanes = 4;
+#else
+static constexpr int kLanes = 1;
+#endif
+
+// Same as Framebuffer::SetPixel().
+template <typename T>
+inline void WriteScalar(const PixelColorBits &d, int32_t gpio_word,
+                        uint16_t red, uint16_t green, uint16_t blue,
+                        T *bitplane_buffer, int plane_stride,
+                        int first_plane, int end_plane) {
+  if (gpio_word < 0) return;  // non-used pixel marker.
+  WritePixelPlanes(d, gpio_word, red, green, blue, bitplane_buffer,
+                   plane_stride, first_plane, end_plane);
+}
+
+#if defined(BITPLANE_SPAN_NEON) || defined(BITPLANE_SPAN_AVX2) \
+  || defined(BITPLANE_SPAN_SSE2)
+// A run of kLanes pixels can be written with vector instructions if
+// they address consecutive words and share the same color bits.
+inline bool IsVectorRun(const int32_t *gpio_words, const uint8_t *color_index) {
+  if (gpio_words[0] < 0) return false;
+  for (int i = 1; i < kLanes; ++i) {
+    if (gpio_words[i] != gpio_words[0] + i
+        || color_index[i] != color_index[0])
+      return false;
+  }
+  return true;
+}
+#endif
+
+#if defined(BITPLANE_SPAN_NEON)
+inline void WriteVectorRun(const PixelColorBits &d, int32_t gpio_word,
+                           const uint16_t *red, const uint16_t *green,
+                           const uint16_t *blue,
+                           gpio_bits_t *bitplane_buffer, int plane_stride,
+                           int first_plane, int end_plane) {
+  const uint32x4_t r = vmovl_u16(vld1_u16(red));
+  const uint32x4_t g = vmovl_u16(vld1_u16(green));
+  const uint32x4_t b = vmovl_u16(vld1_u16(blue));
+  const uint32x4_t r_bits = vdupq_n_u32(d.r_bit);
+  const uint32x4_t g_bits = vdupq_n_u32(d.g_bit);
+  const uint32x4_t b_bits = vdupq_n_u32(d.b_bit);
+  const uint32x4_t keep = vdupq_n_u32(d.mask);
+  gpio_bits_t *bits = bitplane_buffer + gpio_word
+    + plane_stride * first_plane;
+  for (int plane = first_plane; plane < end_plane; ++plane) {
+    const uint32x4_t plane_bit = vdupq_n_u32(1u << plane);
+    uint32x4_t color = vandq_u32(vtstq_u32(r, plane_bit), r_bits);
+    color = vorrq_u32(color, vandq_u32(vtstq_u32(g, plane_bit), g_bits));
+    color = vorrq_u32(color, vandq_u32(vtstq_u32(b, plane_bit), b_bits));
+    const uint32x4_t word = vld1q_u32(bits);
+    vst1q_u32(bits, vorrq_u32(vandq_u32(word, keep), color));
+    bits += plane_stride;
+  }
+}
+#elif defined(BITPLANE_SPAN_AVX2)
+inline __m256i TestBits(__m256i v, __m256i bit) {
+  return _mm256_cmpeq_epi32(_mm256_and_si256(v, bit), bit);
+}
+
+inline void WriteVectorRun(const PixelColorBits &d, int32_t gpio_word,
+                           const uint16_t *red, const uint16_t *green,
+                           const uint16_t *blue,
+                           gpio_bits_t *bitplane_buffer, int plane_stride,
+                           int first_plane, int end_plane) {
+  const __m256i r = _mm256_cvtepu16_epi32(
+    _mm_loadu_si128(reinterpret_cast<const __m128i*>(red)));
+  const __m256i g = _mm256_cvtepu16_epi32(
+    _mm_loadu_si128(reinterpret_cast<const __m128i*>(green)));
+  const __m256i b = _mm256_cvtepu16_epi32(
+    _mm_loadu_si128(reinterpret_cast<const __m128i*>(blue)));
+  const __m256i r_bits = _mm256_set1_epi32(d.r_bit);
+  const __m256i g_bits = _mm256_set1_epi32(d.g_bit);
+  const __m256i b_bits = _mm256_set1_epi32(d.b_bit);
+  const __m256i keep = _mm256_set1_epi32(d.mask);
+  gpio_bits_t *bits = bitplane_buffer + gpio_word
+    + plane_stride * first_plane;
+  for (int plane = first_plane; plane < end_plane; ++plane) {
+    const __m256i plane_bit = _mm256_set1_epi32(1 << plane);
+    __m256i color = _mm256_and_si256(TestBits(r, plane_bit), r_bits);
+    color = _mm256_or_si256(color,
+                            _mm256_and_si256(TestBits(g, plane_bit), g_bits));
+    color = _mm256_or_si256(color,
+                            _mm256_and_si256(TestBits(b, plane_bit), b_bits));
+    __m256i *out = reinterpret_cast<__m256i*>(bits);
+    const __m256i word = _mm256_loadu_si256(out);
+    _mm256_storeu_si256(out, _mm256_or_si256(_mm256_and_si256(word, keep),
+                                             color));
+    bits += plane_stride;
+  }
+}
+#elif defined(BITPLANE_SPAN_SSE2)
+inline __m128i TestBits(__m128i v, __m128i bit) {
+  return _mm_cmpeq_epi32(_mm_and_si128(v, bit), bit);
+}
+
+inline __m128i LoadWidened(const uint16_t *values) {
+  const __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(values));
+  return _mm_unpacklo_epi16(v, _mm_setzero_si128());
+}
+
+inline void WriteVectorRun(const PixelColorBits &d, int32_t gpio_word,
+                           const uint16_t *red, const uint16_t *green,
+                           const uint16_t *blue,
+                           gpio_bits_t *bitplane_buffer, int plane_stride,
+                           int first_plane, int end_plane) {
+  const __m128i r = LoadWidened(red);
+  const __m128i g = LoadWidened(green);
+  const __m128i b = LoadWidened(blue);
+  const __m128i r_bits = _mm_set1_epi32(d.r_bit);
+  const __m128i g_bits = _mm_set1_epi32(d.g_bit);
+  const __m128i b_bits = _mm_set1_epi32(d.b_bit);
+  const __m128i keep = _mm_set1_epi32(d.mask);
+  gpio_bits_t *bits = bitplane_buffer + gpio_word
+    + plane_stride * first_plane;
+  for (int plane = first_plane; plane < end_plane; ++plane) {
+    const __m128i plane_bit = _mm_set1_epi32(1 << plane);
+    __m128i color = _mm_and_si128(TestBits(r, plane_bit), r_bits);
+    color = _mm_or_si128(color, _mm_and_si128(TestBits(g, plane_bit), g_bits));
+    color = _mm_or_si128(color, _mm_and_si128(TestBits(b, plane_bit), b_bits));
+    __m128i *out = reinterpret_cast<__m128i*>(bits);
+    const __m128i word = _mm_loadu_si128(out);
+    _mm_storeu_si128(out, _mm_or_si128(_mm_and_si128(word, keep), color));
+    bits += plane_stride;
+  }
+}
+#endif
+}  // anonymous namespace
+
+void WriteBitplaneSpan(const int32_t *gpio_words, const uint8_t *color_index,
+                       const PixelColorBits *color_bits, int count,
+                       const uint16_t *red, const uint16_t *green,
+                       const uint16_t *blue,
+                       gpio_bits_t *bitplane_buffer, int plane_stride,
+                       int first_plane, int end_plane) {
+  int i = 0;
+#if defined(BITPLANE_SPAN_NEON) || defined(BITPLANE_SPAN_AVX2) \
+  || defined(BITPLANE_SPAN_SSE2)
+  while (i + kLanes <= count) {
+    if (IsVectorRun(gpio_words + i, color_index + i)) {
+      WriteVectorRun(color_bits[color_index[i]], gpio_words[i],
+                     red + i, green + i, blue + i,
+                     bitplane_buffer, plane_stride, first_plane, end_plane);
+      i += kLanes;
+    } else {
+      WriteScalar(color_bits[color_index[i]], gpio_words[i],
+                  red[i], green[i], blue[i],
+                  bitplane_buffer, plane_stride, first_plane, end_plane);
+      ++i;
+    }
+  }
+#endif
+  for (/**/; i < count; ++i) {
+    WriteScalar(color_bits[color_index[i]], gpio_words[i],
+                red[i], green[i], blue[i],
+                bitplane_buffer, plane_stride, first_plane, end_plane);
+  }
+}
+
+void WriteBitplaneSpan(const int32_t *gpio_words, const uint8_t *color_index,
+                       const PixelColorBits *color_bits, int count,
+                       const uint16_t *red, const uint16_t *green,
+                       const uint16_t *blue,
+                       uint8_t *packed_buffer, int plane_stride,
+                       int first_plane, int end_plane) {
+  for (int i = 0; i < count; ++i) {
+    WriteScalar(color_bits[color_index[i]], gpio_words[i],
+                red[i], green[i], blue[i],
+                packed_buffer, plane_stride, first_plane, end_plane);
+  }
+}
+}  // namespace internal
+}  // namespace rgb_matrix
@@ -0,0 +1,113 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Bulk conversion of pixel spans into the bitplane layout of the Framebuffer.
+#ifndef RPI_RGBMATRIX_BITPLANE_KERNELS_H
+#define RPI_RGBMATRIX_BITPLANE_KERNELS_H
+
+#include <stdint.h>
+
+#include "framebuffer-internal.h"
+
+namespace rgb_matrix {
+namespace internal {
+// Number of pixels converted in one go; callers map colors for up to this
+// many pixels into stack buffers before handing them to WriteBitplaneSpan().
+static constexpr int kBitplaneSpanChunk = 64;
+
+// All bits set if the given plane is set in the mapped color value, 0
+// otherwise.
+inline gpio_bits_t PlaneBitMask(uint16_t value, int plane) {
+  return -(gpio_bits_t)((value >> plane) & 1);
+}
+
+// Write the planes [first_plane, first_plane + kPlanes) of a single pixel
+// with already mapped colors; no branches per plane. kPlanes == 0 takes the
+// number of planes from "plane_count" instead. T is gpio_bits_t, or uint8_t
+// for the packed representation.
+template <int kPlanes, typename T>
+inline void WritePlanes(const PixelColorBits &d, long gpio_word,
+                        uint16_t red, uint16_t green, uint16_t blue,
+                        T *bitplane_buffer, int plane_stride,
+                        int first_plane, int plane_count) {
+  T *bits = bitplane_buffer + gpio_word + (long)plane_stride * first_plane;
+  const gpio_bits_t r_bits = d.r_bit;
+  const gpio_bits_t g_bits = d.g_bit;
+  const gpio_bits_t b_bits = d.b_bit;
+  const T designator_mask = d.mask;
+  const int count = kPlanes > 0 ? kPlanes : plane_count;
+  for (int i = 0; i < count; ++i) {
+    const int plane = first_plane + i;
+    const T color_bits = (PlaneBitMask(red, plane) & r_bits)
+      | (PlaneBitMask(green, plane) & g_bits)
+      | (PlaneBitMask(blue, plane) & b_bits);
+    *bits = (*bits & designator_mask) | color_bits;
+    bits += plane_stride;
+  }
+}
+
+// Write the planes [first_plane, end_plane) of a single pixel. The common
+// numbers of planes get a fully unrolled loop.
+template <typename T>
+inline void WritePixelPlanes(const PixelColorBits &d, long gpio_word,
+                             uint16_t red, uint16_t green, uint16_t blue,
+                             T *bitplane_buffer, int plane_stride,
+                             int first_plane, int end_plane) {
+  switch (end_plane - first_plane) {
+  case 8:
+    WritePlanes<8>(d, gpio_word, red, green, blue, bitplane_buffer,
+                   plane_stride, first_plane, 8);
+    break;
+  case 11:
+    WritePlanes<11>(d, gpio_word, red, green, blue, bitplane_buffer,
+                    plane_stride, first_plane, 11);
+    break;
+  case 16:
+    WritePlanes<16>(d, gpio_word, red, green, blue, bitplane_buffer,
+                    plane_stride, first_plane, 16);
+    break;
+  default:
+    WritePlanes<0>(d, gpio_word, red, green, blue, bitplane_buffer,
+                   plane_stride, first_plane, end_plane - first_plane);
+    break;
+  }
+}
+
+// Write "count" pixels with already mapped colors (see Framebuffer::MapColors)
+// into the bitplane buffer. Pixel i goes to word gpio_words[i] with the
+// bits color_bits[color_index[i]] (see PixelDesignatorMap); the planes
+// [first_plane, end_plane) are written, each plane_stride words apart.
+//
+// Runs of pixels that address consecutive words with the same color
+// bits (the common case without pixel mappers) are written with vector
+// instructions if available; everything else takes the scalar path. Both
+// produce exactly the same result as setting the pixels one by one.
+void WriteBitplaneSpan(const int32_t *gpio_words, const uint8_t *color_index,
+                       const PixelColorBits *color_bits, int count,
+                       const uint16_t *red, const uint16_t *green,
+                       const uint16_t *blue,
+                       gpio_bits_t *bitplane_buffer, int plane_stride,
+                       int first_plane, int end_plane);
+
+// Same for the packed representation; always the scalar path.
+void WriteBitplaneSpan(const int32_t *gpio_words, const uint8_t *color_index,
+                       const PixelColorBits *color_bits, int count,
+                       const uint16_t *red, const uint16_t *green,
+                       const uint16_t *blue,
+                       uint8_t *packed_buffer, int plane_stride,
+                       int first_plane, int end_plane);
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_BITPLANE_KERNELS_H
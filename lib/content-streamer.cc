@@ -15,6 +15,7 @@
 #include <algorithm>
 
 #include "gpio-bits.h"
+#include "trace.h"
 
 namespace rgb_matrix {
 
@@ -32,9 +33,11 @@ struct FileHeader {
   uint32_t buf_size;
   uint32_t width;
   uint32_t height;
-  uint64_t future_use1;
+  uint32_t band_count;  // Bands of buf_size / band_count bytes. 0 in old streams.
+  uint32_t future_use1;
   uint64_t is_wide_gpio : 1;
-  uint64_t flags_future_use : 63;
+  uint64_t is_packed : 1;  // Framebuffer with --led-packed-framebuffer.
+  uint64_t flags_future_use : 62;
 };
 STATIC_ASSERT(file_header_size_changed, sizeof(FileHeader) == 32);
 
@@ -43,8 +46,9 @@ struct FrameHeader {
   uint32_t magic;  // kFrameMagic
   uint32_t size;
   uint32_t hold_time_us;  // How long this frame lasts in usec.
-  uint32_t future_use1;
-  uint64_t future_use2;
+  uint32_t is_delta : 1;  // Only the bands in band_mask follow.
+  uint32_t flags_future_use : 31;
+  uint64_t band_mask;     // Bands of a delta frame, in increasing order.
   uint64_t future_use3;
 };
 STATIC_ASSERT(file_header_size_changed, sizeof(FrameHeader) == 32);
@@ -136,7 +140,8 @@ static bool FullAppend(StreamIO *io, const void *buf, const size_t count) {
   return remaining == 0;
 }
 
-StreamWriter::StreamWriter(StreamIO *io) : io_(io), header_written_(false) {}
+StreamWriter::StreamWriter(StreamIO *io, bool delta_frames)
+  : io_(io), delta_frames_(delta_frames), header_written_(false) {}
 bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   const char *data;
   size_t len;
@@ -147,10 +152,54 @@ bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   }
   FrameHeader h = {};
   h.magic = kFrameMagicValue;
-  h.size = len;
   h.hold_time_us = hold_time_us;
+
+  const int bands = frame.band_count();
+  const size_t band_size = len / bands;
+  uint64_t changed = 0;
+  int changed_count = 0;
+  // The band_mask has room for 64 bands.
+  const bool have_previous = delta_frames_ && bands <= 64
+    && previous_frame_.size() == len;
+  streamed_version_.resize(bands);
+  for (int b = 0; b < bands; ++b) {
+    const size_t offset = b * band_size;
+    // If the band still has the content version we streamed last time,
+    // there is no need to even compare.
+    const bool clean = (frame.dirty_planes(b) == 0);
+    if (!have_previous
+        || !(clean && frame.band_version(b) == streamed_version_[b])) {
+      if (!have_previous
+          || memcmp(&previous_frame_[offset], data + offset, band_size) != 0) {
+        if (b < 64) changed |= 1ULL << b;
+        ++changed_count;
+      }
+    }
+    streamed_version_[b] = clean ? frame.band_version(b) : 0;
+  }
+
+  if (changed_count == bands) {
+    h.size = len;
+    FullAppend(io_, &h, sizeof(h));
+    if (delta_frames_) previous_frame_.assign(data, len);
+    return FullAppend(io_, data, len) == (ssize_t)len;
+  }
+
+  h.size = changed_count * band_size;
+  h.is_delta = 1;
+  h.band_mask = changed;
   FullAppend(io_, &h, sizeof(h));
-  return FullAppend(io_, data, len) == (ssize_t)len;
+  // Write runs of consecutive changed bands in one go.
+  for (int b = 0; b < bands; /**/) {
+    if ((changed & (1ULL << b)) == 0) { ++b; continue; }
+    const int run_start = b;
+    while (b < bands && (changed & (1ULL << b))) ++b;
+    const size_t offset = run_start * band_size;
+    const size_t run_len = (b - run_start) * band_size;
+    previous_frame_.replace(offset, run_len, data + offset, run_len);
+    if (!FullAppend(io_, data + offset, run_len)) return false;
+  }
+  return true;
 }
 
 void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
@@ -159,33 +208,33 @@ void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
   header.width = frame.width();
   header.height = frame.height();
   header.buf_size = len;
+  header.band_count = frame.band_count();
   header.is_wide_gpio = (sizeof(gpio_bits_t) > 4);
+  header.is_packed = frame.is_packed();
   FullAppend(io_, &header, sizeof(header));
   header_written_ = true;
 }
 
 StreamReader::StreamReader(StreamIO *io)
-  : io_(io), state_(STREAM_AT_BEGIN), header_frame_buffer_(NULL) {
+  : io_(io), band_size_(0), band_count_(0), state_(STREAM_AT_BEGIN),
+    frame_buffer_(NULL), have_full_frame_(false) {
   io_->Rewind();
 }
-StreamReader::~StreamReader() { delete [] header_frame_buffer_; }
+StreamReader::~StreamReader() { delete [] frame_buffer_; }
 
 void StreamReader::Rewind() {
   io_->Rewind();
   state_ = STREAM_AT_BEGIN;
+  have_full_frame_ = false;
 }
 
 bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
+  RGB_TRACE_SPAN("StreamReader::GetNext");
   if (state_ == STREAM_AT_BEGIN && !ReadFileHeader(*frame)) return false;
   if (state_ != STREAM_READING) return false;
 
-  // Read header and expected buffer size.
-  if (!FullRead(io_, header_frame_buffer_,
-                sizeof(FrameHeader) + frame_buf_size_)) {
-    return false;
-  }
-
-  const FrameHeader &h = *reinterpret_cast<FrameHeader*>(header_frame_buffer_);
+  FrameHeader h;
+  if (!FullRead(io_, &h, sizeof(h))) return false;
 
   // TODO: we might allow for this to be a kFileMagicValue, to allow people
   // to just concatenate streams. In that case, we just would need to read
@@ -195,15 +244,32 @@ bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
     return false;
   }
 
-  // In the future, we might allow larger buffers (audio?), but never smaller.
-  // For now, we need to make sure to exactly match the size, as our assumption
-  // above is that we can read the full header + frame in one FullRead().
-  if (h.size != frame_buf_size_)
-    return false;
+  if (!h.is_delta) {
+    // In the future, we might allow larger buffers (audio?), but never
+    // smaller. For now, we need to make sure to exactly match the size.
+    if (h.size != frame_buf_size_)
+      return false;
+    if (!FullRead(io_, frame_buffer_, frame_buf_size_))
+      return false;
+    have_full_frame_ = true;
+  } else {
+    // Only the changed bands; patch them into the previous frame.
+    if (!have_full_frame_ || band_size_ == 0
+        || (band_count_ < 64 && (h.band_mask >> band_count_) != 0)
+        || h.size != __builtin_popcountll(h.band_mask) * band_size_) {
+      state_ = STREAM_ERROR;
+      return false;
+    }
+    for (size_t offset = 0; offset < frame_buf_size_; offset += band_size_) {
+      if ((h.band_mask & (1ULL << (offset / band_size_))) == 0) continue;
+      if (!FullRead(io_, frame_buffer_ + offset, band_size_))
+        return false;
+    }
+  }
 
   if (hold_time_us) *hold_time_us = h.hold_time_us;
-  return frame->Deserialize(header_frame_buffer_ + sizeof(FrameHeader),
-                            frame_buf_size_);
+  // Only writes the parts that differ from what the frame has.
+  return frame->Deserialize(frame_buffer_, frame_buf_size_);
 }
 
 bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
@@ -230,10 +296,20 @@ bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
     state_ = STREAM_ERROR;
     return false;
   }
+  if (header.is_packed != frame.is_packed()) {
+    fprintf(stderr, "This stream was written %s --led-packed-framebuffer, "
+            "please use the same setting for replay\n",
+            header.is_packed ? "with" : "without");
+    state_ = STREAM_ERROR;
+    return false;
+  }
   state_ = STREAM_READING;
   frame_buf_size_ = header.buf_size;
-  if (!header_frame_buffer_)
-    header_frame_buffer_ = new char [ sizeof(FrameHeader) + header.buf_size ];
+  // Delta frames can only address 64 bands in their band_mask.
+  band_count_ = (header.band_count <= 64) ? header.band_count : 0;
+  band_size_ = band_count_ ? header.buf_size / band_count_ : 0;
+  if (!frame_buffer_)
+    frame_buffer_ = new char [ header.buf_size ];
   return true;
 }
 // Namespace-scoped helper for canvas-aware compatibility so it can access
@@ -246,6 +322,7 @@ bool StreamIOIsCompatibleWithCanvas(StreamIO* io, FrameCanvas* frame) {
   if (header.magic != kFileMagicValue) { io->Rewind(); return false; }
   if ((int)header.width != frame->width() || (int)header.height != frame->height()) { io->Rewind(); return false; }
   if (header.is_wide_gpio != (sizeof(gpio_bits_t) == 8)) { io->Rewind(); return false; }
+  if (header.is_packed != frame->is_packed()) { io->Rewind(); return false; }
   const char* data = nullptr;
   size_t len = 0;
   frame->Serialize(&data, &len);
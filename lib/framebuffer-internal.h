@@ -27,38 +27,71 @@ namespace rgb_matrix {
 class GPIO;
 class PinPulser;
 namespace internal {
-class RowAddressSetter;
+class CaptureGPIO;
+class OutputBackend;
 
-// An opaque type used within the framebuffer that can be used
-// to copy between PixelMappers.
-struct PixelDesignator {
-  PixelDesignator() : gpio_word(-1), r_bit(0), g_bit(0), b_bit(0), mask(~0u){}
-  long gpio_word;
+// The bits of a GPIO word that carry the colors of a pixel.
+struct PixelColorBits {
+  PixelColorBits() : r_bit(0), g_bit(0), b_bit(0), mask(~0u) {}
   gpio_bits_t r_bit;
   gpio_bits_t g_bit;
   gpio_bits_t b_bit;
-  gpio_bits_t mask;
+  gpio_bits_t mask;   // Bits of the word to keep when writing the pixel.
 };
 
+// Where each pixel lives in the framebuffer. Opaque outside the Framebuffer;
+// the RGBMatrix only copies pixels between maps to apply PixelMappers.
+//
+// Stored as structure of arrays to stay small for large displays: for each
+// pixel a 32 bit word offset and an index into a table of the distinct
+// PixelColorBits, of which there are only a few (6 per parallel chain).
 class PixelDesignatorMap {
 public:
-  PixelDesignatorMap(int width, int height, const PixelDesignator &fill_bits);
-
-  // Get a writable version of the PixelDesignator. Outside Framebuffer used
-  // by the RGBMatrix to re-assign mappings to new PixelDesignatorMappers.
-  PixelDesignator *get(int x, int y);
+  PixelDesignatorMap(int width, int height, const PixelColorBits &fill_bits);
+  // Map with all pixels unused, sharing the color bits of "other" so that
+  // pixels can be copied from it with CopyPixel().
+  PixelDesignatorMap(int width, int height, const PixelDesignatorMap &other);
 
   inline int width() const { return width_; }
   inline int height() const { return height_; }
 
+  // Index of the pixel in gpio_words() and color_index(); -1 if outside
+  // the map. Pixels of a row have consecutive indices.
+  inline int index(int x, int y) const {
+    if (x < 0 || y < 0 || x >= width_ || y >= height_)
+      return -1;
+    return y * width_ + x;
+  }
+
+  // Per pixel: offset of the word (byte in packed mode) in the bitplane
+  // buffer of the first bitplane, or -1 for unused pixels.
+  const int32_t *gpio_words() const { return gpio_words_.data(); }
+  // Per pixel: index into color_bits().
+  const uint8_t *color_index() const { return color_index_.data(); }
+  const PixelColorBits *color_bits() const { return color_bits_.data(); }
+
+  void SetPixel(int x, int y, int32_t gpio_word, const PixelColorBits &bits);
+  // Copy pixel from "other", which needs to be created from this map (or
+  // the other way around).
+  void CopyPixel(int x, int y, const PixelDesignatorMap &other,
+                 int other_x, int other_y);
+  bool IsUsed(int x, int y) const { return gpio_words_[index(x, y)] >= 0; }
+
   // All bits that set red/green/blue pixels; used for Fill().
-  const PixelDesignator &GetFillColorBits() { return fill_bits_; }
+  const PixelColorBits &GetFillColorBits() const { return fill_bits_; }
+
+  // Bytes used by the per-pixel arrays.
+  size_t memory_size() const {
+    return gpio_words_.size() * (sizeof(int32_t) + sizeof(uint8_t));
+  }
 
 private:
   const int width_;
   const int height_;
-  const PixelDesignator fill_bits_;  // Precalculated for fill.
-  std::vector<PixelDesignator> buffer_;
+  const PixelColorBits fill_bits_;  // Precalculated for fill.
+  std::vector<int32_t> gpio_words_;
+  std::vector<uint8_t> color_index_;
+  std::vector<PixelColorBits> color_bits_;
 };
 
 // Internal representation of the frame-buffer that as well can
@@ -67,70 +100,129 @@ private:
 // written out.
 class Framebuffer {
 public:
-  // Maximum usable bitplanes.
+  // Range of bitplanes, chosen per matrix with --led-bit-planes.
   //
   // 11 bits seems to be a sweet spot in which we still get somewhat useful
   // refresh rate and have good color richness. This is the default setting
   // However, in low-light situations, we want to be able to scale down
-  // brightness more, having more bits at the bottom.
-  // TODO(hzeller): make the default 15 bit or so, but slide the use of
-  //  timing to lower bits if fewer bits requested to not affect the overall
-  //  refresh in that case.
-  //  This needs to be balanced to not create too aggressive timing however.
-  //  To be explored in a separate commit.
-  //
-  // For now, if someone needs very low level of light, change this to
-  // say 13 and recompile. Run with --led-pwm-bits=13. Also, consider
+  // brightness more, having more bits at the bottom: for very low level
+  // of light, run with say --led-bit-planes=13. Also, consider
   // --led-pwm-dither-bits=2 to have the refresh rate not suffer too much.
-  static constexpr int kBitPlanes = 11;
+  // Fewer planes use less memory; to just trade color depth for refresh
+  // rate, --led-pwm-bits is sufficient.
+  static constexpr int kMaxBitPlanes = 16;
   static constexpr int kDefaultBitPlanes = 11;
 
-  Framebuffer(int rows, int columns, int parallel,
+  // With "packed", only the color bits are stored: one byte per parallel
+  // chain for each column, expanded to GPIO words on output. All
+  // Framebuffers sharing a PixelDesignatorMap need the same setting.
+  Framebuffer(int rows, int columns, int parallel, int bit_planes,
               int scan_mode,
               const char* led_sequence, bool inverse_color,
-              PixelDesignatorMap **mapper);
+              bool packed, PixelDesignatorMap **mapper);
   ~Framebuffer();
 
   // Initialize GPIO bits for output. Only call once.
   static void InitHardwareMapping(const char *named_hardware);
+  // Pick the OutputBackend for this platform and configuration and
+  // initialize it; "io" is only used by the classic GPIO output.
   static void InitGPIO(GPIO *io, int rows, int parallel,
                        bool allow_hardware_pulsing,
                        int pwm_lsb_nanoseconds,
                        int dither_bits,
                        int row_address_type);
-  static void InitializePanels(GPIO *io, const char *panel_type, int columns);
+  // Instead of the hardware, record the output into "io" (see
+  // gpio-capture.h), e.g. to benchmark the refresh on any machine. Needs
+  // InitHardwareMapping(); replaces any previously initialized output.
+  static void InitCapture(CaptureGPIO *io, int rows, int parallel,
+                          int pwm_lsb_nanoseconds,
+                          int dither_bits,
+                          int row_address_type);
+  static void InitializePanels(const char *panel_type, int columns);
+  // The backend chosen by InitGPIO(); NULL before.
+  static OutputBackend *output_backend() { return output_backend_; }
   // Reset internal static globals so InitGPIO() can re-run with new params.
   static void ResetGlobals();
 
-  // Set PWM bits used for output. Default is 11, but if you only deal with
-  // simple comic-colors, 1 might be sufficient. Lower require less CPU.
+  // Set PWM bits used for output, at most bit_planes(). Default is 11, but
+  // if you only deal with simple comic-colors, 1 might be sufficient. Lower
+  // require less CPU.
   // Returns boolean to signify if value was within range.
   bool SetPWMBits(uint8_t value);
-  uint8_t pwmbits() { return pwm_bits_; }
+  uint8_t pwmbits() const { return pwm_bits_; }
+  int bit_planes() const { return bit_planes_; }
 
   // Map brightness of output linearly to input with CIE1931 profile.
-  void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
+  void set_luminance_correct(bool on);
   bool luminance_correct() const { return do_luminance_correct_; }
 
   // Set brightness in percent; range=1..100
   // This will only affect newly set pixels.
-  void SetBrightness(uint8_t b) {
-    brightness_ = (b <= 100 ? (b != 0 ? b : 1) : 100);
-  }
+  void SetBrightness(uint8_t b);
   uint8_t brightness() { return brightness_; }
 
-  void DumpToMatrix(GPIO *io, int pwm_bits_to_show);
+  void DumpToMatrix(int pwm_bits_to_show);
 
+  // In shadow mode, these work on the RGB content of the shadow buffer: a
+  // shadow that is not converted yet is serialized or copied from in a
+  // separate scratch buffer, and bitplanes loaded into a shadow framebuffer
+  // are converted back to RGB. The bitplanes of a shadow framebuffer might
+  // be on screen, so they are not touched.
   void Serialize(const char **data, size_t *len) const;
   bool Deserialize(const char *data, size_t len);
+  // Only copies the double rows that differ, see band_version().
   void CopyFrom(const Framebuffer *other);
 
+  // -- Change tracking. Writers record which bitplanes of which double row
+  // ("band") they modify. MarkClean() folds these into per-band version
+  // numbers; it is called on swap. CopyFrom() takes over the versions of
+  // the bands it copies if they are clean in the source.
+
+  // Bitplanes of the double row modified since the last MarkClean(), as
+  // bitmask (1 << plane).
+  uint32_t dirty_planes(int double_row) const {
+    return dirty_planes_[double_row];
+  }
+  // Identifies the content of the double row as of the last MarkClean():
+  // framebuffers with the same band_version() have identical content in
+  // that double row, unless it is dirty.
+  uint64_t band_version(int double_row) const {
+    return band_version_[double_row];
+  }
+  // Bitplanes of the double row without any LED on as of the last
+  // MarkClean(), as bitmask (1 << plane); 0 while the double row is dirty.
+  uint32_t empty_planes(int double_row) const {
+    return dirty_planes_[double_row] == 0 ? empty_planes_[double_row] : 0;
+  }
+  // If no LED is on in the bitplanes shown with the current pwmbits(), as
+  // far as known from empty_planes().
+  bool IsDark() const;
+  // Give modified bands a new version and reset the dirty bits. Only
+  // bookkeeping, the content is not changed.
+  void MarkClean() const;
+
+  // -- Shadow mode. Drawing operations only write to a plain RGB buffer,
+  // which is converted into the bitplanes in one pass with ConvertShadow().
+
+  // Switch on shadow mode, or re-size the shadow buffer after the pixel
+  // mapping changed. The shadow buffer starts out black.
+  void EnableShadow();
+  bool has_shadow() const { return !shadow_.empty(); }
+
+  // Convert the shadow buffer into the bitplanes if it has been modified
+  // since the last conversion.
+  void ConvertShadow();
+
   // Canvas-inspired methods, but we're not implementing this interface to not
   // have an unnecessary vtable.
   int width() const;
   int height() const;
   void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
   void SetPixels(int x, int y, int width, int height, Color *colors);
+  // Copy a rectangle of packed RGB (or BGR) pixels, "row_stride" bytes
+  // apart. Large images are converted in parallel on the WorkerPool.
+  void SetImage(int x, int y, int width, int height,
+                const uint8_t *image, size_t row_stride, bool is_bgr);
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
   void SubFill(int x, int y, int width, int height, uint8_t red, uint8_t green, uint8_t blue);
@@ -138,17 +230,26 @@ public:
   const struct HardwareMapping &hardware_mapping() const {
     return *hardware_mapping_;
   }
+  // Microseconds the last bulk conversion in SetImage(), SetPixels() or
+  // ConvertShadow() took.
+  uint32_t conversion_usec() const { return conversion_usec_; }
+
   int columns() const { return columns_; }
   int scan_mode() const { return scan_mode_; }
   int double_rows() const { return double_rows_; }
+  bool packed() const { return packed_buffer_ != NULL; }
+  // GPIO words of the given double row and bitplane, columns() of them.
+  // In packed mode, these are expanded into a buffer that is only valid
+  // until the next call, so this is meant for the one thread doing output.
   const gpio_bits_t *RowDataAt(int double_row, int bit) const {
-    return &bitplane_buffer_[double_row * (columns_ * kBitPlanes)
+    if (packed_buffer_) return ExpandRow(double_row, bit);
+    return &bitplane_buffer_[double_row * (columns_ * bit_planes_)
                              + bit * columns_];
   }
 
 private:
   static const struct HardwareMapping *hardware_mapping_;
-  static RowAddressSetter *row_setter_;
+  static OutputBackend *output_backend_;
 
   // This returns the gpio-bit for given color (one of 'R', 'G', 'B'). This is
   // returning the right value in case "led_sequence" is _not_ "RGB"
@@ -158,13 +259,47 @@ private:
                                             gpio_bits_t default_b);
 
   void InitDefaultDesignator(int x, int y, const char *led_sequence,
-                             PixelDesignator *designator);
+                             PixelDesignatorMap *map);
+  const gpio_bits_t *ExpandRow(int double_row, int bit) const;
+  char *storage() const {
+    return packed_buffer_ ? reinterpret_cast<char*>(packed_buffer_)
+      : reinterpret_cast<char*>(bitplane_buffer_);
+  }
+  // Rebuild color_lut_ after any of the settings it depends on changed.
+  void UpdateColorLookup();
   inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
                          uint16_t *red, uint16_t *green, uint16_t *blue);
+  // Same as MapColors(), but for "count" packed RGB or BGR pixels at once.
+  void MapColorSpan(const uint8_t *pixels, bool is_bgr, int count,
+                    uint16_t *red, uint16_t *green, uint16_t *blue);
+  // Write "count" pixels starting at the given index of the
+  // PixelDesignatorMap.
+  void SetPixelSpan(int map_index, int count,
+                    const uint8_t *pixels, bool is_bgr);
+
+  // Convert an image that is within bounds into the bitplanes, using
+  // multiple threads if worthwhile.
+  void WriteImage(int x, int y, int width, int height,
+                  const uint8_t *image, size_t row_stride, bool is_bgr);
+  // Like WriteImage(), but only touching pixels that land in the double
+  // rows [first_double_row, end_double_row).
+  void WriteImageBand(int x, int y, int width, int height,
+                      const uint8_t *image, size_t row_stride, bool is_bgr,
+                      int first_double_row, int end_double_row);
+  static void WriteImageBandPart(void *arg, int part);  // WorkerPool callback
+
+  // The framebuffer with the bitplanes as ConvertShadow() would leave them:
+  // this one, or if the shadow is not converted yet, a scratch framebuffer
+  // it has been converted into.
+  const Framebuffer *ConvertedContent() const;
+  // Set the shadow buffer to the colors that map to the given bitplanes,
+  // in the layout of storage(), as close as the current settings allow.
+  void ShadowFromBitplanes(const char *bitplanes);
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
   const int columns_;  // Number of columns. Number of chained boards * 32.
+  const int bit_planes_;  // Number of bitplanes stored. 1..kMaxBitPlanes
 
   const int scan_mode_;
   const bool inverse_color_;
@@ -172,8 +307,13 @@ private:
   uint8_t pwm_bits_;   // PWM bits to display.
   bool do_luminance_correct_;
   uint8_t brightness_;
+  // 8 bit channel value to the bits to set in the bitplanes, with
+  // brightness, luminance correction and inversion applied.
+  uint16_t color_lut_[256];
 
   const int double_rows_;
+  const int plane_stride_;    // Elements per bitplane of a double row.
+  const int element_size_;    // Bytes per element of the bitplanes.
   const size_t buffer_size_;
 
   // The frame-buffer is organized in bitplanes.
@@ -182,10 +322,40 @@ private:
   // Each bitplane-column is pre-filled IoBits, of which the colors are set.
   // Of course, that means that we store unrelated bits in the frame-buffer,
   // but it allows easy access in the critical section.
+  //
+  // In packed mode, packed_buffer_ is used instead, with the same layout,
+  // but each column being one byte per parallel chain holding just the
+  // colors bits r1, g1, b1, r2, g2, b2 in bits 0..5.
   gpio_bits_t *bitplane_buffer_;
-  inline gpio_bits_t *ValueAt(int double_row, int column, int bit);
+  uint8_t *packed_buffer_;
+  // Per parallel chain: packed 6 bit value to its bits in the GPIO word.
+  std::vector<gpio_bits_t> expand_lut_;
+  mutable std::vector<gpio_bits_t> expanded_row_;  // See RowDataAt().
+
+  // Double row the given element of the bitplanes belongs to.
+  inline int DoubleRowOf(long gpio_word) const {
+    return (uint64_t)gpio_word * double_row_reciprocal_ >> 44;
+  }
+  // Record the planes written by pixel writes with the current pwm_bits_.
+  inline void MarkWritten(long gpio_word) {
+    dirty_planes_[DoubleRowOf(gpio_word)] |= written_planes_;
+  }
+  uint64_t double_row_reciprocal_;  // 2^44 / band size, rounded up.
+  uint32_t written_planes_;         // Planes bit_planes_ - pwm_bits_ and above.
+  mutable std::vector<uint32_t> dirty_planes_;  // Per double row.
+  mutable std::vector<uint64_t> band_version_;  // Per double row.
+  mutable std::vector<uint32_t> empty_planes_;  // Per double row.
 
   PixelDesignatorMap **shared_mapper_;  // Storage in RGBMatrix.
+
+  // RGB content in shadow mode, shadow_width_ * shadow_height_ pixels.
+  std::vector<Color> shadow_;
+  int shadow_width_;
+  int shadow_height_;
+  bool shadow_dirty_;  // Modified since last ConvertShadow().
+  mutable Framebuffer *shadow_scratch_;  // See ConvertedContent().
+
+  uint32_t conversion_usec_;
 };
 }  // namespace internal
 }  // namespace rgb_matrix
@@ -29,52 +29,89 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
 
+#include "bitplane-kernels.h"
 #include "gpio.h"
+#include "gpio-capture.h"
+#include "output-backend.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "worker-pool.h"
 #include "rp1/rp1_pio_backend.h"
 #include "rp1/rp1_rio_backend.h"
 #include "../include/graphics.h"
 
 namespace rgb_matrix {
 namespace internal {
-// We need one global instance of a timing correct pulser. There are different
-// implementations depending on the context.
-static PinPulser *sOutputEnablePulser = NULL;
-
 #ifdef ONLY_SINGLE_SUB_PANEL
 #  define SUB_PANELS_ 1
 #else
 #  define SUB_PANELS_ 2
 #endif
 
-PixelDesignator *PixelDesignatorMap::get(int x, int y) {
-  if (x < 0 || y < 0 || x >= width_ || y >= height_)
-    return NULL;
-  return &buffer_[(y*width_) + x];
+PixelDesignatorMap::PixelDesignatorMap(int width, int height,
+                                       const PixelColorBits &fill_bits)
+  : width_(width),
+    height_(height),
+    fill_bits_(fill_bits),
+    gpio_words_(width * height, -1),
+    color_index_(width * height, 0),
+    color_bits_(1) {  // Entry 0: the bits of unused pixels.
 }
 
 PixelDesignatorMap::PixelDesignatorMap(int width, int height,
-                                       const PixelDesignator &fill_bits)
+                                       const PixelDesignatorMap &other)
   : width_(width),
     height_(height),
-    fill_bits_(fill_bits),
-    buffer_(width * height) {
+    fill_bits_(other.fill_bits_),
+    gpio_words_(width * height, -1),
+    color_index_(width * height, 0),
+    color_bits_(other.color_bits_) {
+}
+
+void PixelDesignatorMap::SetPixel(int x, int y, int32_t gpio_word,
+                                  const PixelColorBits &bits) {
+  size_t i = 0;
+  while (i < color_bits_.size()
+         && (color_bits_[i].r_bit != bits.r_bit
+             || color_bits_[i].g_bit != bits.g_bit
+             || color_bits_[i].b_bit != bits.b_bit
+             || color_bits_[i].mask != bits.mask)) {
+    ++i;
+  }
+  if (i == color_bits_.size()) {
+    assert(i < 256);
+    color_bits_.push_back(bits);
+  }
+  gpio_words_[index(x, y)] = gpio_word;
+  color_index_[index(x, y)] = i;
+}
+
+void PixelDesignatorMap::CopyPixel(int x, int y,
+                                   const PixelDesignatorMap &other,
+                                   int other_x, int other_y) {
+  gpio_words_[index(x, y)] = other.gpio_words_[other.index(other_x, other_y)];
+  color_index_[index(x, y)] = other.color_index_[other.index(other_x, other_y)];
 }
 
 // Different panel types use different techniques to set the row address.
-// We abstract that away with different implementations of RowAddressSetter
+// We abstract that away with different implementations of RowAddressSetter,
+// for the GPIO or the CaptureGPIO as IO.
+template <typename IO>
 class RowAddressSetter {
 public:
   virtual ~RowAddressSetter() {}
   virtual gpio_bits_t need_bits() const = 0;
-  virtual void SetRowAddress(GPIO *io, int row) = 0;
+  virtual void SetRowAddress(IO *io, int row) = 0;
 };
 
 namespace {
 
 // The default DirectRowAddressSetter just sets the address in parallel
 // output lines ABCDE with A the LSB and E the MSB.
-class DirectRowAddressSetter : public RowAddressSetter {
+template <typename IO>
+class DirectRowAddressSetter : public RowAddressSetter<IO> {
 public:
   DirectRowAddressSetter(int double_rows, const HardwareMapping &h)
     : row_mask_(0), last_row_(-1) {
@@ -98,7 +135,7 @@ public:
 
   virtual gpio_bits_t need_bits() const { return row_mask_; }
 
-  virtual void SetRowAddress(GPIO *io, int row) {
+  virtual void SetRowAddress(IO *io, int row) {
     if (row == last_row_) return;
     io->WriteMaskedBits(row_lookup_[row], row_mask_);
     last_row_ = row;
@@ -120,7 +157,8 @@ private:
 // same time (if they have the same content), but that isn't implemented here.
 // BK, DIN and DCK are the designations on the SM5266P datasheet.
 // BK = Enable Input, DIN = Serial In, DCK = Clock
-class SM5266RowAddressSetter : public RowAddressSetter {
+template <typename IO>
+class SM5266RowAddressSetter : public RowAddressSetter<IO> {
 public:
   SM5266RowAddressSetter(int double_rows, const HardwareMapping &h)
     : row_mask_(h.a | h.b | h.c),
@@ -141,7 +179,7 @@ public:
 
   virtual gpio_bits_t need_bits() const { return row_mask_; }
 
-  virtual void SetRowAddress(GPIO *io, int row) {
+  virtual void SetRowAddress(IO *io, int row) {
     if (row == last_row_) return;
     io->SetBits(bk_);  // Enable serial input for the shifter
     for (int r = 7; r >= 0; r--) {
@@ -170,7 +208,8 @@ private:
   gpio_bits_t row_lookup_[32];
 };
 
-class B707ShiftRegisterRowAddressSetter : public RowAddressSetter {
+template <typename IO>
+class B707ShiftRegisterRowAddressSetter : public RowAddressSetter<IO> {
 public:
   B707ShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
     : row_mask_(h.a | h.b | h.c),
@@ -183,7 +222,7 @@ public:
 
   virtual gpio_bits_t need_bits() const { return row_mask_; }
 
-  virtual void SetRowAddress(GPIO *io, int row) {
+  virtual void SetRowAddress(IO *io, int row) {
     if (row == last_row_) return;
     io->SetBits(bk_);  // Enable serial input for the shifter
     if (row == 0) {
@@ -207,7 +246,8 @@ private:
 };
 
 
-class ShiftRegisterRowAddressSetter : public RowAddressSetter {
+template <typename IO>
+class ShiftRegisterRowAddressSetter : public RowAddressSetter<IO> {
 public:
   ShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
     : double_rows_(double_rows),
@@ -216,7 +256,7 @@ public:
   }
   virtual gpio_bits_t need_bits() const { return row_mask_; }
 
-  virtual void SetRowAddress(GPIO *io, int row) {
+  virtual void SetRowAddress(IO *io, int row) {
     if (row == last_row_) return;
     for (int activate = 0; activate < double_rows_; ++activate) {
       io->ClearBits(clock_);
@@ -243,7 +283,8 @@ private:
 // Issue #823
 // An shift register row address setter that does not use B but C for the
 // data. Clock is inverted.
-class ABCShiftRegisterRowAddressSetter : public RowAddressSetter {
+template <typename IO>
+class ABCShiftRegisterRowAddressSetter : public RowAddressSetter<IO> {
 public:
   ABCShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
     : double_rows_(double_rows),
@@ -254,7 +295,7 @@ public:
   }
   virtual gpio_bits_t need_bits() const { return row_mask_; }
 
-  virtual void SetRowAddress(GPIO *io, int row) {
+  virtual void SetRowAddress(IO *io, int row) {
     for (int activate = 0; activate < double_rows_; ++activate) {
       io->ClearBits(clock_);
       if (activate == double_rows_ - 1 - row) {
@@ -288,7 +329,8 @@ private:
 // Line B  | 1 | 0 | 1 | 1
 // Line C  | 1 | 1 | 0 | 1
 // Line D  | 1 | 1 | 1 | 0
-class DirectABCDLineRowAddressSetter : public RowAddressSetter {
+template <typename IO>
+class DirectABCDLineRowAddressSetter : public RowAddressSetter<IO> {
 public:
   DirectABCDLineRowAddressSetter(int double_rows, const HardwareMapping &h)
     : last_row_(-1) {
@@ -302,7 +344,7 @@ public:
 
   virtual gpio_bits_t need_bits() const { return row_mask_; }
 
-  virtual void SetRowAddress(GPIO *io, int row) {
+  virtual void SetRowAddress(IO *io, int row) {
     if (row == last_row_) return;
 
     gpio_bits_t row_address = row_lines_[row % 4];
@@ -319,23 +361,52 @@ private:
 
 }
 
+// Bits of the color pins in a packed byte: r1, g1, b1, r2, g2, b2.
+static const gpio_bits_t kPackedColorPins[6] = { 1, 2, 4, 8, 16, 32 };
+
+// The color pins of the given parallel chain in the same order.
+static void GetChainColorPins(const HardwareMapping &h, int chain,
+                              gpio_bits_t pins[6]) {
+  const gpio_bits_t all_pins[6][6] = {
+    { h.p0_r1, h.p0_g1, h.p0_b1, h.p0_r2, h.p0_g2, h.p0_b2 },
+    { h.p1_r1, h.p1_g1, h.p1_b1, h.p1_r2, h.p1_g2, h.p1_b2 },
+    { h.p2_r1, h.p2_g1, h.p2_b1, h.p2_r2, h.p2_g2, h.p2_b2 },
+    { h.p3_r1, h.p3_g1, h.p3_b1, h.p3_r2, h.p3_g2, h.p3_b2 },
+    { h.p4_r1, h.p4_g1, h.p4_b1, h.p4_r2, h.p4_g2, h.p4_b2 },
+    { h.p5_r1, h.p5_g1, h.p5_b1, h.p5_r2, h.p5_g2, h.p5_b2 },
+  };
+  memcpy(pins, all_pins[chain], sizeof(all_pins[chain]));
+}
+
 const struct HardwareMapping *Framebuffer::hardware_mapping_ = NULL;
-RowAddressSetter *Framebuffer::row_setter_ = NULL;
+OutputBackend *Framebuffer::output_backend_ = NULL;
 
 Framebuffer::Framebuffer(int rows, int columns, int parallel,
-                         int scan_mode,
+                         int bit_planes, int scan_mode,
                          const char *led_sequence, bool inverse_color,
-                         PixelDesignatorMap **mapper)
+                         bool packed, PixelDesignatorMap **mapper)
   : rows_(rows),
     parallel_(parallel),
     height_(rows * parallel),
     columns_(columns),
+    bit_planes_(bit_planes),
     scan_mode_(scan_mode),
     inverse_color_(inverse_color),
-    pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
+    pwm_bits_(bit_planes), do_luminance_correct_(true), brightness_(100),
     double_rows_(rows / SUB_PANELS_),
-    buffer_size_(double_rows_ * columns_ * kBitPlanes * sizeof(gpio_bits_t)),
-    shared_mapper_(mapper) {
+    plane_stride_(packed ? columns * parallel : columns),
+    element_size_(packed ? sizeof(uint8_t) : sizeof(gpio_bits_t)),
+    buffer_size_(double_rows_ * plane_stride_ * bit_planes_ * element_size_),
+    bitplane_buffer_(NULL), packed_buffer_(NULL),
+    double_row_reciprocal_(((1ULL << 44) + plane_stride_ * bit_planes_ - 1)
+                           / (plane_stride_ * bit_planes_)),
+    written_planes_(0),
+    dirty_planes_(double_rows_, (1 << bit_planes_) - 1),
+    band_version_(double_rows_, 0),
+    empty_planes_(double_rows_, 0),
+    shared_mapper_(mapper),
+    shadow_width_(0), shadow_height_(0), shadow_dirty_(false),
+    shadow_scratch_(NULL), conversion_usec_(0) {
   assert(hardware_mapping_ != NULL);   // Called InitHardwareMapping() ?
   assert(shared_mapper_ != NULL);  // Storage should be provided by RGBMatrix.
   assert(rows_ >=4 && rows_ <= 64 && rows_ % 2 == 0);
@@ -347,8 +418,30 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     abort();
   }
   assert(parallel >= 1 && parallel <= 6);
+  assert(bit_planes >= 1 && bit_planes <= kMaxBitPlanes);
+  // Keeps DoubleRowOf() exact for all words of the buffer.
+  assert(plane_stride_ * bit_planes_ < (1 << 19));
+  SetPWMBits(pwm_bits_);  // Also sets up the color_lut_.
 
-  bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * kBitPlanes];
+  const struct HardwareMapping &h = *hardware_mapping_;
+  if (packed) {
+    packed_buffer_ = new uint8_t[double_rows_ * plane_stride_ * bit_planes_];
+    expanded_row_.resize(columns_);
+    expand_lut_.resize(parallel_ * 64);
+    for (int chain = 0; chain < parallel_; ++chain) {
+      gpio_bits_t pins[6];
+      GetChainColorPins(h, chain, pins);
+      for (int value = 0; value < 64; ++value) {
+        gpio_bits_t word = 0;
+        for (int i = 0; i < 6; ++i) {
+          if (value & (1 << i)) word |= pins[i];
+        }
+        expand_lut_[chain * 64 + value] = word;
+      }
+    }
+  } else {
+    bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * bit_planes_];
+  }
 
   // If we're the first Framebuffer created, the shared PixelMapper is
   // still NULL, so create one.
@@ -361,11 +454,15 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   if (*shared_mapper_ == NULL) {
     // Gather all the bits for given color for fast Fill()s and use the right
     // bits according to the led sequence
-    const struct HardwareMapping &h = *hardware_mapping_;
     gpio_bits_t r = h.p0_r1 | h.p0_r2 | h.p1_r1 | h.p1_r2 | h.p2_r1 | h.p2_r2 | h.p3_r1 | h.p3_r2 | h.p4_r1 | h.p4_r2 | h.p5_r1 | h.p5_r2;
     gpio_bits_t g = h.p0_g1 | h.p0_g2 | h.p1_g1 | h.p1_g2 | h.p2_g1 | h.p2_g2 | h.p3_g1 | h.p3_g2 | h.p4_g1 | h.p4_g2 | h.p5_g1 | h.p5_g2;
     gpio_bits_t b = h.p0_b1 | h.p0_b2 | h.p1_b1 | h.p1_b2 | h.p2_b1 | h.p2_b2 | h.p3_b1 | h.p3_b2 | h.p4_b1 | h.p4_b2 | h.p5_b1 | h.p5_b2;
-    PixelDesignator fill_bits;
+    if (packed) {
+      r = kPackedColorPins[0] | kPackedColorPins[3];
+      g = kPackedColorPins[1] | kPackedColorPins[4];
+      b = kPackedColorPins[2] | kPackedColorPins[5];
+    }
+    PixelColorBits fill_bits;
     fill_bits.r_bit = GetGpioFromLedSequence('R', led_sequence, r, g, b);
     fill_bits.g_bit = GetGpioFromLedSequence('G', led_sequence, r, g, b);
     fill_bits.b_bit = GetGpioFromLedSequence('B', led_sequence, r, g, b);
@@ -373,7 +470,7 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     *shared_mapper_ = new PixelDesignatorMap(columns_, height_, fill_bits);
     for (int y = 0; y < height_; ++y) {
       for (int x = 0; x < columns_; ++x) {
-        InitDefaultDesignator(x, y, led_sequence, (*shared_mapper_)->get(x, y));
+        InitDefaultDesignator(x, y, led_sequence, *shared_mapper_);
       }
     }
   }
@@ -383,6 +480,8 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
 
 Framebuffer::~Framebuffer() {
   delete [] bitplane_buffer_;
+  delete [] packed_buffer_;
+  delete shadow_scratch_;
 }
 
 // TODO: this should also be parsed from some special formatted string, e.g.
@@ -430,102 +529,12 @@ Framebuffer::~Framebuffer() {
   hardware_mapping_ = mapping;
 }
 
-/* static */ void Framebuffer::InitGPIO(GPIO *io, int rows, int parallel,
-                                        bool allow_hardware_pulsing,
-                                        int pwm_lsb_nanoseconds,
-                                        int dither_bits,
-                                        int row_address_type) {
-  if (sOutputEnablePulser != NULL)
-    return;  // already initialized.
-
-  const struct HardwareMapping &h = *hardware_mapping_;
-  const int double_rows = rows / SUB_PANELS_;
-
-  if (Rp1RioShouldActivate(h.name, row_address_type, parallel)) {
-    Rp1RioInitOrDie(h, double_rows, parallel, pwm_lsb_nanoseconds, dither_bits,
-                    row_address_type);
-    return;
-  }
-
-  if (Rp1PioShouldActivate(h.name, row_address_type, parallel)) {
-    Rp1PioInitOrDie(h, double_rows, parallel, pwm_lsb_nanoseconds, dither_bits,
-                    row_address_type);
-    return;
-  }
-
-  // Tell GPIO about all bits we intend to use.
-  gpio_bits_t all_used_bits = 0;
-
-  all_used_bits |= h.output_enable | h.clock | h.strobe;
-
-  all_used_bits |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
-  if (parallel >= 2) {
-    all_used_bits |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
-  }
-  if (parallel >= 3) {
-    all_used_bits |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
-  }
-  if (parallel >= 4) {
-    all_used_bits |= h.p3_r1 | h.p3_g1 | h.p3_b1 | h.p3_r2 | h.p3_g2 | h.p3_b2;
-  }
-  if (parallel >= 5) {
-    all_used_bits |= h.p4_r1 | h.p4_g1 | h.p4_b1 | h.p4_r2 | h.p4_g2 | h.p4_b2;
-  }
-  if (parallel >= 6) {
-    all_used_bits |= h.p5_r1 | h.p5_g1 | h.p5_b1 | h.p5_r2 | h.p5_g2 | h.p5_b2;
-  }
-
-  switch (row_address_type) {
-  case 0:
-    row_setter_ = new DirectRowAddressSetter(double_rows, h);
-    break;
-  case 1:
-    row_setter_ = new ShiftRegisterRowAddressSetter(double_rows, h);
-    break;
-  case 2:
-    row_setter_ = new DirectABCDLineRowAddressSetter(double_rows, h);
-    break;
-  case 3:
-    row_setter_ = new ABCShiftRegisterRowAddressSetter(double_rows, h);
-    break;
-  case 4:
-    row_setter_ = new SM5266RowAddressSetter(double_rows, h);
-    break;
-  case 5:
-    row_setter_ = new B707ShiftRegisterRowAddressSetter(double_rows, h);
-    break;
-
-
-  default:
-    assert(0);  // unexpected type.
-  }
-
-  all_used_bits |= row_setter_->need_bits();
-
-  // Adafruit HAT identified by the same prefix.
-  const bool is_some_adafruit_hat = (0 == strncmp(h.name, "adafruit-hat",
-                                                  strlen("adafruit-hat")));
-  // Initialize outputs, make sure that all of these are supported bits.
-  const gpio_bits_t result = io->InitOutputs(all_used_bits,
-                                             is_some_adafruit_hat);
-  assert(result == all_used_bits);  // Impl: all bits declared in gpio.cc ?
-
-  std::vector<int> bitplane_timings;
-  uint32_t timing_ns = pwm_lsb_nanoseconds;
-  for (int b = 0; b < kBitPlanes; ++b) {
-    bitplane_timings.push_back(timing_ns);
-    if (b >= dither_bits) timing_ns *= 2;
-  }
-  sOutputEnablePulser = PinPulser::Create(io, h.output_enable,
-                                          allow_hardware_pulsing,
-                                          bitplane_timings);
-}
-
 // NOTE: first version for panel initialization sequence, need to refine
 // until it is more clear how different panel types are initialized to be
 // able to abstract this more.
 
-static void InitFM6126(GPIO *io, const struct HardwareMapping &h, int columns) {
+template <typename IO>
+static void InitFM6126(IO *io, const struct HardwareMapping &h, int columns) {
   const gpio_bits_t bits_on
     = h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2
     | h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2
@@ -565,7 +574,8 @@ static void InitFM6126(GPIO *io, const struct HardwareMapping &h, int columns) {
 
 // The FM6217 is very similar to the FM6216.
 // FM6217 adds Register 3 to allow for automatic bad pixel suppression.
-static void InitFM6127(GPIO *io, const struct HardwareMapping &h, int columns) {
+template <typename IO>
+static void InitFM6127(IO *io, const struct HardwareMapping &h, int columns) {
   const gpio_bits_t bits_r_on= h.p0_r1 | h.p0_r2;
   const gpio_bits_t bits_g_on= h.p0_g1 | h.p0_g2;
   const gpio_bits_t bits_b_on= h.p0_b1 | h.p0_b2;
@@ -606,123 +616,541 @@ static void InitFM6127(GPIO *io, const struct HardwareMapping &h, int columns) {
   io->ClearBits(h.strobe);
 }
 
-/*static*/ void Framebuffer::InitializePanels(GPIO *io,
-                                              const char *panel_type,
-                                              int columns) {
-  if (!panel_type || panel_type[0] == '\0') return;
-  if (Rp1RioIsActive()) {
-    Rp1RioInitializePanels(*hardware_mapping_, panel_type, columns);
-    return;
+namespace {
+// The parts that differ between writing to the hardware and capturing.
+static PinPulser *CreatePulser(GPIO *io, gpio_bits_t pin,
+                               bool allow_hardware_pulsing,
+                               const std::vector<int> &nano_wait_spec) {
+  return PinPulser::Create(io, pin, allow_hardware_pulsing, nano_wait_spec);
+}
+static PinPulser *CreatePulser(CaptureGPIO *io, gpio_bits_t pin,
+                               bool allow_hardware_pulsing,
+                               const std::vector<int> &nano_wait_spec) {
+  return io->CreatePulser(nano_wait_spec);
+}
+static bool IsHardware(const GPIO *io) { return true; }
+static bool IsHardware(const CaptureGPIO *io) { return false; }
+static int FixedSlowdown(const GPIO *io) { return io->slowdown(); }
+static int FixedSlowdown(const CaptureGPIO *io) {
+  return GPIO::kRuntimeSlowdown;
+}
+
+// The classic output: the GPIO registers are written directly, with the
+// on-time of each bitplane timed by a PinPulser. With the CaptureGPIO as
+// IO, the same sequence of writes is recorded instead.
+template <typename IO>
+class GPIOOutputBackend : public OutputBackend {
+public:
+  GPIOOutputBackend(IO *io, const HardwareMapping &h,
+                    int double_rows, int parallel,
+                    bool allow_hardware_pulsing, int pwm_lsb_nanoseconds,
+                    int dither_bits, int row_address_type)
+    : io_(io), h_(h), row_setter_(NULL), pulser_(NULL), color_clk_mask_(0),
+      play_(NULL), skip_empty_planes_(false), sampled_row_(0) {
+    color_clk_mask_ |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
+    if (parallel >= 2) {
+      color_clk_mask_ |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
+    }
+    if (parallel >= 3) {
+      color_clk_mask_ |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
+    }
+    if (parallel >= 4) {
+      color_clk_mask_ |= h.p3_r1 | h.p3_g1 | h.p3_b1 | h.p3_r2 | h.p3_g2 | h.p3_b2;
+    }
+    if (parallel >= 5) {
+      color_clk_mask_ |= h.p4_r1 | h.p4_g1 | h.p4_b1 | h.p4_r2 | h.p4_g2 | h.p4_b2;
+    }
+    if (parallel >= 6) {
+      color_clk_mask_ |= h.p5_r1 | h.p5_g1 | h.p5_b1 | h.p5_r2 | h.p5_g2 | h.p5_b2;
+    }
+    color_clk_mask_ |= h.clock;
+
+    switch (row_address_type) {
+    case 0:
+      row_setter_ = new DirectRowAddressSetter<IO>(double_rows, h);
+      break;
+    case 1:
+      row_setter_ = new ShiftRegisterRowAddressSetter<IO>(double_rows, h);
+      break;
+    case 2:
+      row_setter_ = new DirectABCDLineRowAddressSetter<IO>(double_rows, h);
+      break;
+    case 3:
+      row_setter_ = new ABCShiftRegisterRowAddressSetter<IO>(double_rows, h);
+      break;
+    case 4:
+      row_setter_ = new SM5266RowAddressSetter<IO>(double_rows, h);
+      break;
+    case 5:
+      row_setter_ = new B707ShiftRegisterRowAddressSetter<IO>(double_rows, h);
+      break;
+
+
+    default:
+      assert(0);  // unexpected type.
+    }
+
+    // Tell GPIO about all bits we intend to use.
+    const gpio_bits_t all_used_bits = color_clk_mask_
+      | h.output_enable | h.strobe | row_setter_->need_bits();
+
+    // Adafruit HAT identified by the same prefix.
+    const bool is_some_adafruit_hat = (0 == strncmp(h.name, "adafruit-hat",
+                                                    strlen("adafruit-hat")));
+    // Initialize outputs, make sure that all of these are supported bits.
+    const gpio_bits_t result = io->InitOutputs(all_used_bits,
+                                               is_some_adafruit_hat);
+    assert(result == all_used_bits);  // Impl: all bits declared in gpio.cc ?
+
+#ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
+    play_ = ((all_used_bits >> 32) != 0)
+      ? ChoosePlayback<true>(FixedSlowdown(io))
+      : ChoosePlayback<false>(FixedSlowdown(io));
+#else
+    play_ = ChoosePlayback<false>(FixedSlowdown(io));
+#endif
+
+    std::vector<int> bitplane_timings;
+    uint32_t timing_ns = pwm_lsb_nanoseconds;
+    for (int b = 0; b < Framebuffer::kMaxBitPlanes; ++b) {
+      bitplane_timings.push_back(timing_ns);
+      if (b >= dither_bits) timing_ns *= 2;
+    }
+    pulser_ = CreatePulser(io, h.output_enable, allow_hardware_pulsing,
+                           bitplane_timings);
   }
-  if (Rp1PioIsActive()) {
-    Rp1PioInitializePanels(*hardware_mapping_, panel_type, columns);
-    return;
+
+  virtual ~GPIOOutputBackend() {
+    delete pulser_;
+    delete row_setter_;
+  }
+
+  virtual void InitializePanels(const char *panel_type, int columns) {
+    if (strncasecmp(panel_type, "fm6126", 6) == 0) {
+      InitFM6126(io_, h_, columns);
+    }
+    else if (strncasecmp(panel_type, "fm6127", 6) == 0) {
+      InitFM6127(io_, h_, columns);
+    }
+    // else if (strncasecmp(...))  // more init types
+    else {
+      fprintf(stderr, "Unknown panel type '%s'; typo ?\n", panel_type);
+    }
+  }
+
+  virtual void DumpFramebuffer(const Framebuffer *framebuffer,
+                               int pwm_low_bit) {
+    // Depending if we do dithering, we might not always show the lowest bits.
+    const int bit_planes = framebuffer->bit_planes();
+    const int start_bit = std::max(pwm_low_bit,
+                                   bit_planes - framebuffer->pwmbits());
+    OutputProgram &program = programs_[start_bit];
+    if (!IsUpToDate(program, framebuffer)) {
+      UpdateProgram(framebuffer, start_bit, &program);
+    }
+
+    (this->*play_)(framebuffer, program, start_bit);
+  }
+
+  virtual void SetSkipEmptyPlanes(bool skip) { skip_empty_planes_ = skip; }
+
+  virtual bool ExposesGPIO() const { return IsHardware(io_); }
+
+private:
+  // The register writes of one column: the bits to clear, which includes
+  // the clock, and the bits to set before the rising clock edge.
+  struct ColumnWrite {
+    gpio_bits_t clear;
+    gpio_bits_t set;
+  };
+
+  // The frame compiled into the writes it takes to show it, so a refresh
+  // only has to play them back. Kept per start bit, as dithering alternates
+  // between start bits; double rows are only compiled again once their
+  // content changed. Rows that are still being drawn on are not compiled,
+  // but sent from the framebuffer directly.
+  struct OutputProgram {
+    OutputProgram() : columns(0), bit_planes(0), scan_mode(-1) {}
+
+    // Layout the program was compiled for.
+    int columns;
+    int bit_planes;
+    int scan_mode;
+
+    // Per row_loop, plane and column in the order they are sent.
+    std::vector<ColumnWrite> writes;
+    // Per row_loop, the double row shown.
+    std::vector<uint8_t> display_row;
+    // Per row_loop, Framebuffer::empty_planes() of the compiled content.
+    std::vector<uint32_t> empty_planes;
+    // Per double row, Framebuffer::band_version() of the compiled content;
+    // 0 if the row is not compiled, as it is being drawn on.
+    std::vector<uint64_t> band_version;
+  };
+
+  static int DisplayRowFromLoop(int row_loop, int double_rows, int scan_mode) {
+    switch (scan_mode) {
+    case 0:  // progressive
+    default:
+      return row_loop;
+
+    case 1: {  // interlaced
+      const int half_double = double_rows / 2;
+      return ((row_loop < half_double)
+              ? (row_loop << 1)
+              : ((row_loop - half_double) << 1) + 1);
+    }
+    }
+  }
+
+  // Version of the double row to remember once compiled. Rows that are being
+  // drawn on have none until the next MarkClean(); compiling them would be
+  // wasted on every refresh, so they are sent from the framebuffer instead.
+  static uint64_t CompilableVersion(const Framebuffer *framebuffer, int row) {
+    return framebuffer->dirty_planes(row) == 0
+      ? framebuffer->band_version(row) : 0;
+  }
+
+  static bool SameLayout(const OutputProgram &program,
+                         const Framebuffer *framebuffer) {
+    return program.columns == framebuffer->columns()
+      && program.bit_planes == framebuffer->bit_planes()
+      && program.scan_mode == framebuffer->scan_mode()
+      && (int)program.band_version.size() == framebuffer->double_rows();
+  }
+
+  static bool IsUpToDate(const OutputProgram &program,
+                         const Framebuffer *framebuffer) {
+    if (!SameLayout(program, framebuffer)) return false;
+    for (int row = 0; row < framebuffer->double_rows(); ++row) {
+      if (CompilableVersion(framebuffer, row) != program.band_version[row])
+        return false;
+    }
+    return true;
   }
-  if (strncasecmp(panel_type, "fm6126", 6) == 0) {
-    InitFM6126(io, *hardware_mapping_, columns);
+
+  // Bring "program" up to date with the framebuffer content. Every plane of
+  // every row has the same number of writes, so changed rows are compiled
+  // in place.
+  void UpdateProgram(const Framebuffer *framebuffer, int start_bit,
+                     OutputProgram *program) const {
+    RGB_TRACE_SPAN("UpdateProgram");
+    const int bit_planes = framebuffer->bit_planes();
+    const int double_rows = framebuffer->double_rows();
+    const int columns = framebuffer->columns();
+    const int scan_mode = framebuffer->scan_mode();
+    const int plane_count = bit_planes - start_bit;
+
+    if (!SameLayout(*program, framebuffer)) {
+      program->columns = columns;
+      program->bit_planes = bit_planes;
+      program->scan_mode = scan_mode;
+      program->writes.resize((size_t)double_rows * plane_count * columns);
+      program->display_row.resize(double_rows);
+      program->empty_planes.resize(double_rows);
+      program->band_version.assign(double_rows, 0);
+      for (int row_loop = 0; row_loop < double_rows; ++row_loop) {
+        program->display_row[row_loop] =
+          DisplayRowFromLoop(row_loop, double_rows, scan_mode);
+      }
+    }
+
+    for (int row_loop = 0; row_loop < double_rows; ++row_loop) {
+      const int d_row = program->display_row[row_loop];
+      const uint64_t version = CompilableVersion(framebuffer, d_row);
+      if (version == program->band_version[d_row]) continue;
+      program->band_version[d_row] = version;
+      if (version == 0) {  // Played from the framebuffer.
+        program->empty_planes[row_loop] = 0;
+        continue;
+      }
+      ColumnWrite *write =
+        &program->writes[(size_t)row_loop * plane_count * columns];
+      for (int b = start_bit; b < bit_planes; ++b) {
+        const gpio_bits_t *row_data = framebuffer->RowDataAt(d_row, b);
+        // The first column is written in full, as the pins are not known
+        // after panel init. After that, only the bits that change from the
+        // previous column are written, so a run of equal columns, common in
+        // dark or flat content, costs just the clock edges.
+        gpio_bits_t current = 0;
+        for (int col = 0; col < columns; ++col, ++write) {
+          const gpio_bits_t out = row_data[col] & color_clk_mask_;
+          if (col == 0) {
+            write->clear = ~out & color_clk_mask_;
+            write->set = out;
+          } else {
+            write->clear = ~out & current;
+            write->set = out & ~current;
+          }
+          current = out | h_.clock;
+        }
+      }
+      program->empty_planes[row_loop] = framebuffer->empty_planes(d_row);
+    }
   }
-  else if (strncasecmp(panel_type, "fm6127", 6) == 0) {
-    InitFM6127(io, *hardware_mapping_, columns);
+
+  typedef void (GPIOOutputBackend::*PlayFunction)(
+    const Framebuffer *framebuffer, const OutputProgram &program,
+    int start_bit);
+
+  // Clock in one plane of a row that is not compiled, straight from the
+  // framebuffer. Same writes as UpdateProgram() would compile.
+  template <int kSlowdown, bool kWide>
+  void ClockInRowData(const gpio_bits_t *row_data, int columns) {
+    gpio_bits_t out = row_data[0] & color_clk_mask_;
+    io_->template WriteClearSetBits<kSlowdown, kWide>(~out & color_clk_mask_,
+                                                     out);
+    io_->template SetBits<kSlowdown, kWide>(h_.clock);
+    for (int col = 1; col < columns; ++col) {
+      const gpio_bits_t current = out | h_.clock;
+      out = row_data[col] & color_clk_mask_;
+      io_->template WriteClearSetBits<kSlowdown, kWide>(~out & current,
+                                                       out & ~current);
+      io_->template SetBits<kSlowdown, kWide>(h_.clock);
+    }
   }
-  // else if (strncasecmp(...))  // more init types
-  else {
-    fprintf(stderr, "Unknown panel type '%s'; typo ?\n", panel_type);
+
+  // Play back "program", with the slowdown and GPIO width of the IO fixed at
+  // compile time, so the loop over the columns has nothing left to decide.
+  template <int kSlowdown, bool kWide>
+  void PlayProgram(const Framebuffer *framebuffer,
+                   const OutputProgram &program, int start_bit) {
+    const int bit_planes = program.bit_planes;
+    const int columns = program.columns;
+    const ColumnWrite *write = &program.writes[0];
+    // Timing every plane would cost more than it tells; one row per
+    // refresh, taking turns, is enough for the telemetry.
+    TelemetryHistogram *const clock_in = &TelemetryBlock()->clock_in;
+    sampled_row_ = (sampled_row_ + 1) % program.display_row.size();
+    for (size_t row_loop = 0; row_loop < program.display_row.size();
+         ++row_loop) {
+      const int d_row = program.display_row[row_loop];
+      const bool compiled = (program.band_version[d_row] != 0);
+      const bool sampled = (row_loop == sampled_row_);
+      RGB_TRACE_SPAN_ARG("row", d_row);
+      const uint32_t skipped_planes =
+        skip_empty_planes_ ? program.empty_planes[row_loop] : 0;
+      // Rows can't be switched very quickly without ghosting, so we do the
+      // full PWM of one row before switching rows.
+      for (int b = start_bit; b < bit_planes; ++b) {
+        if (skipped_planes & (1u << b)) {
+          // Nothing to show: no clocking, no strobe and no pulse.
+          write += columns;
+          continue;
+        }
+        // While the output enable is still on, we can already clock in the
+        // next data.
+        const uint32_t clock_in_start = sampled ? GetMicrosecondCounter() : 0;
+        {
+          RGB_TRACE_SPAN_ARG("clock in", b);
+          if (compiled) {
+            for (int col = 0; col < columns; ++col, ++write) {
+              // col + reset clock
+              io_->template WriteClearSetBits<kSlowdown, kWide>(write->clear,
+                                                               write->set);
+              // Rising edge: clock color in.
+              io_->template SetBits<kSlowdown, kWide>(h_.clock);
+            }
+          } else {
+            ClockInRowData<kSlowdown, kWide>(framebuffer->RowDataAt(d_row, b),
+                                             columns);
+            write += columns;
+          }
+          io_->ClearBits(color_clk_mask_);    // clock back to normal.
+        }
+        if (sampled) {
+          TelemetryRecord(clock_in, GetMicrosecondCounter() - clock_in_start);
+        }
+
+        // OE of the previous row-data must be finished before strobe.
+        {
+          RGB_TRACE_SPAN_ARG("pulse wait", b);
+          pulser_->WaitPulseFinished();
+        }
+
+        // Setting address and strobing needs to happen in dark time.
+        row_setter_->SetRowAddress(io_, d_row);
+
+        io_->SetBits(h_.strobe);   // Strobe in the previously clocked in row.
+        io_->ClearBits(h_.strobe);
+
+        // Now switch on for the sleep time necessary for that bit-plane.
+        pulser_->SendPulse(b);
+      }
+    }
+  }
+
+  // Slowdowns beyond what is instantiated here use the one of the IO.
+  template <bool kWide>
+  static PlayFunction ChoosePlayback(int slowdown) {
+    switch (slowdown) {
+    case -1: return &GPIOOutputBackend::PlayProgram<-1, kWide>;
+    case 0: return &GPIOOutputBackend::PlayProgram<0, kWide>;
+    case 1: return &GPIOOutputBackend::PlayProgram<1, kWide>;
+    case 2: return &GPIOOutputBackend::PlayProgram<2, kWide>;
+    case 3: return &GPIOOutputBackend::PlayProgram<3, kWide>;
+    case 4: return &GPIOOutputBackend::PlayProgram<4, kWide>;
+    default:
+      return &GPIOOutputBackend::PlayProgram<GPIO::kRuntimeSlowdown, kWide>;
+    }
+  }
+
+  IO *const io_;
+  const HardwareMapping &h_;
+  RowAddressSetter<IO> *row_setter_;
+  PinPulser *pulser_;
+  gpio_bits_t color_clk_mask_;  // Mask of bits while clocking in.
+  OutputProgram programs_[Framebuffer::kMaxBitPlanes];
+  PlayFunction play_;
+  bool skip_empty_planes_;
+  size_t sampled_row_;  // Row whose clock-in is timed for the telemetry.
+};
+}  // anonymous namespace
+
+/* static */ void Framebuffer::InitGPIO(GPIO *io, int rows, int parallel,
+                                        bool allow_hardware_pulsing,
+                                        int pwm_lsb_nanoseconds,
+                                        int dither_bits,
+                                        int row_address_type) {
+  if (output_backend_ != NULL)
+    return;  // already initialized.
+
+  const struct HardwareMapping &h = *hardware_mapping_;
+  const int double_rows = rows / SUB_PANELS_;
+
+  if (Rp1RioShouldActivate(h.name, row_address_type, parallel)) {
+    output_backend_ = Rp1RioCreateOutputBackend(h, double_rows, parallel,
+                                                pwm_lsb_nanoseconds,
+                                                dither_bits, row_address_type);
+  } else if (Rp1PioShouldActivate(h.name, row_address_type, parallel)) {
+    output_backend_ = Rp1PioCreateOutputBackend(h, double_rows, parallel,
+                                                pwm_lsb_nanoseconds,
+                                                dither_bits, row_address_type);
+  } else {
+    output_backend_ = new GPIOOutputBackend<GPIO>(io, h, double_rows,
+                                                  parallel,
+                                                  allow_hardware_pulsing,
+                                                  pwm_lsb_nanoseconds,
+                                                  dither_bits,
+                                                  row_address_type);
   }
 }
 
+/* static */ void Framebuffer::InitCapture(CaptureGPIO *io, int rows,
+                                           int parallel,
+                                           int pwm_lsb_nanoseconds,
+                                           int dither_bits,
+                                           int row_address_type) {
+  ResetGlobals();
+  output_backend_ = new GPIOOutputBackend<CaptureGPIO>(io, *hardware_mapping_,
+                                                       rows / SUB_PANELS_,
+                                                       parallel, true,
+                                                       pwm_lsb_nanoseconds,
+                                                       dither_bits,
+                                                       row_address_type);
+}
+
+/*static*/ void Framebuffer::InitializePanels(const char *panel_type,
+                                              int columns) {
+  if (!panel_type || panel_type[0] == '\0') return;
+  if (output_backend_ == NULL) return;
+  output_backend_->InitializePanels(panel_type, columns);
+}
+
 bool Framebuffer::SetPWMBits(uint8_t value) {
-  if (value < 1 || value > kBitPlanes)
+  if (value < 1 || value > bit_planes_)
     return false;
   pwm_bits_ = value;
+  written_planes_ = ((1 << bit_planes_) - 1) & ~((1 << (bit_planes_ - value)) - 1);
+  UpdateColorLookup();
   return true;
 }
 
-inline gpio_bits_t *Framebuffer::ValueAt(int double_row, int column, int bit) {
-  return &bitplane_buffer_[ double_row * (columns_ * kBitPlanes)
-                            + bit * columns_
-                            + column ];
+void Framebuffer::set_luminance_correct(bool on) {
+  do_luminance_correct_ = on;
+  UpdateColorLookup();
+}
+
+void Framebuffer::SetBrightness(uint8_t b) {
+  brightness_ = (b <= 100 ? (b != 0 ? b : 1) : 100);
+  UpdateColorLookup();
 }
 
 void Framebuffer::Clear() {
+  if (has_shadow()) {
+    std::fill(shadow_.begin(), shadow_.end(), Color());
+    shadow_dirty_ = true;
+    return;
+  }
   if (inverse_color_) {
     Fill(0, 0, 0);
   } else  {
     // Cheaper.
-    memset(bitplane_buffer_, 0,
-           sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+    memset(storage(), 0, buffer_size_);
+    std::fill(dirty_planes_.begin(), dirty_planes_.end(),
+              (1 << bit_planes_) - 1);
   }
 }
 
-struct ColorLookup {
-  uint16_t color[256];
-};
-
-class ColorLookupTable {
-  public:
-    static const ColorLookup &GetLookup(uint8_t brightness) {
-      static ColorLookupTable instance;
-      return instance.lookups_[brightness - 1];
-    }
-
-
-  private:
-    // Do CIE1931 luminance correction and scale to output bitplanes
-    static uint16_t luminance_cie1931(uint8_t c, uint8_t brightness) {
-      float out_factor = ((1 << internal::Framebuffer::kBitPlanes) - 1);
-      float v = (float) c * brightness / 255.0;
-      return roundf(out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3)));
-    }
-
-    ColorLookupTable() {
-      for (int c = 0; c < 256; ++c)
-        for (int b = 0; b < 100; ++b)
-          lookups_[b].color[c] = luminance_cie1931(c, b + 1);
-    }
-
-    ColorLookup lookups_[100]{};
-  };
-
-  static inline uint16_t CIEMapColor(uint8_t brightness, uint8_t c) {
-    return ColorLookupTable::GetLookup(brightness).color[c];
-  }
+// Do CIE1931 luminance correction and scale to output bitplanes. Only used
+// to fill the per-framebuffer color_lut_, so not worth caching.
+static uint16_t CIEMapColor(uint8_t brightness, uint8_t c, int bit_planes) {
+  const float out_factor = ((1 << bit_planes) - 1);
+  float v = (float) c * brightness / 255.0;
+  return roundf(out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3)));
+}
 
 // Non luminance correction. TODO: consider getting rid of this.
-static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c) {
+static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c,
+                                      int bit_planes) {
   // simple scale down the color value
   c = c * brightness / 100;
 
   // shift to be left aligned with top-most bits.
-  constexpr int shift = internal::Framebuffer::kBitPlanes - 8;
+  const int shift = bit_planes - 8;
   return (shift > 0) ? (c << shift) : (c >> -shift);
 }
 
+void Framebuffer::UpdateColorLookup() {
+  for (int c = 0; c < 256; ++c) {
+    uint16_t value = do_luminance_correct_
+      ? CIEMapColor(brightness_, c, bit_planes_)
+      : DirectMapColor(brightness_, c, bit_planes_);
+    if (inverse_color_) value = ~value;
+    color_lut_[c] = value & written_planes_;
+  }
+}
+
 inline void Framebuffer::MapColors(
   uint8_t r, uint8_t g, uint8_t b,
   uint16_t *red, uint16_t *green, uint16_t *blue) {
+  *red   = color_lut_[r];
+  *green = color_lut_[g];
+  *blue  = color_lut_[b];
+}
 
-  if (do_luminance_correct_) {
-    *red   = CIEMapColor(brightness_, r);
-    *green = CIEMapColor(brightness_, g);
-    *blue  = CIEMapColor(brightness_, b);
-  } else {
-    *red   = DirectMapColor(brightness_, r);
-    *green = DirectMapColor(brightness_, g);
-    *blue  = DirectMapColor(brightness_, b);
-  }
-
-  if (inverse_color_) {
-    *red = ~(*red);
-    *green = ~(*green);
-    *blue = ~(*blue);
+void Framebuffer::MapColorSpan(const uint8_t *pixels, bool is_bgr, int count,
+                               uint16_t *red, uint16_t *green, uint16_t *blue) {
+  const int r_index = is_bgr ? 2 : 0;
+  const int b_index = is_bgr ? 0 : 2;
+  for (int i = 0; i < count; ++i, pixels += 3) {
+    red[i]   = color_lut_[pixels[r_index]];
+    green[i] = color_lut_[pixels[1]];
+    blue[i]  = color_lut_[pixels[b_index]];
   }
 }
 
 void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
+  if (has_shadow()) {
+    std::fill(shadow_.begin(), shadow_.end(), Color(r, g, b));
+    shadow_dirty_ = true;
+    return;
+  }
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
-  const PixelDesignator &fill = (*shared_mapper_)->GetFillColorBits();
+  const PixelColorBits &fill = (*shared_mapper_)->GetFillColorBits();
 
-  for (int bits = kBitPlanes - pwm_bits_; bits < kBitPlanes; ++bits) {
+  for (int bits = bit_planes_ - pwm_bits_; bits < bit_planes_; ++bits) {
     uint16_t mask = 1 << bits;
     gpio_bits_t plane_bits = 0;
     plane_bits |= ((red & mask) == mask)   ? fill.r_bit : 0;
@@ -730,50 +1158,125 @@ void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
     plane_bits |= ((blue & mask) == mask)  ? fill.b_bit : 0;
 
     for (int row = 0; row < double_rows_; ++row) {
-      gpio_bits_t *row_data = ValueAt(row, 0, bits);
-      for (int col = 0; col < columns_; ++col) {
-        *row_data++ = plane_bits;
+      const long offset = ((long)row * bit_planes_ + bits) * plane_stride_;
+      if (packed_buffer_) {
+        std::fill(packed_buffer_ + offset,
+                  packed_buffer_ + offset + plane_stride_,
+                  (uint8_t)plane_bits);
+      } else {
+        std::fill(bitplane_buffer_ + offset,
+                  bitplane_buffer_ + offset + plane_stride_, plane_bits);
       }
     }
   }
+  for (int row = 0; row < double_rows_; ++row) {
+    dirty_planes_[row] |= written_planes_;
+  }
 }
 
-void Framebuffer::SubFill(int x, int y, int width, int height, uint8_t r, uint8_t g, uint8_t b) {
+// Write the planes of one pixel, the color given as all-ones or zero
+// masks for each plane. As WritePlanes(), kPlanes == 0 takes the number of
+// planes from "plane_count".
+template <int kPlanes, typename T>
+static inline void WriteSplitColor(const PixelColorBits &color,
+                                   const gpio_bits_t *red_on,
+                                   const gpio_bits_t *green_on,
+                                   const gpio_bits_t *blue_on,
+                                   T *bits, int plane_stride,
+                                   int first_plane, int plane_count) {
+  bits += (long)plane_stride * first_plane;
+  const gpio_bits_t r_bits = color.r_bit;
+  const gpio_bits_t g_bits = color.g_bit;
+  const gpio_bits_t b_bits = color.b_bit;
+  const T designator_mask = color.mask;
+  const int count = kPlanes > 0 ? kPlanes : plane_count;
+  for (int i = 0; i < count; ++i) {
+    const int plane = first_plane + i;
+    const T color_bits = (red_on[plane] & r_bits)
+      | (green_on[plane] & g_bits) | (blue_on[plane] & b_bits);
+    *bits = (*bits & designator_mask) | color_bits;
+    bits += plane_stride;
+  }
+}
 
-  uint16_t red, green, blue;
-  MapColors(r, g, b, &red, &green, &blue);
+template <typename T>
+static inline void WriteSplitColor(const PixelColorBits &color,
+                                   const gpio_bits_t *red_on,
+                                   const gpio_bits_t *green_on,
+                                   const gpio_bits_t *blue_on,
+                                   T *bits, int plane_stride,
+                                   int first_plane, int end_plane) {
+  switch (end_plane - first_plane) {
+  case 8:
+    WriteSplitColor<8>(color, red_on, green_on, blue_on, bits, plane_stride,
+                       first_plane, 8);
+    break;
+  case 11:
+    WriteSplitColor<11>(color, red_on, green_on, blue_on, bits, plane_stride,
+                        first_plane, 11);
+    break;
+  case 16:
+    WriteSplitColor<16>(color, red_on, green_on, blue_on, bits, plane_stride,
+                        first_plane, 16);
+    break;
+  default:
+    WriteSplitColor<0>(color, red_on, green_on, blue_on, bits, plane_stride,
+                       first_plane, end_plane - first_plane);
+    break;
+  }
+}
 
+void Framebuffer::SubFill(int x, int y, int width, int height, uint8_t r, uint8_t g, uint8_t b) {
   int safe_y = std::max(0, y);
   int safe_y_max = std::min((*shared_mapper_)->height(), y + height);
   int safe_x = std::max(0, x);
   int safe_x_max = std::min((*shared_mapper_)->width(), x + width);
+  // Nothing to fill; also, there is no mapping for a column beyond the width.
+  if (safe_x >= safe_x_max) return;
+
+  if (has_shadow()) {
+    for (int row = safe_y; row < safe_y_max; ++row) {
+      Color *const line = &shadow_[row * shadow_width_];
+      std::fill(line + safe_x, line + safe_x_max, Color(r, g, b));
+    }
+    shadow_dirty_ = true;
+    return;
+  }
+
+  uint16_t red, green, blue;
+  MapColors(r, g, b, &red, &green, &blue);
+  // Same color everywhere: decide once per plane which color bits are on.
+  const int min_bit_plane = bit_planes_ - pwm_bits_;
+  gpio_bits_t red_on[kMaxBitPlanes], green_on[kMaxBitPlanes];
+  gpio_bits_t blue_on[kMaxBitPlanes];
+  for (int plane = min_bit_plane; plane < bit_planes_; ++plane) {
+    red_on[plane]   = PlaneBitMask(red, plane);
+    green_on[plane] = PlaneBitMask(green, plane);
+    blue_on[plane]  = PlaneBitMask(blue, plane);
+  }
 
+  const PixelDesignatorMap &map = **shared_mapper_;
   for (int row = safe_y; row < safe_y_max; row++)
   {
-    const PixelDesignator* designator = (*shared_mapper_)->get(safe_x, row);
+    const int index = map.index(safe_x, row);
+    const int32_t *gpio_word = map.gpio_words() + index;
+    const uint8_t *color_index = map.color_index() + index;
 
-    for (int col = safe_x; col < safe_x_max; col++)
+    for (int col = safe_x; col < safe_x_max; col++, gpio_word++, color_index++)
     {
-      if (designator == NULL) continue;
-      const long pos = designator->gpio_word;
+      const long pos = *gpio_word;
       if (pos < 0) continue;  // non-used pixel marker.
+      MarkWritten(pos);
 
-      gpio_bits_t* bits = bitplane_buffer_ + pos;
-      const int min_bit_plane = kBitPlanes - pwm_bits_;
-      bits += (columns_ * min_bit_plane);
-      const gpio_bits_t r_bits = designator->r_bit;
-      const gpio_bits_t g_bits = designator->g_bit;
-      const gpio_bits_t b_bits = designator->b_bit;
-      const gpio_bits_t designator_mask = designator->mask;
-      for (uint16_t mask = 1 << min_bit_plane; mask != 1 << kBitPlanes; mask <<= 1) {
-        gpio_bits_t color_bits = 0;
-        if (red & mask)   color_bits |= r_bits;
-        if (green & mask) color_bits |= g_bits;
-        if (blue & mask)  color_bits |= b_bits;
-        *bits = (*bits & designator_mask) | color_bits;
-        bits += columns_;
+      const PixelColorBits &color = map.color_bits()[*color_index];
+      if (packed_buffer_) {
+        WriteSplitColor(color, red_on, green_on, blue_on, packed_buffer_ + pos,
+                        plane_stride_, min_bit_plane, bit_planes_);
+      } else {
+        WriteSplitColor(color, red_on, green_on, blue_on,
+                        bitplane_buffer_ + pos,
+                        plane_stride_, min_bit_plane, bit_planes_);
       }
-      designator++;
     }
   }
 }
@@ -782,38 +1285,272 @@ int Framebuffer::width() const { return (*shared_mapper_)->width(); }
 int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-  const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
-  if (designator == NULL) return;
-  const long pos = designator->gpio_word;
+  if (has_shadow()) {
+    if (x < 0 || y < 0 || x >= shadow_width_ || y >= shadow_height_) return;
+    Color &c = shadow_[y * shadow_width_ + x];
+    c.r = r; c.g = g; c.b = b;
+    shadow_dirty_ = true;
+    return;
+  }
+  const PixelDesignatorMap &map = **shared_mapper_;
+  const int index = map.index(x, y);
+  if (index < 0) return;
+  const long pos = map.gpio_words()[index];
   if (pos < 0) return;  // non-used pixel marker.
 
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
+  MarkWritten(pos);
 
-  gpio_bits_t *bits = bitplane_buffer_ + pos;
-  const int min_bit_plane = kBitPlanes - pwm_bits_;
-  bits += (columns_ * min_bit_plane);
-  const gpio_bits_t r_bits = designator->r_bit;
-  const gpio_bits_t g_bits = designator->g_bit;
-  const gpio_bits_t b_bits = designator->b_bit;
-  const gpio_bits_t designator_mask = designator->mask;
-  for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
-    gpio_bits_t color_bits = 0;
-    if (red & mask)   color_bits |= r_bits;
-    if (green & mask) color_bits |= g_bits;
-    if (blue & mask)  color_bits |= b_bits;
-    *bits = (*bits & designator_mask) | color_bits;
-    bits += columns_;
+  const PixelColorBits &color = map.color_bits()[map.color_index()[index]];
+  if (packed_buffer_) {
+    WritePixelPlanes(color, pos, red, green, blue, packed_buffer_,
+                     plane_stride_, bit_planes_ - pwm_bits_, bit_planes_);
+  } else {
+    WritePixelPlanes(color, pos, red, green, blue, bitplane_buffer_,
+                     plane_stride_, bit_planes_ - pwm_bits_, bit_planes_);
+  }
+}
+
+void Framebuffer::SetPixelSpan(int map_index, int count,
+                               const uint8_t *pixels, bool is_bgr) {
+  uint16_t red[kBitplaneSpanChunk];
+  uint16_t green[kBitplaneSpanChunk];
+  uint16_t blue[kBitplaneSpanChunk];
+  const int min_bit_plane = bit_planes_ - pwm_bits_;
+  const PixelDesignatorMap &map = **shared_mapper_;
+  const int32_t *gpio_words = map.gpio_words() + map_index;
+  const uint8_t *color_index = map.color_index() + map_index;
+  int last_double_row = -1;
+  for (int i = 0; i < count; ++i) {
+    if (gpio_words[i] < 0) continue;
+    const int double_row = DoubleRowOf(gpio_words[i]);
+    if (double_row != last_double_row) {  // Mostly the same along a span.
+      dirty_planes_[double_row] |= written_planes_;
+      last_double_row = double_row;
+    }
+  }
+  while (count > 0) {
+    const int chunk = std::min(count, kBitplaneSpanChunk);
+    MapColorSpan(pixels, is_bgr, chunk, red, green, blue);
+    if (packed_buffer_) {
+      WriteBitplaneSpan(gpio_words, color_index, map.color_bits(), chunk,
+                        red, green, blue, packed_buffer_, plane_stride_,
+                        min_bit_plane, bit_planes_);
+    } else {
+      WriteBitplaneSpan(gpio_words, color_index, map.color_bits(), chunk,
+                        red, green, blue, bitplane_buffer_, plane_stride_,
+                        min_bit_plane, bit_planes_);
+    }
+    gpio_words += chunk;
+    color_index += chunk;
+    pixels += 3 * chunk;
+    count -= chunk;
+  }
+}
+
+void Framebuffer::WriteImageBand(int x, int y, int width, int height,
+                                 const uint8_t *image, size_t row_stride,
+                                 bool is_bgr, int first_double_row,
+                                 int end_double_row) {
+  const long word_begin = (long)first_double_row * plane_stride_ * bit_planes_;
+  const long word_end = (long)end_double_row * plane_stride_ * bit_planes_;
+  const PixelDesignatorMap &map = **shared_mapper_;
+  for (int row = 0; row < height; ++row, image += row_stride) {
+    const int index = map.index(x, y + row);
+    const int32_t *gpio_words = map.gpio_words() + index;
+    // Write runs of pixels that land in our band; with pixel mappers,
+    // a row can be spread over several bands.
+    int i = 0;
+    while (i < width) {
+      while (i < width && (gpio_words[i] < word_begin
+                           || gpio_words[i] >= word_end)) {
+        ++i;
+      }
+      const int run_start = i;
+      while (i < width && gpio_words[i] >= word_begin
+             && gpio_words[i] < word_end) {
+        ++i;
+      }
+      if (i > run_start) {
+        SetPixelSpan(index + run_start, i - run_start,
+                     image + 3 * run_start, is_bgr);
+      }
+    }
   }
 }
 
+namespace {
+struct ImageBandJob {
+  Framebuffer *framebuffer;
+  int x, y, width, height;
+  const uint8_t *image;
+  size_t row_stride;
+  bool is_bgr;
+  int double_rows;
+  int parts;
+};
+}  // anonymous namespace
+
+void Framebuffer::WriteImageBandPart(void *arg, int part) {
+  RGB_TRACE_SPAN_ARG("WriteImageBand", part);
+  const ImageBandJob *job = static_cast<ImageBandJob*>(arg);
+  job->framebuffer->WriteImageBand(
+    job->x, job->y, job->width, job->height,
+    job->image, job->row_stride, job->is_bgr,
+    job->double_rows * part / job->parts,
+    job->double_rows * (part + 1) / job->parts);
+}
+
+void Framebuffer::WriteImage(int x, int y, int width, int height,
+                             const uint8_t *image, size_t row_stride,
+                             bool is_bgr) {
+  // Below that, waking up the workers costs more than it saves.
+  static constexpr int kMinParallelPixels = 8192;
+  RGB_TRACE_SPAN("WriteImage");
+
+  const uint32_t start_time = GetMicrosecondCounter();
+  if (width * height < kMinParallelPixels || double_rows_ < 2) {
+    WriteImageBand(x, y, width, height, image, row_stride, is_bgr,
+                   0, double_rows_);
+  } else {
+    // The bitplanes of each double row are independent, so bands of double
+    // rows can be written in parallel without stepping on each other's words.
+    WorkerPool *pool = WorkerPool::Get();
+    ImageBandJob job = { this, x, y, width, height, image, row_stride, is_bgr,
+                         double_rows_,
+                         std::min(pool->parallelism(), double_rows_) };
+    pool->Run(job.parts, &WriteImageBandPart, &job);
+  }
+  conversion_usec_ = GetMicrosecondCounter() - start_time;
+}
+
+void Framebuffer::SetImage(int x, int y, int width, int height,
+                           const uint8_t *image, size_t row_stride,
+                           bool is_bgr) {
+  // Pixels outside the canvas are ignored, just like in SetPixel().
+  const int x_start = std::max(0, x);
+  const int x_end = std::min(this->width(), x + width);
+  const int y_start = std::max(0, y);
+  const int y_end = std::min(this->height(), y + height);
+  if (x_start >= x_end || y_start >= y_end) return;
+  image += (y_start - y) * row_stride + 3 * (x_start - x);
+
+  if (has_shadow()) {
+    const int r_index = is_bgr ? 2 : 0;
+    const int b_index = is_bgr ? 0 : 2;
+    for (int row = y_start; row < y_end; ++row, image += row_stride) {
+      Color *out = &shadow_[row * shadow_width_ + x_start];
+      const uint8_t *pixel = image;
+      for (int col = x_start; col < x_end; ++col, pixel += 3, ++out) {
+        out->r = pixel[r_index];
+        out->g = pixel[1];
+        out->b = pixel[b_index];
+      }
+    }
+    shadow_dirty_ = true;
+    return;
+  }
+
+  WriteImage(x_start, y_start, x_end - x_start, y_end - y_start,
+             image, row_stride, is_bgr);
+}
+
 void Framebuffer::SetPixels(int x, int y, int width, int height, Color *colors) {
-  for (int iy = 0; iy < height; ++iy) {
-    for (int ix = 0; ix < width; ++ix) {
-      SetPixel(x + ix, y + iy, colors->r, colors->g, colors->b);
-      ++colors;
+  static_assert(sizeof(Color) == 3, "Color needs to be packed RGB");
+  SetImage(x, y, width, height, reinterpret_cast<const uint8_t*>(colors),
+           3 * width, false);
+}
+
+void Framebuffer::EnableShadow() {
+  shadow_width_ = (*shared_mapper_)->width();
+  shadow_height_ = (*shared_mapper_)->height();
+  shadow_.assign(shadow_width_ * shadow_height_, Color());
+  shadow_dirty_ = true;
+}
+
+void Framebuffer::ConvertShadow() {
+  if (!shadow_dirty_) return;
+  RGB_TRACE_SPAN("ConvertShadow");
+  WriteImage(0, 0, shadow_width_, shadow_height_,
+             reinterpret_cast<const uint8_t*>(shadow_.data()),
+             3 * shadow_width_, false);
+  shadow_dirty_ = false;
+}
+
+const Framebuffer *Framebuffer::ConvertedContent() const {
+  if (!shadow_dirty_) return this;
+  RGB_TRACE_SPAN("ConvertShadowScratch");
+  if (shadow_scratch_ == NULL) {
+    // Shares our PixelDesignatorMap, so the LED sequence is not used.
+    shadow_scratch_ = new Framebuffer(rows_, columns_, parallel_, bit_planes_,
+                                      scan_mode_, "RGB", inverse_color_,
+                                      packed_buffer_ != NULL, shared_mapper_);
+  }
+  shadow_scratch_->SetPWMBits(pwm_bits_);
+  shadow_scratch_->do_luminance_correct_ = do_luminance_correct_;
+  shadow_scratch_->SetBrightness(brightness_);
+  shadow_scratch_->WriteImage(0, 0, shadow_width_, shadow_height_,
+                              reinterpret_cast<const uint8_t*>(shadow_.data()),
+                              3 * shadow_width_, false);
+  return shadow_scratch_;
+}
+
+// Bits of the given color of a pixel in all planes, as value for the
+// color_lut_.
+template <typename T>
+static uint16_t ReadPlanes(const T *word, int plane_stride, gpio_bits_t bit,
+                           int bit_planes) {
+  uint16_t value = 0;
+  for (int plane = 0; plane < bit_planes; ++plane, word += plane_stride) {
+    if (*word & bit) value |= 1 << plane;
+  }
+  return value;
+}
+
+void Framebuffer::ShadowFromBitplanes(const char *bitplanes) {
+  RGB_TRACE_SPAN("ShadowFromBitplanes");
+  // For each value of the planes, the color that maps closest to it. The
+  // color_lut_ grows with the color, apart from inversion.
+  std::vector<uint8_t> to_color(1 << bit_planes_);
+  int c = 0;
+  for (int value = 0; value < (int)to_color.size(); ++value) {
+    while (c < 255) {
+      const int here = inverse_color_ ? ~color_lut_[c] & written_planes_
+        : color_lut_[c];
+      const int next = inverse_color_ ? ~color_lut_[c + 1] & written_planes_
+        : color_lut_[c + 1];
+      if (abs(next - value) > abs(here - value)) break;
+      ++c;
     }
+    to_color[value] = c;
   }
+  const PixelDesignatorMap &map = **shared_mapper_;
+  for (int y = 0; y < shadow_height_; ++y) {
+    for (int x = 0; x < shadow_width_; ++x) {
+      Color &out = shadow_[y * shadow_width_ + x];
+      const int index = map.index(x, y);
+      const long pos = index < 0 ? -1 : map.gpio_words()[index];
+      if (pos < 0) {
+        out = Color();
+        continue;
+      }
+      const PixelColorBits &bits = map.color_bits()[map.color_index()[index]];
+      uint16_t rgb[3];
+      const gpio_bits_t color_bit[3] = { bits.r_bit, bits.g_bit, bits.b_bit };
+      for (int i = 0; i < 3; ++i) {
+        rgb[i] = packed_buffer_
+          ? ReadPlanes(reinterpret_cast<const uint8_t*>(bitplanes) + pos,
+                       plane_stride_, color_bit[i], bit_planes_)
+          : ReadPlanes(reinterpret_cast<const gpio_bits_t*>(bitplanes) + pos,
+                       plane_stride_, color_bit[i], bit_planes_);
+        if (inverse_color_) rgb[i] = ~rgb[i];
+        rgb[i] &= written_planes_;
+      }
+      out = Color(to_color[rgb[0]], to_color[rgb[1]], to_color[rgb[2]]);
+    }
+  }
+  shadow_dirty_ = true;
 }
 // Strange LED-mappings such as RBG or so are handled here.
 gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
@@ -837,189 +1574,170 @@ gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
 }
 
 void Framebuffer::InitDefaultDesignator(int x, int y, const char *seq,
-                                        PixelDesignator *d) {
-  const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t *bits = ValueAt(y % double_rows_, x, 0);
-  d->gpio_word = bits - bitplane_buffer_;
-  d->r_bit = d->g_bit = d->b_bit = 0;
-  if (y < rows_) {
-    if (y < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-    }
-  }
-  else if (y >= rows_ && y < 2 * rows_) {
-    if (y - rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-    }
-  }
-  else if (y >= 2*rows_ && y < 3 * rows_) {
-    if (y - 2*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p2_r2, h.p2_g2, h.p2_b2);
+                                        PixelDesignatorMap *map) {
+  const int chain = std::min(y / rows_, 5);
+  const bool lower_half = (y - chain * rows_) >= double_rows_;
+  gpio_bits_t chain_pins[6];
+  GetChainColorPins(*hardware_mapping_, chain, chain_pins);
+  const gpio_bits_t *pins = packed_buffer_ ? kPackedColorPins : chain_pins;
+  pins += lower_half ? 3 : 0;  // r2, g2, b2
+
+  PixelColorBits color;
+  color.r_bit = GetGpioFromLedSequence('R', seq, pins[0], pins[1], pins[2]);
+  color.g_bit = GetGpioFromLedSequence('G', seq, pins[0], pins[1], pins[2]);
+  color.b_bit = GetGpioFromLedSequence('B', seq, pins[0], pins[1], pins[2]);
+  color.mask = ~(color.r_bit | color.g_bit | color.b_bit);
+
+  long offset = (long)(y % double_rows_) * plane_stride_ * bit_planes_;
+  offset += packed_buffer_ ? x * parallel_ + chain : x;
+  map->SetPixel(x, y, offset, color);
+}
+
+const gpio_bits_t *Framebuffer::ExpandRow(int double_row, int bit) const {
+  const uint8_t *in = packed_buffer_
+    + ((long)double_row * bit_planes_ + bit) * plane_stride_;
+  gpio_bits_t *out = expanded_row_.data();
+  const gpio_bits_t *lut = expand_lut_.data();
+  // The bytes are read before any word is written: with uint8_t input the
+  // compiler otherwise has to assume the output aliases it.
+  switch (parallel_) {
+  case 1:
+    for (int col = 0; col < columns_; ++col) {
+      out[col] = lut[in[col] & 0x3f];
     }
-  }
-  else if (y >= 3*rows_ && y < 4 * rows_) {
-    if (y - 3*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p3_r2, h.p3_g2, h.p3_b2);
+    break;
+  case 2:
+    for (int col = 0; col < columns_; ++col, in += 2) {
+      const uint8_t c0 = in[0] & 0x3f, c1 = in[1] & 0x3f;
+      out[col] = lut[c0] | lut[64 + c1];
     }
-  }
-  else if (y >= 4*rows_ && y < 5 * rows_){
-    if (y - 4*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p4_r2, h.p4_g2, h.p4_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p4_r2, h.p4_g2, h.p4_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p4_r2, h.p4_g2, h.p4_b2);
+    break;
+  case 3:
+    for (int col = 0; col < columns_; ++col, in += 3) {
+      const uint8_t c0 = in[0] & 0x3f, c1 = in[1] & 0x3f, c2 = in[2] & 0x3f;
+      out[col] = lut[c0] | lut[64 + c1] | lut[128 + c2];
     }
-
-  }
-  else {
-    if (y - 5*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p5_r2, h.p5_g2, h.p5_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p5_r2, h.p5_g2, h.p5_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p5_r2, h.p5_g2, h.p5_b2);
+    break;
+  default:
+    for (int col = 0; col < columns_; ++col) {
+      gpio_bits_t word = 0;
+      for (int chain = 0; chain < parallel_; ++chain) {
+        word |= lut[chain * 64 + (*in++ & 0x3f)];
+      }
+      out[col] = word;
     }
+    break;
   }
-
-  d->mask = ~(d->r_bit | d->g_bit | d->b_bit);
+  return out;
 }
 
 void Framebuffer::Serialize(const char **data, size_t *len) const {
-  *data = reinterpret_cast<const char*>(bitplane_buffer_);
+  *data = ConvertedContent()->storage();
   *len = buffer_size_;
 }
 
 bool Framebuffer::Deserialize(const char *data, size_t len) {
   if (len != buffer_size_) return false;
-  memcpy(bitplane_buffer_, data, len);
+  if (has_shadow()) {
+    ShadowFromBitplanes(data);
+    return true;
+  }
+  // Consecutive frames of a stream often only differ in a few places, so
+  // only write (and mark dirty) the bitplanes that actually changed.
+  const size_t plane_bytes = plane_stride_ * element_size_;
+  char *out = storage();
+  for (int row = 0; row < double_rows_; ++row) {
+    for (int plane = 0; plane < bit_planes_; ++plane) {
+      if (memcmp(out, data, plane_bytes) != 0) {
+        memcpy(out, data, plane_bytes);
+        dirty_planes_[row] |= 1 << plane;
+      }
+      data += plane_bytes;
+      out += plane_bytes;
+    }
+  }
   return true;
 }
 
-void Framebuffer::CopyFrom(const Framebuffer *other) {
-  if (other == this) return;
-  memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
+void Framebuffer::MarkClean() const {
+  RGB_TRACE_SPAN("MarkClean");
+  static std::atomic<uint64_t> next_version(1);
+  const size_t plane_bytes = plane_stride_ * element_size_;
+  for (int row = 0; row < double_rows_; ++row) {
+    if (dirty_planes_[row] == 0) continue;
+    band_version_[row] = next_version++;
+    // With inverse colors, a plane without bits set is all on.
+    uint32_t empty = 0;
+    for (int b = 0; b < bit_planes_ && !inverse_color_; ++b) {
+      const char *plane = storage() + (row * bit_planes_ + b) * plane_bytes;
+      if (plane[0] == 0 && memcmp(plane, plane + 1, plane_bytes - 1) == 0) {
+        empty |= 1u << b;
+      }
+    }
+    empty_planes_[row] = empty;
+    dirty_planes_[row] = 0;
+  }
 }
 
-void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
-  if (Rp1RioIsActive()) {
-    Rp1RioDumpFramebuffer(this, pwm_low_bit);
-    return;
-  }
-  if (Rp1PioIsActive()) {
-    Rp1PioDumpFramebuffer(this, pwm_low_bit);
-    return;
+bool Framebuffer::IsDark() const {
+  const uint32_t shown_planes = ((1u << bit_planes_) - 1)
+    & ~((1u << (bit_planes_ - pwm_bits_)) - 1);
+  for (int row = 0; row < double_rows_; ++row) {
+    if ((empty_planes(row) & shown_planes) != shown_planes) return false;
   }
+  return true;
+}
 
-  const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t color_clk_mask = 0;  // Mask of bits while clocking in.
-  color_clk_mask |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
-  if (parallel_ >= 2) {
-    color_clk_mask |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
-  }
-  if (parallel_ >= 3) {
-    color_clk_mask |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
-  }
-  if (parallel_ >= 4) {
-    color_clk_mask |= h.p3_r1 | h.p3_g1 | h.p3_b1 | h.p3_r2 | h.p3_g2 | h.p3_b2;
-  }
-  if (parallel_ >= 5) {
-    color_clk_mask |= h.p4_r1 | h.p4_g1 | h.p4_b1 | h.p4_r2 | h.p4_g2 | h.p4_b2;
-  }
-  if (parallel_ >= 6) {
-    color_clk_mask |= h.p5_r1 | h.p5_g1 | h.p5_b1 | h.p5_r2 | h.p5_g2 | h.p5_b2;
+void Framebuffer::CopyFrom(const Framebuffer *other) {
+  if (other == this) return;
+  if (has_shadow()) {
+    // Only the RGB content; our bitplanes might still be on screen.
+    if (other->has_shadow() && other->shadow_.size() == shadow_.size()) {
+      shadow_ = other->shadow_;
+      shadow_dirty_ = true;
+    } else {
+      ShadowFromBitplanes(other->ConvertedContent()->storage());
+    }
+    return;
   }
-
-  color_clk_mask |= h.clock;
-
-  // Depending if we do dithering, we might not always show the lowest bits.
-  const int start_bit = std::max(pwm_low_bit, kBitPlanes - pwm_bits_);
-
-  const uint8_t half_double = double_rows_/2;
-  for (uint8_t row_loop = 0; row_loop < double_rows_; ++row_loop) {
-    uint8_t d_row;
-    switch (scan_mode_) {
-    case 0:  // progressive
-    default:
-      d_row = row_loop;
-      break;
-
-    case 1:  // interlaced
-      d_row = ((row_loop < half_double)
-               ? (row_loop << 1)
-               : ((row_loop - half_double) << 1) + 1);
+  // The bookkeeping of "other" is left alone: it might be on screen, with
+  // the refresh thread reading it. So versions only tell bands apart that
+  // are clean in both.
+  other = other->ConvertedContent();
+  const uint32_t all_planes = (1 << bit_planes_) - 1;
+  const size_t band_bytes = buffer_size_ / double_rows_;
+  for (int row = 0; row < double_rows_; ++row) {
+    const bool same_version = band_version_[row] == other->band_version_[row];
+    if (same_version && dirty_planes_[row] == 0
+        && other->dirty_planes_[row] == 0) {
+      continue;
     }
-
-    // Rows can't be switched very quickly without ghosting, so we do the
-    // full PWM of one row before switching rows.
-    for (int b = start_bit; b < kBitPlanes; ++b) {
-      gpio_bits_t *row_data = ValueAt(d_row, 0, b);
-      // While the output enable is still on, we can already clock in the next
-      // data.
-      for (int col = 0; col < columns_; ++col) {
-        const gpio_bits_t &out = *row_data++;
-        io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
-        io->SetBits(h.clock);               // Rising edge: clock color in.
-      }
-      io->ClearBits(color_clk_mask);    // clock back to normal.
-
-      // OE of the previous row-data must be finished before strobe.
-      sOutputEnablePulser->WaitPulseFinished();
-
-      // Setting address and strobing needs to happen in dark time.
-      row_setter_->SetRowAddress(io, d_row);
-
-      io->SetBits(h.strobe);   // Strobe in the previously clocked in row.
-      io->ClearBits(h.strobe);
-
-      // Now switch on for the sleep time necessary for that bit-plane.
-      sOutputEnablePulser->SendPulse(b);
+    memcpy(storage() + row * band_bytes, other->storage() + row * band_bytes,
+           band_bytes);
+    if (other->dirty_planes_[row] == 0) {
+      band_version_[row] = other->band_version_[row];
+      empty_planes_[row] = other->empty_planes_[row];
+      dirty_planes_[row] = 0;
+    } else if (same_version && dirty_planes_[row] == 0) {
+      dirty_planes_[row] = other->dirty_planes_[row];
+    } else {
+      dirty_planes_[row] = all_planes;
     }
   }
 }
+
+void Framebuffer::DumpToMatrix(int pwm_low_bit) {
+  RGB_TRACE_SPAN("DumpToMatrix");
+  if (output_backend_ != NULL)
+    output_backend_->DumpFramebuffer(this, pwm_low_bit);
+}
 }  // namespace internal
 }  // namespace rgb_matrix
 namespace rgb_matrix {
 namespace internal {
   void Framebuffer::ResetGlobals() {
-    if (sOutputEnablePulser != NULL) {
-      delete sOutputEnablePulser;
-      sOutputEnablePulser = NULL;
-    }
-    Rp1RioDeinit();
-    Rp1PioDeinit();
-    if (row_setter_ != NULL) {
-      delete row_setter_;
-      row_setter_ = NULL;
-    }
+    delete output_backend_;
+    output_backend_ = NULL;
   }
 }
 }
@@ -0,0 +1,165 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "gpio-capture.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "gpio.h"
+#include "hardware-mapping.h"
+
+#ifdef ONLY_SINGLE_SUB_PANEL
+#  define SUB_PANELS_ 1
+#else
+#  define SUB_PANELS_ 2
+#endif
+
+namespace rgb_matrix {
+namespace internal {
+class CaptureGPIO::Pulser : public PinPulser {
+public:
+  Pulser(CaptureGPIO *capture, const std::vector<int> &nano_wait_spec)
+    : capture_(capture), nano_wait_spec_(nano_wait_spec) {}
+
+  virtual void SendPulse(int time_spec_number) {
+    Event e = { (gpio_bits_t)time_spec_number, SEND_PULSE };
+    capture_->trace_.push_back(e);
+    const int duration = nano_wait_spec_[time_spec_number];
+    if (capture_->cost_.hardware_pulse) {
+      capture_->pulse_end_ns_ = capture_->elapsed_ns_ + duration;
+    } else {
+      capture_->elapsed_ns_ += duration;
+    }
+  }
+
+  virtual void WaitPulseFinished() {
+    Event e = { 0, WAIT_PULSE };
+    capture_->trace_.push_back(e);
+    capture_->elapsed_ns_ = std::max(capture_->elapsed_ns_,
+                                     capture_->pulse_end_ns_);
+  }
+
+private:
+  CaptureGPIO *const capture_;
+  const std::vector<int> nano_wait_spec_;
+};
+
+CaptureGPIO::CaptureGPIO(const CaptureCostModel &cost)
+  : cost_(cost), output_bits_(0), writes_(0), elapsed_ns_(0),
+    pulse_end_ns_(0) {
+}
+
+PinPulser *CaptureGPIO::CreatePulser(const std::vector<int> &nano_wait_spec) {
+  return new Pulser(this, nano_wait_spec);
+}
+
+void CaptureGPIO::Reset() {
+  trace_.clear();
+  writes_ = 0;
+  elapsed_ns_ = 0;
+  pulse_end_ns_ = 0;
+}
+
+bool DecodeCapture(const std::vector<CaptureGPIO::Event> &trace,
+                   const HardwareMapping &h,
+                   int rows, int columns, int parallel, int bit_planes,
+                   uint8_t *rgb) {
+  const gpio_bits_t chain_pins[6][6] = {
+    { h.p0_r1, h.p0_g1, h.p0_b1, h.p0_r2, h.p0_g2, h.p0_b2 },
+    { h.p1_r1, h.p1_g1, h.p1_b1, h.p1_r2, h.p1_g2, h.p1_b2 },
+    { h.p2_r1, h.p2_g1, h.p2_b1, h.p2_r2, h.p2_g2, h.p2_b2 },
+    { h.p3_r1, h.p3_g1, h.p3_b1, h.p3_r2, h.p3_g2, h.p3_b2 },
+    { h.p4_r1, h.p4_g1, h.p4_b1, h.p4_r2, h.p4_g2, h.p4_b2 },
+    { h.p5_r1, h.p5_g1, h.p5_b1, h.p5_r2, h.p5_g2, h.p5_b2 },
+  };
+  const int double_rows = rows / SUB_PANELS_;
+  const int height = rows * parallel;
+
+  // Per column and chain the pins r1, g1, b1, r2, g2, b2 as bits 0..5; what
+  // is clocked into the shift registers, and what is latched from there.
+  std::vector<uint8_t> shifted;
+  std::vector<uint8_t> latched(columns * parallel, 0);
+  std::vector<uint32_t> sum(columns * height * 3, 0);
+
+  gpio_bits_t pins = 0;
+  for (size_t i = 0; i < trace.size(); ++i) {
+    const CaptureGPIO::Event &e = trace[i];
+    switch (e.operation) {
+    case CaptureGPIO::SET_BITS:
+      if ((e.bits & h.clock) && !(pins & h.clock)) {
+        for (int chain = 0; chain < parallel; ++chain) {
+          uint8_t colors = 0;
+          for (int c = 0; c < 6; ++c) {
+            if (pins & chain_pins[chain][c]) colors |= 1 << c;
+          }
+          shifted.push_back(colors);
+        }
+      }
+      if ((e.bits & h.strobe) && !(pins & h.strobe)) {
+        // The panels hold the last "columns" values clocked in.
+        const int clocked = shifted.size() / parallel;
+        const int first = std::max(0, clocked - columns);
+        std::fill(latched.begin(), latched.end(), 0);
+        for (int col = first; col < clocked; ++col) {
+          memcpy(&latched[(col + columns - clocked) * parallel],
+                 &shifted[col * parallel], parallel);
+        }
+        shifted.clear();
+      }
+      pins |= e.bits;
+      break;
+
+    case CaptureGPIO::CLEAR_BITS:
+      pins &= ~e.bits;
+      break;
+
+    case CaptureGPIO::SEND_PULSE: {
+      int row = 0;
+      if (pins & h.a) row |= 0x01;
+      if (pins & h.b) row |= 0x02;
+      if (pins & h.c) row |= 0x04;
+      if (pins & h.d) row |= 0x08;
+      if (pins & h.e) row |= 0x10;
+      if (row >= double_rows) return false;
+      const uint32_t weight = 1u << e.bits;
+      for (int chain = 0; chain < parallel; ++chain) {
+        for (int col = 0; col < columns; ++col) {
+          const uint8_t colors = latched[col * parallel + chain];
+          for (int c = 0; c < 3 * SUB_PANELS_; ++c) {
+            if (!(colors & (1 << c))) continue;
+            const int y = chain * rows + row + (c >= 3 ? double_rows : 0);
+            sum[(y * columns + col) * 3 + c % 3] += weight;
+          }
+        }
+      }
+      break;
+    }
+
+    case CaptureGPIO::WAIT_PULSE:
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < sum.size(); ++i) {
+    const uint32_t value = (bit_planes >= 8)
+      ? sum[i] >> (bit_planes - 8) : sum[i] << (8 - bit_planes);
+    rgb[i] = std::min(value, 255u);
+  }
+  return true;
+}
+}  // namespace internal
+}  // namespace rgb_matrix
@@ -0,0 +1,152 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// A stand-in for the GPIO that records what would be written to the pins,
+// to run and measure the refresh on a machine without any LED panel.
+#ifndef RPI_RGBMATRIX_GPIO_CAPTURE_H
+#define RPI_RGBMATRIX_GPIO_CAPTURE_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "gpio-bits.h"
+
+struct HardwareMapping;
+
+namespace rgb_matrix {
+class PinPulser;
+namespace internal {
+// How long the operations of the output take on the target, used to
+// estimate the time of a refresh. Best measured on the Pi in question, e.g.
+// by comparing the refresh rate shown with --led-show-refresh.
+struct CaptureCostModel {
+  CaptureCostModel() : write_ns(0), slowdown(0), hardware_pulse(true) {}
+
+  int write_ns;         // One write to the set or clear register.
+  int slowdown;         // Like --led-slowdown-gpio: writes after each access.
+  // With the hardware pulser, the OE pulse runs while the next row is
+  // clocked in; otherwise the CPU waits for the duration of each pulse.
+  bool hardware_pulse;
+};
+
+// Has the parts of the GPIO interface the output uses. Every write is
+// appended to trace(); the OE pulses of the PinPulser from CreatePulser()
+// go into the same trace.
+class CaptureGPIO {
+public:
+  enum Operation {
+    SET_BITS,       // "bits" set.
+    CLEAR_BITS,     // "bits" cleared.
+    SEND_PULSE,     // OE pulse for the bitplane in "bits".
+    WAIT_PULSE,     // Waited for the previous pulse to finish.
+  };
+  struct Event {
+    gpio_bits_t bits;
+    uint32_t operation;
+  };
+
+  explicit CaptureGPIO(const CaptureCostModel &cost = CaptureCostModel());
+
+  gpio_bits_t InitOutputs(gpio_bits_t outputs,
+                          bool adafruit_hack_needed = false) {
+    output_bits_ |= outputs;
+    return outputs;
+  }
+  gpio_bits_t output_bits() const { return output_bits_; }
+
+  // Same semantics as the GPIO, including the number of register writes.
+  inline void SetBits(gpio_bits_t value) {
+    if (!value) return;
+    Write(SET_BITS, value);
+    delay();
+  }
+  inline void ClearBits(gpio_bits_t value) {
+    if (!value) return;
+    Write(CLEAR_BITS, value);
+    delay();
+  }
+  inline void WriteMaskedBits(gpio_bits_t value, gpio_bits_t mask) {
+    Write(CLEAR_BITS, ~value & mask);
+    Write(SET_BITS, value & mask);
+    delay();
+  }
+  inline void WriteClearSetBits(gpio_bits_t clear, gpio_bits_t set) {
+    if (clear) Write(CLEAR_BITS, clear);
+    if (set) Write(SET_BITS, set);
+    delay();
+  }
+  // The compile-time variants of the GPIO record like the ones above; the
+  // slowdown is that of the cost model.
+  template <int kSlowdown, bool kWide>
+  inline void SetBits(gpio_bits_t value) { SetBits(value); }
+  template <int kSlowdown, bool kWide>
+  inline void WriteClearSetBits(gpio_bits_t clear, gpio_bits_t set) {
+    WriteClearSetBits(clear, set);
+  }
+
+  // A PinPulser recording into this capture; "nano_wait_spec" as in
+  // PinPulser::Create(). Owned by the caller.
+  PinPulser *CreatePulser(const std::vector<int> &nano_wait_spec);
+
+  const std::vector<Event> &trace() const { return trace_; }
+  // Register writes since the last Reset(), including the slowdown writes.
+  uint64_t writes() const { return writes_; }
+  // Estimated time the recorded operations take on the target.
+  uint64_t elapsed_ns() const { return elapsed_ns_; }
+
+  // Start a new recording, e.g. for the next frame.
+  void Reset();
+
+private:
+  class Pulser;
+
+  inline void Write(Operation op, gpio_bits_t bits) {
+    Event e = { bits, (uint32_t)op };
+    trace_.push_back(e);
+    ++writes_;
+    elapsed_ns_ += cost_.write_ns;
+  }
+  inline void delay() {
+    if (cost_.slowdown > 0) {
+      writes_ += cost_.slowdown;
+      elapsed_ns_ += (uint64_t)cost_.slowdown * cost_.write_ns;
+    }
+  }
+
+  const CaptureCostModel cost_;
+  gpio_bits_t output_bits_;
+  std::vector<Event> trace_;
+  uint64_t writes_;
+  uint64_t elapsed_ns_;
+  uint64_t pulse_end_ns_;
+};
+
+// Replay the trace of one frame like a chain of panels would and write the
+// picture it shows as "rows" x "columns" RGB triplets for each of the "parallel"
+// chains stacked vertically; the layout of the Framebuffer before any pixel
+// mappers. The value of each color is the sum of the bitplanes it was on,
+// scaled to 8 bits for "bit_planes" planes, so with a linear mapping
+// (no luminance correction, 100% brightness) this reproduces the input.
+//
+// Only direct row addressing (--led-row-addr-type=0) is decoded. Returns
+// false if the trace has pulses on rows it can't make sense of.
+bool DecodeCapture(const std::vector<CaptureGPIO::Event> &trace,
+                   const HardwareMapping &h,
+                   int rows, int columns, int parallel, int bit_planes,
+                   uint8_t *rgb);
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_GPIO_CAPTURE_H
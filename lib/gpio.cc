@@ -17,6 +17,7 @@
 #include <inttypes.h>
 
 #include "gpio.h"
+#include "telemetry.h"
 
 #include <assert.h>
 #include <fcntl.h>
@@ -34,7 +35,8 @@
  * we subtract this value whenever we do nanosleep(); the remaining time
  * we then busy wait to get a good accurate result.
  *
- * You can measure the overhead using DEBUG_SLEEP_JITTER below.
+ * You can measure the overhead with the pulse_overshoot histogram of the
+ * telemetry (see RGBMatrix::GetTelemetry()).
  *
  * Note: A higher value here will result in more CPU use because of more busy
  * waiting inching towards the real value (for all the cases that nanosleep()
@@ -52,15 +54,6 @@
  */
 #define MINIMUM_NANOSLEEP_TIME_US 5
 
-/* In order to determine useful values for above, set this to 1 and use the
- * hardware pin-pulser.
- * It will output a histogram atexit() of how much how often we were over
- * the requested time.
- * (The full histogram will be shifted by the EMPIRICAL_NANOSLEEP_OVERHEAD_US
- *  value above. To get a full histogram of OS overhead, set it to 0 first).
- */
-#define DEBUG_SLEEP_JITTER 0
-
 // Raspberry 1 and 2 have different base addresses for the periphery
 #define BCM2708_PERI_BASE        0x20000000
 #define BCM2709_PERI_BASE        0x3F000000
@@ -125,6 +118,9 @@ static volatile uint32_t *s_PWM_registers = NULL;
 static volatile uint32_t *s_CLK_registers = NULL;
 
 namespace rgb_matrix {
+using internal::TelemetryBlock;
+using internal::TelemetryRecord;
+
 static bool LinuxHasModuleLoaded(const char *name) {
   FILE *f = fopen("/proc/modules", "r");
   if (f == NULL) return false; // don't care.
@@ -476,7 +472,7 @@ class TimerBasedPinPulser : public PinPulser {
 public:
   TimerBasedPinPulser(GPIO *io, gpio_bits_t bits,
                       const std::vector<int> &nano_specs)
-    : io_(io), bits_(bits), nano_specs_(nano_specs) {
+    : io_(io), bits_(bits), nano_specs_(nano_specs), long_pulses_(0) {
     if (!s_Timer1Mhz) {
       fprintf(stderr, "FYI: not running as root which means we can't properly "
               "control timing unless this is a real-time kernel. Expect color "
@@ -485,15 +481,31 @@ public:
   }
 
   virtual void SendPulse(int time_spec_number) {
+    const int nanos = nano_specs_[time_spec_number];
+    // Measuring every pulse would cost more than the short ones take, and
+    // the 1MHz timer can't resolve those anyway; so only every
+    // kSampleInterval-th pulse of at least a microsecond is measured.
+    // Without the timer, measuring costs too much.
+    const bool sampled = (s_Timer1Mhz && nanos >= 1000
+                          && ++long_pulses_ % kSampleInterval == 0);
+    const uint32_t start_us = sampled ? *s_Timer1Mhz : 0;
     io_->ClearBits(bits_);
-    Timers::sleep_nanos(nano_specs_[time_spec_number]);
+    Timers::sleep_nanos(nanos);
     io_->SetBits(bits_);
+    if (sampled) {
+      const int overshoot = (int)(*s_Timer1Mhz - start_us) - nanos / 1000;
+      TelemetryRecord(&TelemetryBlock()->pulse_overshoot,
+                      overshoot < 0 ? 0 : overshoot);
+    }
   }
 
 private:
+  static const uint32_t kSampleInterval = 64;
+
   GPIO *const io_;
   const gpio_bits_t bits_;
   const std::vector<int> nano_specs_;
+  uint32_t long_pulses_;
 };
 
 // Check that 3 shows up in isolcpus
@@ -642,26 +654,6 @@ static void busy_wait_nanos_rpi_4(long nanos) {
   }
 }
 
-#if DEBUG_SLEEP_JITTER
-static int overshoot_histogram_us[256] = {0};
-static void print_overshoot_histogram() {
-  fprintf(stderr, "Overshoot histogram >= empirical overhead of %dus\n"
-          "%6s | %7s | %7s\n",
-          JitterAllowanceMicroseconds(), "usec", "count", "accum");
-  int total_count = 0;
-  for (int i = 0; i < 256; ++i) total_count += overshoot_histogram_us[i];
-  int running_count = 0;
-  for (int us = 0; us < 256; ++us) {
-    const int count = overshoot_histogram_us[us];
-    if (count > 0) {
-      running_count += count;
-      fprintf(stderr, "%s%3dus: %8d %7.3f%%\n", (us == 0) ? "<=" : " +",
-              us, count, 100.0 * running_count / total_count);
-    }
-  }
-}
-#endif
-
 // A PinPulser that uses the PWM hardware to create accurate pulses.
 // It only works on GPIO-12 or 18 though.
 class HardwarePinPulser : public PinPulser {
@@ -694,10 +686,6 @@ public:
     assert(CanHandle(pins));
     assert(s_CLK_registers && s_PWM_registers && s_Timer1Mhz);
 
-#if DEBUG_SLEEP_JITTER
-    atexit(print_overshoot_histogram);
-#endif
-
     if (LinuxHasModuleLoaded("snd_bcm2835")) {
       fprintf(stderr,
               "\n%s=== snd_bcm2835: found that the Pi sound module is loaded. ===%s\n"
@@ -796,18 +784,15 @@ public:
         struct timespec sleep_time = { 0, 1000 * to_sleep_us };
         nanosleep(&sleep_time, NULL);
 
-#if DEBUG_SLEEP_JITTER
-        {
-          // Record histogram of realtime jitter how much longer we actually
-          // took.
-          const int total_us = *s_Timer1Mhz - start_time_;
-          const int nanoslept_us = total_us - already_elapsed_usec;
-          int overshoot = nanoslept_us - (to_sleep_us + JitterAllowanceMicroseconds());
-          if (overshoot < 0) overshoot = 0;
-          if (overshoot > 255) overshoot = 255;
-          overshoot_histogram_us[overshoot]++;
-        }
-#endif
+        // How much longer than the allowance the realtime jitter made us
+        // sleep. (This is shifted by EMPIRICAL_NANOSLEEP_OVERHEAD_US; to see
+        // the full OS overhead, set it to 0 first).
+        const int total_us = *s_Timer1Mhz - start_time_;
+        const int nanoslept_us = total_us - already_elapsed_usec;
+        const int overshoot =
+          nanoslept_us - (to_sleep_us + JitterAllowanceMicroseconds());
+        TelemetryRecord(&TelemetryBlock()->pulse_overshoot,
+                        overshoot < 0 ? 0 : overshoot);
       }
     }
 
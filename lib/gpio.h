@@ -78,6 +78,38 @@ public:
     delay();
   }
 
+  // Clear the bits that are '1' in "clear", then set the ones in "set", as
+  // one write like WriteMaskedBits(). Registers without bits to change are
+  // skipped.
+  inline void WriteClearSetBits(gpio_bits_t clear, gpio_bits_t set) {
+    if (clear) WriteClrBits(clear);
+    if (set) WriteSetBits(set);
+    delay();
+  }
+
+  // Value for the kSlowdown template parameter below to use the slowdown
+  // given to Init() at runtime.
+  static const int kRuntimeSlowdown = -2;
+
+  // SetBits() and WriteClearSetBits() for the refresh loop, with the
+  // slowdown and whether the upper 32 GPIOs are written fixed at compile
+  // time. "kSlowdown" is the value given to Init() or kRuntimeSlowdown;
+  // "kWide" is only honored with ENABLE_WIDE_GPIO_COMPUTE_MODULE.
+  template <int kSlowdown, bool kWide>
+  inline void SetBits(gpio_bits_t value) {
+    if (!value) return;
+    WriteBits<kWide>(gpio_set_bits_low_, value);
+    delay<kSlowdown>();
+  }
+  template <int kSlowdown, bool kWide>
+  inline void WriteClearSetBits(gpio_bits_t clear, gpio_bits_t set) {
+    if (clear) WriteBits<kWide>(gpio_clr_bits_low_, clear);
+    if (set) WriteBits<kWide>(gpio_set_bits_low_, set);
+    delay<kSlowdown>();
+  }
+
+  int slowdown() const { return slowdown_; }
+
   inline gpio_bits_t Read() const { return ReadRegisters() & input_bits_; }
 
   // Return if this appears to be a Pi 4-class board.
@@ -98,6 +130,33 @@ private:
     }
   }
 
+  template <int kSlowdown>
+  inline void delay() const {
+    if (kSlowdown == kRuntimeSlowdown) {
+      delay();
+      return;
+    }
+#if LED_MATRIX_ALLOW_BARRIER_DELAY
+    if (kSlowdown == -1) {
+        asm volatile("dsb\tst");
+        return;
+    }
+#endif
+    for (int n = 0; n < kSlowdown; n++) {
+      *gpio_clr_bits_low_ = 0;
+    }
+  }
+
+  // Write "value" to the set or clear register starting at "reg_low".
+  template <bool kWide>
+  inline void WriteBits(volatile uint32_t *reg_low, gpio_bits_t value) {
+    *reg_low = static_cast<uint32_t>(value & 0xFFFFFFFF);
+#ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
+    // The high register is the next one.
+    if (kWide) *(reg_low + 1) = static_cast<uint32_t>(value >> 32);
+#endif
+  }
+
   inline gpio_bits_t ReadRegisters() const {
     return (static_cast<gpio_bits_t>(*gpio_read_bits_low_)
 #ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
@@ -14,6 +14,7 @@
 // along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
 
 #include "graphics.h"
+#include "led-matrix.h"
 #include "utf8-internal.h"
 
 #include <stdlib.h>
@@ -57,6 +58,15 @@ bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
   const size_t next_row_skip = skip_start_row + skip_end_row;
   buffer += skip_start_row;
 
+  // A FrameCanvas can take the whole image in one go.
+  FrameCanvas *const frame = dynamic_cast<FrameCanvas*>(c);
+  if (frame != NULL) {
+    frame->SetImageRect(canvas_offset_x, canvas_offset_y,
+                        w - canvas_offset_x, h - canvas_offset_y,
+                        buffer, 3 * width, is_bgr);
+    return true;
+  }
+
   if (is_bgr) {
     for (int y = canvas_offset_y; y < h; ++y) {
       for (int x = canvas_offset_x; x < w; ++x) {
@@ -19,12 +19,17 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <map>
+
 #include "led-matrix.h"
 #include "graphics.h"
 
 // Make sure C++ is in sync with C
 static_assert(sizeof(rgb_matrix::RGBMatrix::Options) == sizeof(RGBLedMatrixOptions), "C and C++ out of sync");
 static_assert(sizeof(rgb_matrix::RuntimeOptions) == sizeof(RGBLedRuntimeOptions), "C and C++ out of sync");
+static_assert(sizeof(rgb_matrix::RGBMatrix::VSyncInfo) == sizeof(LedVSyncInfo), "C and C++ out of sync");
+static_assert(sizeof(rgb_matrix::RGBMatrix::Telemetry) == sizeof(LedTelemetry), "C and C++ out of sync");
+static_assert(rgb_matrix::RGBMatrix::kTelemetryBuckets == LED_TELEMETRY_BUCKETS, "C and C++ out of sync");
 
 // Our opaque dummy structs to communicate with the c-world
 struct RGBLedMatrix {};
@@ -89,6 +94,8 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     OPT_COPY_IF_SET(panel_type);
     OPT_COPY_IF_SET(limit_refresh_rate_hz);
     OPT_COPY_IF_SET(disable_busy_waiting);
+    OPT_COPY_IF_SET(packed_framebuffer);
+    OPT_COPY_IF_SET(bit_planes);
 #undef OPT_COPY_IF_SET
   }
 
@@ -97,11 +104,13 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
 #define RT_OPT_COPY_IF_SET(o) if (rt_opts->o) default_rt.o = rt_opts->o
     RT_OPT_COPY_IF_SET(gpio_slowdown);
     RT_OPT_COPY_IF_SET(rp1_rio);
+    RT_OPT_COPY_IF_SET(rp1_pio_sm);
     RT_OPT_COPY_IF_SET(daemon);
     RT_OPT_COPY_IF_SET(drop_privileges);
     RT_OPT_COPY_IF_SET(do_gpio_init);
     RT_OPT_COPY_IF_SET(drop_priv_user);
     RT_OPT_COPY_IF_SET(drop_priv_group);
+    RT_OPT_COPY_IF_SET(telemetry_file);
 #undef RT_OPT_COPY_IF_SET
   }
 
@@ -137,6 +146,8 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     ACTUAL_VALUE_BACK_TO_OPT(panel_type);
     ACTUAL_VALUE_BACK_TO_OPT(limit_refresh_rate_hz);
     ACTUAL_VALUE_BACK_TO_OPT(disable_busy_waiting);
+    ACTUAL_VALUE_BACK_TO_OPT(packed_framebuffer);
+    ACTUAL_VALUE_BACK_TO_OPT(bit_planes);
 #undef ACTUAL_VALUE_BACK_TO_OPT
   }
 
@@ -144,11 +155,13 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
 #define ACTUAL_VALUE_BACK_TO_RT_OPT(o) rt_opts->o = runtime_opt.o
     ACTUAL_VALUE_BACK_TO_RT_OPT(gpio_slowdown);
     ACTUAL_VALUE_BACK_TO_RT_OPT(rp1_rio);
+    ACTUAL_VALUE_BACK_TO_RT_OPT(rp1_pio_sm);
     ACTUAL_VALUE_BACK_TO_RT_OPT(daemon);
     ACTUAL_VALUE_BACK_TO_RT_OPT(drop_privileges);
     ACTUAL_VALUE_BACK_TO_RT_OPT(do_gpio_init);
     ACTUAL_VALUE_BACK_TO_RT_OPT(drop_priv_user);
     ACTUAL_VALUE_BACK_TO_RT_OPT(drop_priv_group);
+    ACTUAL_VALUE_BACK_TO_RT_OPT(telemetry_file);
 #undef ACTUAL_VALUE_BACK_TO_RT_OPT
   }
 
@@ -192,8 +205,31 @@ void led_matrix_print_flags(FILE *out) {
   rgb_matrix::PrintMatrixFlags(out, defaults, rt_opt);
 }
 
+// The C callback of each matrix, called through a C++ VSyncCallback.
+struct CVSyncCallback {
+  LedVSyncCallback callback;
+  void *user_data;
+};
+// Entries stay in place while their callback thread runs; map nodes don't
+// move when others are added or removed.
+static rgb_matrix::Mutex s_vsync_callbacks_mutex;
+static std::map<rgb_matrix::RGBMatrix *, CVSyncCallback> s_vsync_callbacks;
+
+static void CallCVSyncCallback(const rgb_matrix::RGBMatrix::VSyncInfo &info,
+                               void *c_callback) {
+  const CVSyncCallback *cb = static_cast<CVSyncCallback *>(c_callback);
+  cb->callback(reinterpret_cast<const struct LedVSyncInfo *>(&info),
+               cb->user_data);
+}
+
 void led_matrix_delete(struct RGBLedMatrix *matrix) {
-  delete to_matrix(matrix);
+  rgb_matrix::RGBMatrix *const m = to_matrix(matrix);
+  m->SetVSyncCallback(NULL, NULL, 0);
+  {
+    rgb_matrix::MutexLock l(&s_vsync_callbacks_mutex);
+    s_vsync_callbacks.erase(m);
+  }
+  delete m;
 }
 
 struct LedCanvas *led_matrix_get_canvas(struct RGBLedMatrix *matrix) {
@@ -204,11 +240,74 @@ struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *m) {
   return from_canvas(to_matrix(m)->CreateFrameCanvas());
 }
 
+struct LedCanvas *led_matrix_create_shadow_canvas(struct RGBLedMatrix *m) {
+  return from_canvas(to_matrix(m)->CreateShadowFrameCanvas());
+}
+
 struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
                                            struct LedCanvas *canvas) {
   return from_canvas(to_matrix(matrix)->SwapOnVSync(to_canvas(canvas)));
 }
 
+int led_matrix_queue_frame(struct RGBLedMatrix *matrix,
+                           struct LedCanvas *canvas,
+                           uint64_t present_at_usec, uint32_t min_hold_usec) {
+  return to_matrix(matrix)->QueueFrame(to_canvas(canvas), present_at_usec,
+                                       min_hold_usec);
+}
+
+struct LedCanvas *led_matrix_take_recycled_frame(struct RGBLedMatrix *matrix) {
+  return from_canvas(to_matrix(matrix)->TakeRecycledFrame());
+}
+
+int led_matrix_get_vsync_info(struct RGBLedMatrix *matrix,
+                              struct LedVSyncInfo *info) {
+  return to_matrix(matrix)->GetVSyncInfo(
+    reinterpret_cast<rgb_matrix::RGBMatrix::VSyncInfo *>(info));
+}
+
+int led_matrix_await_refresh(struct RGBLedMatrix *matrix, uint64_t refresh,
+                             struct LedVSyncInfo *info, int timeout_ms) {
+  return to_matrix(matrix)->AwaitRefresh(
+    refresh, reinterpret_cast<rgb_matrix::RGBMatrix::VSyncInfo *>(info),
+    timeout_ms);
+}
+
+int led_matrix_set_vsync_callback(struct RGBLedMatrix *matrix,
+                                  LedVSyncCallback callback, void *user_data,
+                                  uint32_t lead_usec) {
+  rgb_matrix::RGBMatrix *const m = to_matrix(matrix);
+  rgb_matrix::MutexLock l(&s_vsync_callbacks_mutex);
+  // Replacing the callback stops the thread calling the old one first.
+  m->SetVSyncCallback(NULL, NULL, 0);
+  if (callback == NULL) {
+    s_vsync_callbacks.erase(m);
+    return 1;
+  }
+  CVSyncCallback &c_callback = s_vsync_callbacks[m];
+  c_callback.callback = callback;
+  c_callback.user_data = user_data;
+  return m->SetVSyncCallback(&CallCVSyncCallback, &c_callback, lead_usec);
+}
+
+void led_matrix_get_telemetry(struct RGBLedMatrix *matrix,
+                              struct LedTelemetry *telemetry) {
+  to_matrix(matrix)->GetTelemetry(
+    reinterpret_cast<rgb_matrix::RGBMatrix::Telemetry *>(telemetry));
+}
+
+int led_matrix_export_telemetry(struct RGBLedMatrix *matrix, const char *path) {
+  return to_matrix(matrix)->ExportTelemetry(path);
+}
+
+void led_matrix_set_tracing(int on) {
+  rgb_matrix::RGBMatrix::SetTracing(on);
+}
+
+int led_matrix_dump_trace(const char *filename) {
+  return rgb_matrix::RGBMatrix::DumpTrace(filename);
+}
+
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix,
                                uint8_t brightness) {
   to_matrix(matrix)->SetBrightness(brightness);
@@ -17,6 +17,7 @@
 
 #include <assert.h>
 #include <grp.h>
+#include <limits.h>
 #include <pwd.h>
 #include <math.h>
 #include <pthread.h>
@@ -24,15 +25,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <atomic>
+
 #include "gpio.h"
+#include "output-backend.h"
 #include "rp1/rp1_pio_backend.h"
 #include "rp1/rp1_rio_backend.h"
+#include "telemetry.h"
 #include "thread.h"
+#include "trace.h"
 #include "framebuffer-internal.h"
 #include "multiplex-mappers-internal.h"
 
@@ -62,6 +70,9 @@ namespace rgb_matrix {
 class RGBMatrix::Impl {
   class UpdateThread;
   friend class UpdateThread;
+  class ShadowConverterThread;
+  friend class ShadowConverterThread;
+  class VSyncCallbackThread;
 
 public:
   // Create an RGBMatrix.
@@ -87,7 +98,15 @@ public:
   bool StartRefresh();
 
   FrameCanvas *CreateFrameCanvas();
+  FrameCanvas *CreateShadowFrameCanvas();
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction);
+  bool QueueFrame(FrameCanvas *frame, uint64_t present_at_usec,
+                  uint32_t min_hold_usec);
+  FrameCanvas *TakeRecycledFrame();
+  bool GetVSyncInfo(VSyncInfo *info);
+  bool AwaitRefresh(uint64_t refresh, VSyncInfo *info, int timeout_ms);
+  bool SetVSyncCallback(VSyncCallback callback, void *user_data,
+                        uint32_t lead_usec);
   bool ApplyPixelMapper(const PixelMapper *mapper);
 
   bool SetPWMBits(uint8_t value);
@@ -115,6 +134,10 @@ private:
   void ApplyNamedPixelMappers(const char *pixel_mapper_config,
                               int chain, int parallel);
 
+  // Swap a FrameCanvas with shadow buffer; conversion happens in
+  // ShadowConverterThread.
+  FrameCanvas *SwapShadowOnVSync(FrameCanvas *other, unsigned frame_fraction);
+
   Options params_;
   bool do_luminance_correct_;
 
@@ -123,6 +146,8 @@ private:
   GPIO *io_;
   Mutex active_frame_sync_;
   UpdateThread *updater_;
+  ShadowConverterThread *shadow_converter_;
+  VSyncCallbackThread *vsync_callback_;
   std::vector<FrameCanvas*> created_frames_;
   internal::PixelDesignatorMap *shared_pixel_mapper_;
   uint64_t user_output_bits_;
@@ -130,6 +155,117 @@ private:
 
 using namespace internal;
 
+// If the pins not used by the matrix can be read and written next to the
+// refresh; not the case if the output is driven by e.g. the RP1 PIO.
+static bool UserGPIOAvailable() {
+  const OutputBackend *backend = Framebuffer::output_backend();
+  return backend == NULL || backend->ExposesGPIO();
+}
+
+// Sleep while "word" still has the value "expected", at most "timeout_ms"
+// if >= 0. Returns right away if it changed already; might wake up early.
+static void FutexWait(std::atomic<uint32_t> *word, uint32_t expected,
+                      long timeout_ms = -1) {
+  static_assert(sizeof(*word) == sizeof(uint32_t), "futex needs 32 bits");
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT_PRIVATE,
+          expected, timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+}
+
+static void FutexWakeAll(std::atomic<uint32_t> *word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE_PRIVATE,
+          INT_MAX, NULL, NULL, 0);
+}
+
+static uint64_t MonotonicMicroseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Fixed size queue from one producing to one consuming thread, neither of
+// which ever waits for the other.
+template <typename T, int kSize>
+class SingleProducerQueue {
+public:
+  SingleProducerQueue() : head_(0), tail_(0) {}
+
+  // Returns false if full.
+  bool Push(const T &value) {
+    const uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == kSize) return false;
+    items_[tail % kSize] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // The oldest element, or NULL if empty. Consumer only.
+  const T *Front() const {
+    const uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) return NULL;
+    return &items_[head % kSize];
+  }
+
+  // Remove the element returned by Front(). Consumer only.
+  void Pop() { head_.fetch_add(1, std::memory_order_release); }
+
+private:
+  T items_[kSize];
+  std::atomic<uint32_t> head_;  // Next to consume.
+  std::atomic<uint32_t> tail_;  // Next to fill.
+};
+
+// Latest value of a struct, written by one thread and read by any without
+// locks: readers retry while a write is in progress.
+template <typename T>
+class SeqLocked {
+public:
+  SeqLocked() : sequence_(0) {
+    for (int i = 0; i < kWords; ++i) words_[i].store(0);
+  }
+
+  void Store(const T &value) {
+    uint64_t words[kWords];
+    memcpy(words, &value, sizeof(value));
+    const uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < kWords; ++i) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  // Returns the sequence number of the value; it changes with every Store().
+  uint32_t Load(T *value) const {
+    uint64_t words[kWords];
+    for (;;) {
+      const uint32_t sequence = sequence_.load(std::memory_order_acquire);
+      if (sequence & 1) continue;  // Writer is in the middle of it.
+      for (int i = 0; i < kWords; ++i) {
+        words[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence_.load(std::memory_order_relaxed) == sequence) {
+        memcpy(value, words, sizeof(*value));
+        return sequence;
+      }
+    }
+  }
+
+  // To FutexWait() on for the next Store().
+  std::atomic<uint32_t> *sequence() { return &sequence_; }
+
+private:
+  static const int kWords = sizeof(T) / sizeof(uint64_t);
+  static_assert(sizeof(T) % sizeof(uint64_t) == 0, "Needs whole words");
+
+  std::atomic<uint32_t> sequence_;
+  std::atomic<uint64_t> words_[kWords];
+};
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
 class RGBMatrix::Impl::UpdateThread : public Thread {
 public:
@@ -139,11 +275,13 @@ public:
     : io_(io), show_refresh_(show_refresh),
       target_frame_usec_(limit_refresh_hz < 1 ? 0 : 1e6/limit_refresh_hz),
       allow_busy_waiting_(allow_busy_waiting),
-      running_(true),
+      running_(true), refresh_usec_(kInitialRefreshUsec),
+      gpio_inputs_(0), input_changes_(0), input_waiters_(0),
       current_frame_(initial_frame), next_frame_(NULL),
-      requested_frame_multiple_(1) {
-    pthread_cond_init(&frame_done_, NULL);
-    pthread_cond_init(&input_change_, NULL);
+      requested_frame_multiple_(1), frames_done_(0), swap_waiters_(0),
+      current_from_queue_(false), shown_since_usec_(0), hold_usec_(0),
+      vsync_waiters_(0), shown_frame_(NULL), last_refresh_start_usec_(0) {
+    memset(&vsync_info_, 0, sizeof(vsync_info_));
     switch (pwm_dither_bits) {
     case 0:
       start_bit_[0] = 0; start_bit_[1] = 0;
@@ -161,8 +299,7 @@ public:
   }
 
   void Stop() {
-    MutexLock l(&running_mutex_);
-    running_ = false;
+    running_.store(false);
   }
 
   virtual void Run() {
@@ -176,38 +313,54 @@ public:
     static const int kHoldffTimeUs = 2000 * 1000;
     uint32_t initial_holdoff_start = GetMicrosecondCounter();
     bool max_measure_enabled = false;
+    bool at_vsync = true;
 
     while (running()) {
+      RGB_TRACE_SPAN("refresh");
       const uint32_t start_time_us = GetMicrosecondCounter();
+      PublishRefresh(at_vsync, frame_count);
+      at_vsync = false;
+
+      // With nothing to show, the panel stays off once the last pulse is
+      // done. The thread idles for the time of a refresh instead, which
+      // keeps the pace of SwapOnVSync().
+      Framebuffer *const framebuffer =
+        current_frame_.load(std::memory_order_relaxed)->framebuffer();
+      const bool dark = framebuffer->IsDark();
+      if (dark) {
+        RGB_TRACE_SPAN("dark idle");
+        if (!target_frame_usec_) SleepMicroseconds(refresh_usec_);
+      } else {
+        framebuffer->DumpToMatrix(start_bit_[low_bit_sequence % 4]);
+      }
 
-      current_frame_->framebuffer()
-        ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
-
-      // SwapOnVSync() exchange.
-      {
-        MutexLock l(&frame_sync_);
-        // Do fast equality test first (likely due to frame_count reset).
-        if (frame_count == requested_frame_multiple_
-            || frame_count % requested_frame_multiple_ == 0) {
-          // We reset to avoid frame hick-up every couple of weeks
-          // run-time iff requested_frame_multiple_ is not a factor of 2^32.
-          frame_count = 0;
-          if (next_frame_ != NULL) {
-            current_frame_ = next_frame_;
-            next_frame_ = NULL;
-          }
-          pthread_cond_signal(&frame_done_);
+      // SwapOnVSync() exchange. Nothing here waits for the other side, so
+      // a preempted caller of SwapOnVSync() can't hold up the refresh.
+      const unsigned frame_multiple = requested_frame_multiple_.load();
+      // Do fast equality test first (likely due to frame_count reset).
+      if (frame_count == frame_multiple || frame_count % frame_multiple == 0) {
+        // We reset to avoid frame hick-up every couple of weeks
+        // run-time iff requested_frame_multiple_ is not a factor of 2^32.
+        frame_count = 0;
+        FrameCanvas *const next = next_frame_.exchange(NULL);
+        if (next != NULL) {
+          current_frame_.store(next);
+          current_from_queue_ = false;
         }
+        at_vsync = true;
+        frames_done_.fetch_add(1);
+        if (swap_waiters_.load() > 0) FutexWakeAll(&frames_done_);
       }
+      PresentQueuedFrame();
 
       // Read input bits.
-      if (!Rp1PioIsActive() && !Rp1RioIsActive()) {
+      if (UserGPIOAvailable()) {
         const gpio_bits_t inputs = io_->Read();
         if (inputs != last_gpio_bits) {
           last_gpio_bits = inputs;
-          MutexLock l(&input_sync_);
-          gpio_inputs_ = inputs;
-          pthread_cond_signal(&input_change_);
+          gpio_inputs_.store(inputs);
+          input_changes_.fetch_add(1);
+          if (input_waiters_.load() > 0) FutexWakeAll(&input_changes_);
         }
       }
 
@@ -215,17 +368,21 @@ public:
       ++low_bit_sequence;
 
       if (target_frame_usec_) {
-        if (allow_busy_waiting_) {
+        RGB_TRACE_SPAN("limit refresh");
+        const uint32_t spent_us = GetMicrosecondCounter() - start_time_us;
+        if (spent_us > target_frame_usec_) {
+          TelemetryAdd(&TelemetryBlock()->missed_refresh_targets, 1);
+        } else if (allow_busy_waiting_ && !dark) {
           while ((GetMicrosecondCounter() - start_time_us) < target_frame_usec_) {
             // busy wait. We have our dedicated core, so ok to burn cycles.
           }
         } else {
-          long spent_us = GetMicrosecondCounter() - start_time_us;
           SleepMicroseconds(target_frame_usec_ - spent_us);
         }
       }
 
       const uint32_t end_time_us = GetMicrosecondCounter();
+      if (!dark) refresh_usec_ = end_time_us - start_time_us;
       if (show_refresh_) {
         uint32_t usec = end_time_us - start_time_us;
         printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
@@ -242,25 +399,150 @@ public:
     }
   }
 
+  // Show "other" from the next frame boundary on, or with NULL, just wait
+  // for it. Returns the frame shown until then. Only one thread may swap at
+  // a time.
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned frame_fraction) {
-    MutexLock l(&frame_sync_);
-    FrameCanvas *previous = current_frame_;
-    next_frame_ = other;
-    requested_frame_multiple_ = frame_fraction;
-    frame_sync_.WaitOn(&frame_done_);
+    RGB_TRACE_SPAN("SwapOnVSync");
+    FrameCanvas *const previous = current_frame_.load();
+    requested_frame_multiple_.store(frame_fraction);
+    const uint32_t wait_start_us = GetMicrosecondCounter();
+    const uint32_t frames_before = frames_done_.load();
+    next_frame_.store(other);
+    swap_waiters_.fetch_add(1);
+    for (;;) {
+      const uint32_t frames_done = frames_done_.load();
+      // Swapped in once the refresh thread took it.
+      if (other != NULL ? next_frame_.load() != other
+                        : frames_done != frames_before) {
+        break;
+      }
+      FutexWait(&frames_done_, frames_done);
+    }
+    swap_waiters_.fetch_sub(1);
+    TelemetryRecord(&TelemetryBlock()->swap_wait,
+                    GetMicrosecondCounter() - wait_start_us);
     return previous;
   }
 
+  bool QueueFrame(FrameCanvas *frame, uint64_t present_at_usec,
+                  uint32_t min_hold_usec) {
+    const QueuedFrame queued = { frame, present_at_usec, min_hold_usec };
+    return present_queue_.Push(queued);
+  }
+
+  FrameCanvas *TakeRecycledFrame() {
+    FrameCanvas *const *frame = recycle_queue_.Front();
+    if (frame == NULL) return NULL;
+    FrameCanvas *const result = *frame;
+    recycle_queue_.Pop();
+    return result;
+  }
+
+  void GetVSyncInfo(VSyncInfo *info) const { published_.Load(info); }
+
+  // Wait until "field" of the published VSyncInfo reaches "value". Returns
+  // false on timeout.
+  bool AwaitVSyncInfo(uint64_t VSyncInfo::*field, uint64_t value,
+                      VSyncInfo *info, int timeout_ms) {
+    const uint64_t deadline_usec =
+      MonotonicMicroseconds() + (uint64_t)timeout_ms * 1000;
+    bool reached;
+    vsync_waiters_.fetch_add(1);
+    for (;;) {
+      const uint32_t sequence = published_.Load(info);
+      reached = info->*field >= value;
+      if (reached) break;
+      long wait_ms = -1;
+      if (timeout_ms >= 0) {
+        const uint64_t now = MonotonicMicroseconds();
+        if (now >= deadline_usec) break;
+        wait_ms = (deadline_usec - now + 999) / 1000;
+      }
+      FutexWait(published_.sequence(), sequence, wait_ms);
+    }
+    vsync_waiters_.fetch_sub(1);
+    return reached;
+  }
+
   gpio_bits_t AwaitInputChange(int timeout_ms) {
-    MutexLock l(&input_sync_);
-    input_sync_.WaitOn(&input_change_, timeout_ms);
-    return gpio_inputs_;
+    input_waiters_.fetch_add(1);
+    FutexWait(&input_changes_, input_changes_.load(), timeout_ms);
+    input_waiters_.fetch_sub(1);
+    return gpio_inputs_.load();
   }
 
 private:
-  inline bool running() {
-    MutexLock l(&running_mutex_);
-    return running_;
+  struct QueuedFrame {
+    FrameCanvas *frame;
+    uint64_t present_at_usec;  // 0: as soon as possible.
+    uint32_t min_hold_usec;
+  };
+
+  inline bool running() { return running_.load(std::memory_order_relaxed); }
+
+  // Called as each refresh starts, with "at_vsync" if it is the first of a
+  // frame and "frame_count" the refreshes since.
+  void PublishRefresh(bool at_vsync, unsigned frame_count) {
+    const uint64_t now = MonotonicMicroseconds();
+    VSyncInfo &info = vsync_info_;
+    Telemetry *const telemetry = TelemetryBlock();
+    if (info.refreshes > 0) {
+      info.refresh_usec = now - last_refresh_start_usec_;
+      TelemetryRecord(&telemetry->refresh_period, info.refresh_usec);
+    }
+    last_refresh_start_usec_ = now;
+    ++info.refreshes;
+    TelemetryAdd(&telemetry->refreshes, 1);
+    if (at_vsync) {
+      ++info.vsyncs;
+      info.vsync_usec = now;
+    }
+    // The boundary comes after the refresh at which frame_count reaches a
+    // multiple; refine the estimate with every refresh.
+    const unsigned multiple = requested_frame_multiple_.load();
+    const unsigned remaining = (multiple - frame_count % multiple) % multiple;
+    info.next_vsync_usec = now + (uint64_t)(remaining + 1) * info.refresh_usec;
+    FrameCanvas *const frame = current_frame_.load(std::memory_order_relaxed);
+    if (frame != shown_frame_) {
+      shown_frame_ = frame;
+      info.frame_shown_usec = now;
+      info.frame_refreshes = 0;
+    }
+    ++info.frame_refreshes;
+    published_.Store(info);
+    if (vsync_waiters_.load() > 0) FutexWakeAll(published_.sequence());
+  }
+
+  // Swap in the next queued frame once it is due and the current one was
+  // shown long enough. Of several timed frames that are due, only the last
+  // is shown; frames without a time are never skipped.
+  void PresentQueuedFrame() {
+    const QueuedFrame *next = present_queue_.Front();
+    if (next == NULL) return;
+    const uint64_t now = MonotonicMicroseconds();
+    if (now - shown_since_usec_ < hold_usec_) return;
+    if (next->present_at_usec > now) return;
+    QueuedFrame frame = *next;
+    present_queue_.Pop();
+    while (frame.present_at_usec != 0
+           && (next = present_queue_.Front()) != NULL
+           && next->present_at_usec != 0 && next->present_at_usec <= now) {
+      recycle_queue_.Push(frame.frame);
+      TelemetryAdd(&TelemetryBlock()->late_frames, 1);
+      frame = *next;
+      present_queue_.Pop();
+    }
+    // Only frames that came through QueueFrame() are handed back; not the
+    // initial frame or one from SwapOnVSync(). If the producer doesn't take
+    // them back, they stay with the matrix.
+    FrameCanvas *const previous = current_frame_.exchange(frame.frame);
+    if (current_from_queue_ && previous != frame.frame) {
+      recycle_queue_.Push(previous);
+    }
+    current_from_queue_ = true;
+    shown_since_usec_ = now;
+    hold_usec_ = frame.min_hold_usec;
   }
 
   GPIO *const io_;
@@ -269,18 +551,160 @@ private:
   const bool allow_busy_waiting_;
   uint32_t start_bit_[4];
 
-  Mutex running_mutex_;
+  // Time a refresh is assumed to take before the first one is measured.
+  static const uint32_t kInitialRefreshUsec = 5000;
+
+  std::atomic<bool> running_;
+  uint32_t refresh_usec_;  // Time the last refresh took.
+
+  // Inputs as last read, and the number of changes seen, to wait on.
+  std::atomic<gpio_bits_t> gpio_inputs_;
+  std::atomic<uint32_t> input_changes_;
+  std::atomic<int> input_waiters_;
+
+  // The refresh thread and SwapOnVSync() only exchange atomics; the waiting
+  // side sleeps on a futex for frames_done_ to change.
+  std::atomic<FrameCanvas*> current_frame_;
+  std::atomic<FrameCanvas*> next_frame_;  // Taken at the next frame boundary.
+  std::atomic<unsigned> requested_frame_multiple_;
+  std::atomic<uint32_t> frames_done_;     // Frame boundaries passed.
+  std::atomic<int> swap_waiters_;
+
+  // QueueFrame() to the refresh thread, and the frames it is done with back.
+  SingleProducerQueue<QueuedFrame,
+                      RGBMatrix::kPresentationQueueSize> present_queue_;
+  SingleProducerQueue<FrameCanvas*,
+                      RGBMatrix::kPresentationQueueSize + 1> recycle_queue_;
+  bool current_from_queue_;    // current_frame_ came from present_queue_.
+  uint64_t shown_since_usec_;  // When the current queued frame was swapped in.
+  uint32_t hold_usec_;         // How long it stays at least.
+
+  // Timing as of the latest refresh; vsync_info_ is the refresh thread's
+  // copy, published_ what everyone else reads.
+  SeqLocked<VSyncInfo> published_;
+  std::atomic<int> vsync_waiters_;
+  VSyncInfo vsync_info_;
+  FrameCanvas *shown_frame_;
+  uint64_t last_refresh_start_usec_;
+};
+
+// Converts FrameCanvases with shadow buffer into their bitplanes outside the
+// caller's thread, then swaps them in. Only one frame is in flight at a time.
+class RGBMatrix::Impl::ShadowConverterThread : public Thread {
+public:
+  ShadowConverterThread(RGBMatrix::Impl *matrix)
+    : matrix_(matrix), running_(true), pending_(NULL), pending_fraction_(1) {
+    pthread_cond_init(&state_change_, NULL);
+  }
+
+  void Stop() {
+    MutexLock l(&mutex_);
+    running_ = false;
+    pthread_cond_broadcast(&state_change_);
+  }
+
+  // Hand over the frame for conversion; waits while the previous one is
+  // still in flight. Returns the frame that was last submitted to the
+  // display, i.e. the one "frame" replaces.
+  FrameCanvas *Submit(FrameCanvas *frame, unsigned frame_fraction) {
+    MutexLock l(&mutex_);
+    while (pending_ != NULL) mutex_.WaitOn(&state_change_);
+    FrameCanvas *previous;
+    {
+      MutexLock active_lock(&matrix_->active_frame_sync_);
+      previous = matrix_->active_;
+    }
+    pending_ = frame;
+    pending_fraction_ = frame_fraction;
+    pthread_cond_broadcast(&state_change_);
+    return previous;
+  }
+
+  // Wait until the frame in flight, if any, is converted and swapped in.
+  void WaitIdle() {
+    MutexLock l(&mutex_);
+    while (pending_ != NULL) mutex_.WaitOn(&state_change_);
+  }
+
+  virtual void Run() {
+    for (;;) {
+      FrameCanvas *frame;
+      unsigned frame_fraction;
+      {
+        MutexLock l(&mutex_);
+        while (running_ && pending_ == NULL) mutex_.WaitOn(&state_change_);
+        if (!running_) return;
+        frame = pending_;
+        frame_fraction = pending_fraction_;
+      }
+
+      frame->framebuffer()->ConvertShadow();
+      frame->framebuffer()->MarkClean();
+      matrix_->updater_->SwapOnVSync(frame, frame_fraction);
+      {
+        MutexLock active_lock(&matrix_->active_frame_sync_);
+        matrix_->active_ = frame;
+      }
+
+      MutexLock l(&mutex_);
+      pending_ = NULL;
+      pthread_cond_broadcast(&state_change_);
+    }
+  }
+
+private:
+  RGBMatrix::Impl *const matrix_;
+  Mutex mutex_;
+  pthread_cond_t state_change_;
   bool running_;
+  FrameCanvas *pending_;
+  unsigned pending_fraction_;
+};
 
-  Mutex input_sync_;
-  pthread_cond_t input_change_;
-  gpio_bits_t gpio_inputs_;
+// Calls the user's VSyncCallback once per frame, shortly before the refresh
+// thread is estimated to reach the next frame boundary.
+class RGBMatrix::Impl::VSyncCallbackThread : public Thread {
+public:
+  VSyncCallbackThread(UpdateThread *updater, VSyncCallback callback,
+                      void *user_data, uint32_t lead_usec)
+    : updater_(updater), callback_(callback), user_data_(user_data),
+      lead_usec_(lead_usec), running_(true) {}
+
+  void Stop() { running_.store(false); }
 
-  Mutex frame_sync_;
-  pthread_cond_t frame_done_;
-  FrameCanvas *current_frame_;
-  FrameCanvas *next_frame_;
-  unsigned requested_frame_multiple_;
+  virtual void Run() {
+    // Longest we sleep or wait before looking at running_ again.
+    static const int kPollMs = 100;
+    uint64_t called_for_vsync = 0;
+    VSyncInfo info;
+    while (running_.load()) {
+      updater_->GetVSyncInfo(&info);
+      if (info.vsyncs == called_for_vsync) {
+        updater_->AwaitVSyncInfo(&VSyncInfo::vsyncs, called_for_vsync + 1,
+                                 &info, kPollMs);
+        continue;
+      }
+      // The estimate gets better with every refresh; look again once close.
+      const uint64_t now = MonotonicMicroseconds();
+      const uint64_t call_at = info.next_vsync_usec > lead_usec_
+        ? info.next_vsync_usec - lead_usec_ : 0;
+      if (now < call_at) {
+        const uint64_t wait_usec = call_at - now;
+        SleepMicroseconds(wait_usec < kPollMs * 1000 ? wait_usec
+                                                     : kPollMs * 1000);
+        continue;
+      }
+      callback_(info, user_data_);
+      called_for_vsync = info.vsyncs;
+    }
+  }
+
+private:
+  UpdateThread *const updater_;
+  const VSyncCallback callback_;
+  void *const user_data_;
+  const uint32_t lead_usec_;
+  std::atomic<bool> running_;
 };
 
 // Some defaults. See options-initialize.cc for the command line parsing.
@@ -296,6 +720,7 @@ RGBMatrix::Options::Options() :
 
   rows(32), cols(32), chain_length(1), parallel(1),
   pwm_bits(internal::Framebuffer::kDefaultBitPlanes),
+  bit_planes(internal::Framebuffer::kDefaultBitPlanes),
 
 #ifdef LSB_PWM_NANOSECONDS
     pwm_lsb_nanoseconds(LSB_PWM_NANOSECONDS),
@@ -341,10 +766,11 @@ RGBMatrix::Options::Options() :
   limit_refresh_rate_hz(0),
 #endif
 #ifdef DISABLE_BUSY_WAITING
-    disable_busy_waiting(true)
+    disable_busy_waiting(true),
 #else
-    disable_busy_waiting(false)
+    disable_busy_waiting(false),
 #endif
+  packed_framebuffer(false)
 {
   // Nothing to see here.
 }
@@ -362,6 +788,7 @@ static void PrintOptions(const RGBMatrix::Options &o) {
   P_INT(chain_length);
   P_INT(parallel);
   P_INT(pwm_bits);
+  P_INT(bit_planes);
   P_INT(pwm_lsb_nanoseconds);
   P_INT(pwm_dither_bits);
   P_INT(brightness);
@@ -376,6 +803,7 @@ static void PrintOptions(const RGBMatrix::Options &o) {
   P_STR(panel_type);
   P_INT(limit_refresh_rate_hz);
   P_BOOL(disable_busy_waiting);
+  P_BOOL(packed_framebuffer);
 #undef P_INT
 #undef P_STR
 #undef P_BOOL
@@ -383,8 +811,9 @@ static void PrintOptions(const RGBMatrix::Options &o) {
 #endif  // DEBUG_MATRIX_OPTIONS
 
 RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
-  : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL),
-    user_output_bits_(0) {
+  : params_(options), io_(NULL), updater_(NULL), shadow_converter_(NULL),
+    vsync_callback_(NULL),
+    shared_pixel_mapper_(NULL), user_output_bits_(0) {
   assert(params_.Validate(NULL));
 #if DEBUG_MATRIX_OPTIONS
   PrintOptions(params_);
@@ -419,6 +848,14 @@ RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
 }
 
 RGBMatrix::Impl::~Impl() {
+  SetVSyncCallback(NULL, NULL, 0);
+  if (shadow_converter_) {  // Needs the updater, so stop first.
+    shadow_converter_->WaitIdle();
+    shadow_converter_->Stop();
+    shadow_converter_->WaitStopped();
+  }
+  delete shadow_converter_;
+
   if (updater_) {
     updater_->Stop();
     updater_->WaitStopped();
@@ -427,9 +864,10 @@ RGBMatrix::Impl::~Impl() {
 
   // Make sure LEDs are off.
   active_->Clear();
-  if (io_) active_->framebuffer()->DumpToMatrix(io_, 0);
-  internal::Rp1RioDeinit();
-  internal::Rp1PioDeinit();
+  active_->framebuffer()->ConvertShadow();
+  if (io_) active_->framebuffer()->DumpToMatrix(0);
+  // The RP1 backends claim their hardware per matrix; release it.
+  if (!UserGPIOAvailable()) Framebuffer::ResetGlobals();
 
   for (size_t i = 0; i < created_frames_.size(); ++i) {
     delete created_frames_[i];
@@ -442,19 +880,19 @@ RGBMatrix::~RGBMatrix() {
 }
 
 uint64_t RGBMatrix::Impl::RequestInputs(uint64_t bits) {
-  if (Rp1PioIsActive() || Rp1RioIsActive()) return 0;
+  if (!UserGPIOAvailable()) return 0;
   return io_->RequestInputs(static_cast<gpio_bits_t>(bits));
 }
 
 uint64_t RGBMatrix::Impl::RequestOutputs(uint64_t output_bits) {
-  if (Rp1PioIsActive() || Rp1RioIsActive()) return 0;
+  if (!UserGPIOAvailable()) return 0;
   uint64_t success_bits = io_->InitOutputs(static_cast<gpio_bits_t>(output_bits));
   user_output_bits_ |= success_bits;
   return success_bits;
 }
 
 void RGBMatrix::Impl::OutputGPIO(uint64_t output_bits) {
-  if (Rp1PioIsActive() || Rp1RioIsActive()) return;
+  if (!UserGPIOAvailable()) return;
   io_->WriteMaskedBits(static_cast<gpio_bits_t>(output_bits), static_cast<gpio_bits_t>(user_output_bits_));
 }
 
@@ -490,7 +928,12 @@ void RGBMatrix::Impl::SetGPIO(GPIO *io, bool start_thread) {
                           !params_.disable_hardware_pulsing,
                           params_.pwm_lsb_nanoseconds, params_.pwm_dither_bits,
                           params_.row_address_type);
-    Framebuffer::InitializePanels(io_, params_.panel_type,
+    // Leaving out empty bitplanes shortens the refresh depending on the
+    // content, which only doesn't show as changing brightness if the time
+    // between refreshes is fixed.
+    Framebuffer::output_backend()->SetSkipEmptyPlanes(
+      params_.limit_refresh_rate_hz > 0);
+    Framebuffer::InitializePanels(params_.panel_type,
                                   params_.cols * params_.chain_length);
   }
   if (start_thread) {
@@ -521,9 +964,11 @@ FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
     new FrameCanvas(new Framebuffer(params_.rows,
                                     params_.cols * params_.chain_length,
                                     params_.parallel,
+                                    params_.bit_planes,
                                     params_.scan_mode,
                                     params_.led_rgb_sequence,
                                     params_.inverse_colors,
+                                    params_.packed_framebuffer,
                                     &shared_pixel_mapper_));
   if (created_frames_.empty()) {
     // First time. Get defaults from initial Framebuffer.
@@ -552,18 +997,95 @@ FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
   return result;
 }
 
+FrameCanvas *RGBMatrix::Impl::CreateShadowFrameCanvas() {
+  FrameCanvas *result = CreateFrameCanvas();
+  result->framebuffer()->EnableShadow();
+  return result;
+}
+
 FrameCanvas *RGBMatrix::Impl::SwapOnVSync(FrameCanvas *other,
                                           unsigned frame_fraction) {
   if (frame_fraction == 0) frame_fraction = 1; // correct user error.
   if (!updater_) return NULL;
+  if (other != NULL && other->framebuffer()->has_shadow()) {
+    return SwapShadowOnVSync(other, frame_fraction);
+  }
+  if (shadow_converter_) shadow_converter_->WaitIdle();
+  if (other) other->framebuffer()->MarkClean();
   FrameCanvas *const previous = updater_->SwapOnVSync(other, frame_fraction);
-  if (other) active_ = other;
+  if (other) {
+    MutexLock l(&active_frame_sync_);
+    active_ = other;
+  }
+  return previous;
+}
+
+FrameCanvas *RGBMatrix::Impl::SwapShadowOnVSync(FrameCanvas *other,
+                                                unsigned frame_fraction) {
+  if (shadow_converter_ == NULL) {
+    shadow_converter_ = new ShadowConverterThread(this);
+    // Stay away from the refresh thread on core 3.
+    shadow_converter_->Start(0, (1<<0) | (1<<1) | (1<<2));
+  }
+  FrameCanvas *const previous = shadow_converter_->Submit(other,
+                                                          frame_fraction);
+  // Drawing on a shadow canvas does not touch what is on screen, so it can
+  // be handed back right away. Other canvases are only safe to draw on once
+  // they have been swapped out.
+  if (!previous->framebuffer()->has_shadow()) {
+    shadow_converter_->WaitIdle();
+  }
   return previous;
 }
 
+bool RGBMatrix::Impl::QueueFrame(FrameCanvas *frame, uint64_t present_at_usec,
+                                 uint32_t min_hold_usec) {
+  if (!updater_ || frame == NULL) return false;
+  // The refresh thread shows what it gets as it is; no conversion thread.
+  frame->framebuffer()->ConvertShadow();
+  frame->framebuffer()->MarkClean();
+  return updater_->QueueFrame(frame, present_at_usec, min_hold_usec);
+}
+
+FrameCanvas *RGBMatrix::Impl::TakeRecycledFrame() {
+  if (!updater_) return NULL;
+  return updater_->TakeRecycledFrame();
+}
+
+bool RGBMatrix::Impl::GetVSyncInfo(VSyncInfo *info) {
+  if (!updater_) return false;
+  updater_->GetVSyncInfo(info);
+  return true;
+}
+
+bool RGBMatrix::Impl::AwaitRefresh(uint64_t refresh, VSyncInfo *info,
+                                   int timeout_ms) {
+  if (!updater_) return false;
+  VSyncInfo ignored;
+  return updater_->AwaitVSyncInfo(&VSyncInfo::refreshes, refresh,
+                                  info ? info : &ignored, timeout_ms);
+}
+
+bool RGBMatrix::Impl::SetVSyncCallback(VSyncCallback callback,
+                                       void *user_data, uint32_t lead_usec) {
+  if (vsync_callback_) {
+    vsync_callback_->Stop();
+    vsync_callback_->WaitStopped();
+    delete vsync_callback_;
+    vsync_callback_ = NULL;
+  }
+  if (callback == NULL) return true;
+  if (!updater_) return false;
+  vsync_callback_ = new VSyncCallbackThread(updater_, callback, user_data,
+                                            lead_usec);
+  // Stay away from the refresh thread on core 3.
+  vsync_callback_->Start(0, (1<<0) | (1<<1) | (1<<2));
+  return true;
+}
+
 uint64_t RGBMatrix::Impl::AwaitInputChange(int timeout_ms) {
   if (!updater_) return 0;
-  if (Rp1PioIsActive() || Rp1RioIsActive()) return 0;
+  if (!UserGPIOAvailable()) return 0;
   return updater_->AwaitInputChange(timeout_ms);
 }
 
@@ -606,7 +1128,7 @@ bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
     return false;
   }
   PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
-    new_width, new_height, shared_pixel_mapper_->GetFillColorBits());
+    new_width, new_height, *shared_pixel_mapper_);
   switch (mapper->GetMappingType()) {
     case PixelMapper::VisibleToMatrix:
       for (int y = 0; y < new_height; ++y) {
@@ -620,9 +1142,7 @@ bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
                     "%dx%d]\n", x, y, orig_x, orig_y, old_width, old_height);
             continue;
           }
-          const internal::PixelDesignator *orig_designator;
-          orig_designator = shared_pixel_mapper_->get(orig_x, orig_y);
-          *new_mapper->get(x, y) = *orig_designator;
+          new_mapper->CopyPixel(x, y, *shared_pixel_mapper_, orig_x, orig_y);
         }
       }
       break;
@@ -640,14 +1160,11 @@ bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
                       x, y, new_x, new_y, new_width, new_height);
               continue;
             }
-            const internal::PixelDesignator *orig_designator;
-            orig_designator = shared_pixel_mapper_->get(x, y);
-            internal::PixelDesignator *new_designator = new_mapper->get(new_x, new_y);
-            if (new_designator->gpio_word >= 0 && !collision_reported) {
+            if (new_mapper->IsUsed(new_x, new_y) && !collision_reported) {
               fprintf(stderr, "Warning: MapMatrixToVisible: %s mapped twice to the same pixel (%d, %d) -> (%d, %d)\n", mapper->GetName(), x, y, new_x, new_y);
               collision_reported = true;
             }
-            *new_designator = *orig_designator;
+            new_mapper->CopyPixel(new_x, new_y, *shared_pixel_mapper_, x, y);
           }
         }
       }
@@ -656,6 +1173,12 @@ bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
   }
   delete shared_pixel_mapper_;
   shared_pixel_mapper_ = new_mapper;
+
+  // Shadow buffers are in visible coordinates, so their size follows.
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    if (created_frames_[i]->framebuffer()->has_shadow())
+      created_frames_[i]->framebuffer()->EnableShadow();
+  }
   return true;
 }
 
@@ -722,6 +1245,11 @@ RGBMatrix *RGBMatrix::CreateFromOptions(const RGBMatrix::Options &options,
             runtime_options.rp1_rio);
     return NULL;
   }
+  if (runtime_options.rp1_pio_sm < 1 || runtime_options.rp1_pio_sm > 4) {
+    fprintf(stderr, "--led-rp1-pio-sm=%d is outside usable range 1..4\n",
+            runtime_options.rp1_pio_sm);
+    return NULL;
+  }
 
   // Use file-scope GPIO instance.
   GPIO &io = s_global_io;
@@ -739,6 +1267,7 @@ RGBMatrix *RGBMatrix::CreateFromOptions(const RGBMatrix::Options &options,
   }
   if (use_rp1_pio) {
     Rp1PioSetGpioSlowdown(runtime_options.gpio_slowdown);
+    Rp1PioSetStateMachines(runtime_options.rp1_pio_sm);
   }
 
   const bool pi5_backend_available =
@@ -776,6 +1305,12 @@ RGBMatrix *RGBMatrix::CreateFromOptions(const RGBMatrix::Options &options,
     perror("Failed to become daemon");
   }
 
+  // Before dropping privileges, as the file might be somewhere only root
+  // can write.
+  if (runtime_options.telemetry_file && *runtime_options.telemetry_file) {
+    TelemetryExport(runtime_options.telemetry_file);
+  }
+
   RGBMatrix::Impl *result = new RGBMatrix::Impl(NULL, options);
   // Allowing daemon also means we are allowed to start the thread now.
   const bool allow_daemon = !(runtime_options.daemon < 0);
@@ -813,10 +1348,41 @@ RGBMatrix *RGBMatrix::CreateFromFlags(int *argc, char ***argv,
 FrameCanvas *RGBMatrix::CreateFrameCanvas() {
   return impl_->CreateFrameCanvas();
 }
+FrameCanvas *RGBMatrix::CreateShadowFrameCanvas() {
+  return impl_->CreateShadowFrameCanvas();
+}
 FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other,
                                     unsigned framerate_fraction) {
   return impl_->SwapOnVSync(other, framerate_fraction);
 }
+bool RGBMatrix::QueueFrame(FrameCanvas *frame, uint64_t present_at_usec,
+                           uint32_t min_hold_usec) {
+  return impl_->QueueFrame(frame, present_at_usec, min_hold_usec);
+}
+FrameCanvas *RGBMatrix::TakeRecycledFrame() {
+  return impl_->TakeRecycledFrame();
+}
+bool RGBMatrix::GetVSyncInfo(VSyncInfo *info) {
+  return impl_->GetVSyncInfo(info);
+}
+bool RGBMatrix::AwaitRefresh(uint64_t refresh, VSyncInfo *info,
+                             int timeout_ms) {
+  return impl_->AwaitRefresh(refresh, info, timeout_ms);
+}
+bool RGBMatrix::SetVSyncCallback(VSyncCallback callback, void *user_data,
+                                 uint32_t lead_usec) {
+  return impl_->SetVSyncCallback(callback, user_data, lead_usec);
+}
+void RGBMatrix::GetTelemetry(Telemetry *telemetry) {
+  TelemetrySnapshot(telemetry);
+}
+bool RGBMatrix::ExportTelemetry(const char *path) {
+  return TelemetryExport(path);
+}
+void RGBMatrix::SetTracing(bool on) { internal::SetTracing(on); }
+bool RGBMatrix::DumpTrace(const char *filename) {
+  return internal::DumpTrace(filename);
+}
 bool RGBMatrix::ApplyPixelMapper(const PixelMapper *mapper) {
   return impl_->ApplyPixelMapper(mapper);
 }
@@ -882,6 +1448,14 @@ void FrameCanvas::SetPixels(int x, int y, int width, int height,
                          Color *colors) {
   frame_->SetPixels(x, y, width, height, colors);
 }
+void FrameCanvas::SetImageRect(int x, int y, int width, int height,
+                               const uint8_t *image, size_t row_stride,
+                               bool is_bgr) {
+  frame_->SetImage(x, y, width, height, image, row_stride, is_bgr);
+}
+uint32_t FrameCanvas::conversion_usec() const {
+  return frame_->conversion_usec();
+}
 void FrameCanvas::Clear() { return frame_->Clear(); }
 void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   frame_->Fill(red, green, blue);
@@ -908,4 +1482,12 @@ bool FrameCanvas::Deserialize(const char *data, size_t len) {
 void FrameCanvas::CopyFrom(const FrameCanvas &other) {
   frame_->CopyFrom(other.frame_);
 }
+bool FrameCanvas::is_packed() const { return frame_->packed(); }
+int FrameCanvas::band_count() const { return frame_->double_rows(); }
+uint32_t FrameCanvas::dirty_planes(int band) const {
+  return frame_->dirty_planes(band);
+}
+uint64_t FrameCanvas::band_version(int band) const {
+  return frame_->band_version(band);
+}
 }  // end namespace rgb_matrix
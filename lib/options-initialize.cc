@@ -42,7 +42,9 @@ RuntimeOptions::RuntimeOptions() :
   drop_privileges(1),   // Encourage good practice: drop privileges by default.
   do_gpio_init(true),
   drop_priv_user("daemon"),
-  drop_priv_group("daemon")
+  drop_priv_group("daemon"),
+  telemetry_file(NULL),
+  rp1_pio_sm(1)
 {
   // Nothing to see here.
 }
@@ -144,6 +146,7 @@ static bool FlagInit(int &argc, char **&argv,
   bool bool_scratch;
   int err = 0;
   bool posix_end_option_seen = false;  // end of options '--'
+  bool pwm_bits_given = false, bit_planes_given = false;
   for (/**/; it < end; ++it) {
     posix_end_option_seen |= (strcmp(*it, "--") == 0);
     if (!posix_end_option_seen) {
@@ -173,8 +176,14 @@ static bool FlagInit(int &argc, char **&argv,
         continue;
       if (ConsumeIntFlag("scan-mode", it, end, &mopts->scan_mode, &err))
         continue;
-      if (ConsumeIntFlag("pwm-bits", it, end, &mopts->pwm_bits, &err))
+      if (ConsumeIntFlag("pwm-bits", it, end, &mopts->pwm_bits, &err)) {
+        pwm_bits_given = true;
         continue;
+      }
+      if (ConsumeIntFlag("bit-planes", it, end, &mopts->bit_planes, &err)) {
+        bit_planes_given = true;
+        continue;
+      }
       if (ConsumeIntFlag("pwm-lsb-nanoseconds", it, end,
                          &mopts->pwm_lsb_nanoseconds, &err))
         continue;
@@ -191,6 +200,9 @@ static bool FlagInit(int &argc, char **&argv,
         continue;
       if (ConsumeBoolFlag("inverse", it, &mopts->inverse_colors))
         continue;
+      if (ConsumeBoolFlag("packed-framebuffer", it,
+                          &mopts->packed_framebuffer))
+        continue;
       // We don't have a swap_green_blue option anymore, but we simulate the
       // flag for a while.
       bool swap_green_blue;
@@ -236,6 +248,16 @@ static bool FlagInit(int &argc, char **&argv,
         }
         continue;
       }
+      const int err_before_rp1_pio_sm = err;
+      if (ConsumeIntFlag("rp1-pio-sm", it, end, &ropts->rp1_pio_sm, &err)) {
+        if (err == err_before_rp1_pio_sm
+            && (ropts->rp1_pio_sm < 1 || ropts->rp1_pio_sm > 4)) {
+          fprintf(stderr, "%s%s=%d is outside usable range 1..4\n",
+                  OPTION_PREFIX, "rp1-pio-sm", ropts->rp1_pio_sm);
+          ++err;
+        }
+        continue;
+      }
       if (ropts->daemon >= 0 && ConsumeBoolFlag("daemon", it, &bool_scratch)) {
         ropts->daemon = bool_scratch ? 1 : 0;
         continue;
@@ -253,6 +275,10 @@ static bool FlagInit(int &argc, char **&argv,
                             &ropts->drop_priv_group, &err)) {
         continue;
       }
+      if (ConsumeStringFlag("telemetry-file", it, end,
+                            &ropts->telemetry_file, &err)) {
+        continue;
+      }
 
       if (strncmp(*it, OPTION_PREFIX, OPTION_PREFIX_LEN) == 0) {
         fprintf(stderr, "Option %s starts with %s but it is unknown. Typo?\n",
@@ -262,6 +288,11 @@ static bool FlagInit(int &argc, char **&argv,
     unused_options.push_back(*it);
   }
 
+  // Unless asked otherwise, show all the planes we have.
+  if (bit_planes_given && !pwm_bits_given) {
+    mopts->pwm_bits = mopts->bit_planes;
+  }
+
   if (err > 0) {
     return false;
   }
@@ -337,7 +368,8 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "\t--led-pixel-mapper        : Semicolon-separated list of pixel-mappers to arrange pixels.\n"
           "\t                            Optional params after a colon e.g. \"U-mapper;Rotate:90\"\n"
           "\t                            Available: %s. Default: \"\"\n"
-          "\t--led-pwm-bits=<1..%d>    : PWM bits (Default: %d).\n"
+          "\t--led-pwm-bits=<1..%d>    : PWM bits; at most bit-planes (Default: %d).\n"
+          "\t--led-bit-planes=<1..%d>  : Bitplanes in frame buffers (Default: %d).\n"
           "\t--led-brightness=<percent>: Brightness in percent (Default: %d).\n"
           "\t--led-scan-mode=<0..1>    : 0 = progressive; 1 = interlaced "
           "(Default: %d).\n"
@@ -356,12 +388,14 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "(Default: 0)\n"
           "\t--led-%shardware-pulse   : %sse hardware pin-pulse generation.\n"
           "\t--led-panel-type=<name>   : Needed to initialize special panels. Supported: 'FM6126A', 'FM6127'\n"
-          "\t--led-%sbusy-waiting     : %sse busy waiting when limiting refresh rate.\n",
+          "\t--led-%sbusy-waiting     : %sse busy waiting when limiting refresh rate.\n"
+          "\t--led-%spacked-framebuffer : %sse compact frame buffers.\n",
           d.hardware_mapping,
           d.rows, d.cols, d.chain_length, d.parallel,
           (int) muxers.size(), CreateAvailableMultiplexString(muxers).c_str(),
           available_mappers.c_str(),
-          internal::Framebuffer::kBitPlanes, d.pwm_bits,
+          internal::Framebuffer::kMaxBitPlanes, d.pwm_bits,
+          internal::Framebuffer::kMaxBitPlanes, d.bit_planes,
           d.brightness, d.scan_mode,
           d.show_refresh_rate ? "no-" : "", d.show_refresh_rate ? "Don't s" : "S",
           d.limit_refresh_rate_hz,
@@ -370,7 +404,9 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           !d.disable_hardware_pulsing ? "no-" : "",
           !d.disable_hardware_pulsing ? "Don't u" : "U",
           !d.disable_busy_waiting ? "no-" : "",
-          !d.disable_busy_waiting ? "Don't u" : "U");
+          !d.disable_busy_waiting ? "Don't u" : "U",
+          d.packed_framebuffer ? "no-" : "",
+          d.packed_framebuffer ? "Don't u" : "U");
 
   fprintf(out,
           "\t--led-slowdown-gpio=<%d..4>: "
@@ -404,6 +440,10 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
             "Drop privileges to this groupname or GID (Default: '%s')\n",
             r.drop_priv_group);
   }
+  fprintf(out, "\t--led-telemetry-file=<file>: "
+          "Export refresh telemetry to this shared memory file, e.g.\n"
+          "\t                            /dev/shm/rgb-matrix-telemetry "
+          "(Default: none)\n");
 }
 
 bool RGBMatrix::Options::Validate(std::string *err_in) const {
@@ -454,16 +494,30 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
+  // One byte per parallel chain only saves memory over one GPIO word.
+  if (packed_framebuffer && parallel >= (int)sizeof(gpio_bits_t)) {
+    err->append("Packed framebuffer (--led-packed-framebuffer) does not save "
+                "memory with this many parallel chains.\n");
+    success = false;
+  }
+
   if (brightness < 1 || brightness > 100) {
     err->append("Brightness outside usable range (Percent 1..100 allowed).\n");
     success = false;
   }
 
-  if (pwm_bits <= 0 || pwm_bits > internal::Framebuffer::kBitPlanes) {
+  if (bit_planes <= 0 || bit_planes > internal::Framebuffer::kMaxBitPlanes) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "Invalid range of bit-planes (1..%d allowed).\n",
+             internal::Framebuffer::kMaxBitPlanes);
+    err->append(buffer);
+    success = false;
+  } else if (pwm_bits <= 0 || pwm_bits > bit_planes) {
     char buffer[256];
     snprintf(buffer, sizeof(buffer),
-             "Invalid range of pwm-bits (1..%d allowed).\n",
-             internal::Framebuffer::kBitPlanes);
+             "Invalid range of pwm-bits (1..%d allowed with %d bit-planes).\n",
+             bit_planes, bit_planes);
     err->append(buffer);
     success = false;
   }
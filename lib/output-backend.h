@@ -0,0 +1,55 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef RPI_RGBMATRIX_OUTPUT_BACKEND_H
+#define RPI_RGBMATRIX_OUTPUT_BACKEND_H
+
+namespace rgb_matrix {
+namespace internal {
+class Framebuffer;
+
+// Everything between the Framebuffer and the pins: clocking in the
+// bitplanes, row addressing and the on-time of each plane. Implemented by
+// the classic GPIO output (all Pis up to the Pi 4) and the RP1 PIO and RIO
+// renderers of the Pi 5.
+//
+// Framebuffer::InitGPIO() picks and initializes the backend; deleting it
+// releases the hardware resources it claimed.
+class OutputBackend {
+public:
+  virtual ~OutputBackend() {}
+
+  // Send the initialization sequence some panel types need (e.g. FM6126A)
+  // to "columns" columns.
+  virtual void InitializePanels(const char *panel_type, int columns) = 0;
+
+  // Show one full PWM cycle of the framebuffer. Bitplanes below
+  // "pwm_low_bit" are skipped (used for dithering).
+  virtual void DumpFramebuffer(const Framebuffer *framebuffer,
+                               int pwm_low_bit) = 0;
+
+  // Allow leaving out the bitplanes of a row that have no LED on, see
+  // Framebuffer::empty_planes(). A refresh then takes less time the darker
+  // the content, so this is only visually safe if something else keeps the
+  // time between refreshes constant, such as --led-limit-refresh. Ignored by
+  // backends that have nothing to gain from it.
+  virtual void SetSkipEmptyPlanes(bool skip) {}
+
+  // If the GPIO registers are directly accessible, so that the unused pins
+  // can be read and written by the user next to the refresh.
+  virtual bool ExposesGPIO() const = 0;
+};
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_OUTPUT_BACKEND_H
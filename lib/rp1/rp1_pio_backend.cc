@@ -11,20 +11,22 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <deque>
 #include <string>
 #include <vector>
 
 #include "../framebuffer-internal.h"
 #include "../gpio.h"
 #include "../hardware-mapping.h"
+#include "../output-backend.h"
+#include "../trace.h"
+#include "thread.h"
 
 extern "C" {
 #include "hardware/pio.h"
 #include "piolib.h"
 }
 
-#include "piomatter/protomatter.pio.h"
-
 namespace rgb_matrix {
 namespace internal {
 namespace {
@@ -33,39 +35,89 @@ namespace {
 // - framebuffer.cc still decides row order and prepares one GPIO bitmap per
 //   pixel clock in the software framebuffer.
 // - this backend repackages those GPIO bitmaps into a compact command stream
-//   for a single RP1 PIO state machine.
+//   for the RP1 PIO state machines; with several, they take turns by
+//   double row.
 // - the PIO program owns the clock edge timing via side-set; the CPU only
 //   describes which GPIO levels to present and how long each bitplane stays on.
 
 static const uint32_t kPioOutputPinCount = 28;
 static const uint32_t kMaxTransferBytes = 65532;
-// Command words use bit 31 as a tag:
-//   1 = "the next N words are GPIO samples to clock out"
-//   0 = "hold this GPIO sample for N encoded delay cycles"
-static const uint32_t kCommandData = 1u << 31;
+// Command words use bits 31..30 as a tag, bits 29..0 are a count N:
+//   0 = "hold the GPIO sample in the next word for N encoded delay cycles"
+//   1 = "clock out the GPIO sample in the next word N + 1 times"
+//   2 = "the next N + 1 words are GPIO samples to clock out"; if several
+//       pixel clocks are packed into a word (see BuildProgram()), these
+//       words follow one full GPIO sample
+//   3 = "execute bits 29..14 as instruction, then wait for the next turn";
+//       the instruction lets the next state machine take over. N is unused.
+static const uint32_t kCommandRepeat = 1u << 30;
+static const uint32_t kCommandData = 2u << 30;
+static const uint32_t kCommandHandover = 3u << 30;
 static const int kDelayOverheadClocks = 5;
 static const int kClocksPerDataWord = 2;
 static const int kPostAddressDelayClocks = 5;
 static const double kBaseTargetPioClockHz = 27000000.0;
+// Encoded copies of the stream per dither phase: one can be updated while
+// the other is still being transferred.
+static const int kEncodedFrameSlots = 2;
+// Streams handed to the transfer thread, including the one in transfer.
+static const int kMaxQueuedTransfers = 2;
+// The RP1 PIO has four state machines.
+static const int kMaxStateMachines = 4;
+// Shortest run of equal data words sent as repeat command.
+static const int kMinRepeatWords = 8;
+
+// The command streams of a frame starting at one bitplane (which changes
+// with dithering), kept across refreshes. The segment of each double row only
+// depends on the content of that row, so only rows that changed since the
+// last refresh are encoded again.
+struct EncodedFrame {
+  EncodedFrame() : columns(0), bit_planes(0), scan_mode(-1) {}
+
+  // Layout the words were encoded for.
+  int columns;
+  int bit_planes;
+  int scan_mode;
+
+  // Stream per state machine; row_loop goes to the one at
+  // row_loop % words.size().
+  std::vector<std::vector<uint32_t> > words;
+  // Per row_loop, its words [row_begin, row_end) in that stream.
+  std::vector<size_t> row_begin;
+  std::vector<size_t> row_end;
+  // Per double row, Framebuffer::band_version() of the encoded content;
+  // 0 if it needs to be encoded again.
+  std::vector<uint64_t> band_version;
+};
+
+class TransferThread;
 
 struct Rp1PioState {
   Rp1PioState()
       : active(false),
         panel_init_warned(false),
         pio(NULL),
-        sm(-1),
+        requested_state_machines(1),
         row_address_type(0),
         double_rows(0),
         gpio_slowdown(1),
         output_enable_bit(0),
         latch_bit(0),
-        used_mask(0) {
+        used_mask(0),
+        pixels_per_word(1),
+        out_pin_base(0),
+        packed_pin_mask(0) {
   }
 
   bool active;
   bool panel_init_warned;
   PIO pio;
-  int sm;
+  int requested_state_machines;
+  // Claimed state machines, taking turns by double row. The first one
+  // starts, and has the turn between frames.
+  std::vector<int> sms;
+  // Per state machine, the command handing the turn to the next one.
+  std::vector<uint32_t> handover_command;
   // Cached configuration copied from the selected matrix mapping so the hot
   // dump loop does not need to rediscover backend-specific details each frame.
   int row_address_type;
@@ -74,8 +126,24 @@ struct Rp1PioState {
   uint32_t output_enable_bit;
   uint32_t latch_bit;
   uint32_t used_mask;
+  // Pixel clocks per data word. If more than one, each takes the
+  // 32 / pixels_per_word bits of packed_pin_mask, starting at out_pin_base.
+  int pixels_per_word;
+  uint32_t out_pin_base;
+  uint32_t packed_pin_mask;
+  std::vector<uint16_t> program;
   std::vector<int> bitplane_active_words;
-  std::vector<uint32_t> transfer_buffer;
+  // kEncodedFrameSlots per first bitplane; last_slot is the one most
+  // recently updated for that bitplane.
+  std::vector<EncodedFrame> encoded_frames;
+  std::vector<int> last_slot;
+  // Scratch space for encoding.
+  std::vector<uint32_t> samples;
+  std::vector<std::vector<uint32_t> > next_words;
+  std::vector<size_t> next_row_begin;
+  std::vector<size_t> next_row_end;
+  // Per state machine, started with the first refresh.
+  std::vector<TransferThread*> transfer_threads;
 };
 
 Rp1PioState s_pio_state;
@@ -175,6 +243,107 @@ static bool IsSingleBit(uint64_t bits) {
   return bits != 0 && (bits & (bits - 1)) == 0;
 }
 
+// While a row is clocked in, only the color pins and OE change; everything
+// else is set by the delay commands in between. If these pins are close
+// together, the data words only need to carry that window of pins, and
+// several pixel clocks fit into one FIFO word. None of the standard
+// mappings on a 40 pin header is that compact except "classic" with one
+// chain, but it cuts the transfer to half there.
+static int ChoosePixelsPerWord(const HardwareMapping &h, int parallel,
+                               uint32_t *out_pin_base) {
+  const uint32_t changing = CollectColorMask(h, parallel) | h.output_enable;
+  const int lowest = __builtin_ctz(changing);
+  const int span = 32 - __builtin_clz(changing) - lowest;
+  for (int pixels = 4; pixels > 1; pixels /= 2) {
+    const int bits = 32 / pixels;
+    if (span > bits) continue;
+    *out_pin_base = std::min(lowest, (int)kPioOutputPinCount - bits);
+    return pixels;
+  }
+  *out_pin_base = 0;
+  return 1;
+}
+
+// The command interpreter. It started out as the protomatter program of the
+// Adafruit Piomatter library; data and delay commands still take the same
+// time. A repeat command takes one PIO clock more than sending the samples.
+// The OUT pins start at the packed window, so all 32 bit writes are rotated
+// by its base.
+//
+// The first pixel of a packed data command is a full GPIO sample, which
+// also takes the strobe of the previous latch down; the pins outside the
+// window keep that state for the rest of the command.
+//
+// With several state machines, each waits at "handover_wait" for its own
+// IRQ flag; the handover command sets the flag of the next one. Only the
+// state machine having the turn touches the pins.
+static void BuildProgram(int pixels_per_word, std::vector<uint16_t> *program,
+                         int *wrap_target, int *wrap, int *handover_wait) {
+  const uint bits = 32 / pixels_per_word;
+  const uint side_0 = pio_encode_sideset_opt(1, 0);
+  const uint side_1 = pio_encode_sideset_opt(1, 1);
+  const uint top = 4;
+  const uint do_delay = top + 1;
+  const uint do_repeat = do_delay + 4;
+  const uint do_data = do_repeat + 5;
+  const uint data_loop = do_data + (pixels_per_word > 1 ? 3 : 1);
+  const uint do_handover = data_loop + 2 * pixels_per_word;
+
+  std::vector<uint16_t> &p = *program;
+  p.clear();
+  // "out pc, 2" jumps to one of these, by the command tag.
+  p.push_back(pio_encode_jmp(do_delay));
+  p.push_back(pio_encode_jmp(do_repeat));
+  p.push_back(pio_encode_jmp(do_data));
+  p.push_back(pio_encode_jmp(do_handover));
+  *wrap_target = p.size();
+  p.push_back(pio_encode_out(pio_pc, 2));          // top:
+
+  p.push_back(pio_encode_out(pio_y, 30));          // do_delay:
+  p.push_back(pio_encode_out(pio_pins, 32));
+  p.push_back(pio_encode_jmp_y_dec(p.size()));
+  p.push_back(pio_encode_jmp(top));
+
+  p.push_back(pio_encode_out(pio_y, 30));          // do_repeat:
+  p.push_back(pio_encode_out(pio_pins, 32));
+  p.push_back(pio_encode_jmp_y_dec(p.size() + 2) | side_1);
+  p.push_back(pio_encode_jmp(top));
+  p.push_back(pio_encode_jmp(p.size() - 2) | side_0);
+
+  p.push_back(pio_encode_out(pio_y, 30));          // do_data:
+  if (pixels_per_word == 1) {
+    p.push_back(pio_encode_out(pio_pins, 32));     // data_loop:
+    *wrap = p.size();
+    p.push_back(pio_encode_jmp_y_dec(data_loop) | side_1);
+  } else {
+    p.push_back(pio_encode_out(pio_pins, 32));
+    p.push_back(pio_encode_jmp(data_loop) | side_1);
+    for (int i = 0; i < pixels_per_word; ++i) {    // data_loop:
+      p.push_back(pio_encode_out(pio_pins, bits) | side_0);
+      if (i < pixels_per_word - 1) {
+        p.push_back(pio_encode_nop() | side_1);
+      } else {
+        *wrap = p.size();
+        p.push_back(pio_encode_jmp_y_dec(data_loop) | side_1);
+      }
+    }
+  }
+
+  p.push_back(pio_encode_out(pio_exec_out, 16));   // do_handover:
+  p.push_back(pio_encode_out(pio_null, 14));
+  *handover_wait = p.size();
+  p.push_back(pio_encode_wait_irq(true, true, 0));  // Own flag, cleared.
+  p.push_back(pio_encode_jmp(top));
+  // Like protomatter, fill all 32 instructions so nothing else can load.
+  p.resize(32, pio_encode_nop());
+}
+
+// A GPIO sample as written by "out pins, 32".
+static uint32_t PinWord(uint32_t pins) {
+  const uint32_t base = s_pio_state.out_pin_base;
+  return base == 0 ? pins : (pins >> base) | (pins << (32 - base));
+}
+
 static uint32_t CalcRowAddressBits(const HardwareMapping &h,
                                    int row_address_type, int row) {
   switch (row_address_type) {
@@ -213,11 +382,45 @@ static void AppendDelay(std::vector<uint32_t> *buffer, uint32_t pins,
   int encoded_cycles = clock_cycles - kDelayOverheadClocks;
   if (encoded_cycles < 1) encoded_cycles = 1;
   buffer->push_back(static_cast<uint32_t>(encoded_cycles - 1));
-  buffer->push_back(pins);
+  buffer->push_back(PinWord(pins));
+}
+
+static void AppendRepeat(std::vector<uint32_t> *buffer, uint32_t pins,
+                         int clocks) {
+  buffer->push_back(kCommandRepeat | static_cast<uint32_t>(clocks - 1));
+  buffer->push_back(PinWord(pins));
+}
+
+static uint32_t HandoverCommand(int next_sm) {
+  return kCommandHandover | pio_encode_irq_set(false, next_sm) << 14;
 }
 
-static void AppendDataHeader(std::vector<uint32_t> *buffer, int words) {
-  buffer->push_back(kCommandData | static_cast<uint32_t>(words - 1));
+// Append a data command for "count" samples; with packed words, the first
+// is sent as full GPIO sample and the rest needs to fill whole words.
+static void AppendData(std::vector<uint32_t> *buffer, const uint32_t *samples,
+                       int count) {
+  const Rp1PioState &state = s_pio_state;
+  const int pixels_per_word = state.pixels_per_word;
+  if (pixels_per_word == 1) {
+    buffer->push_back(kCommandData | static_cast<uint32_t>(count - 1));
+    buffer->insert(buffer->end(), samples, samples + count);
+    return;
+  }
+
+  buffer->push_back(kCommandData
+                    | static_cast<uint32_t>((count - 1) / pixels_per_word - 1));
+  buffer->push_back(PinWord(samples[0]));
+  ++samples;
+  --count;
+  const int packed_bits = 32 / pixels_per_word;
+  for (int i = 0; i < count; i += pixels_per_word) {
+    uint32_t packed = 0;
+    for (int p = 0; p < pixels_per_word; ++p) {
+      packed = (packed << packed_bits)
+        | ((samples[i + p] >> state.out_pin_base) & state.packed_pin_mask);
+    }
+    buffer->push_back(packed);
+  }
 }
 
 static int TransferLarge(PIO pio, int sm, const uint32_t *data,
@@ -236,6 +439,83 @@ static int TransferLarge(PIO pio, int sm, const uint32_t *data,
   return 0;
 }
 
+// Pushes encoded streams to the PIO in the background, so that the refresh
+// thread can already prepare the next pass while the previous one is being
+// transferred. One per state machine, so their transfers run in parallel.
+class TransferThread : public Thread {
+public:
+  // Transfers words[index] of the frames to state machine sms[index].
+  explicit TransferThread(int index) : index_(index), running_(true) {
+    pthread_cond_init(&queue_changed_, NULL);
+  }
+  virtual ~TransferThread() {
+    {
+      MutexLock l(&mutex_);
+      running_ = false;
+      pthread_cond_broadcast(&queue_changed_);
+    }
+    WaitStopped();  // Finishes what is queued.
+    pthread_cond_destroy(&queue_changed_);
+  }
+
+  // Queue the frame for transfer. Blocks while kMaxQueuedTransfers are
+  // pending.
+  void Submit(EncodedFrame *frame) {
+    MutexLock l(&mutex_);
+    while ((int)queue_.size() >= kMaxQueuedTransfers) {
+      mutex_.WaitOn(&queue_changed_);
+    }
+    queue_.push_back(frame);
+    pthread_cond_broadcast(&queue_changed_);
+  }
+
+  // Wait until the frame is neither queued nor in transfer, so that it can
+  // be modified.
+  void WaitReleased(const EncodedFrame *frame) {
+    MutexLock l(&mutex_);
+    while (std::find(queue_.begin(), queue_.end(), frame) != queue_.end()) {
+      mutex_.WaitOn(&queue_changed_);
+    }
+  }
+
+  void WaitIdle() {
+    MutexLock l(&mutex_);
+    while (!queue_.empty()) mutex_.WaitOn(&queue_changed_);
+  }
+
+  virtual void Run() {
+    for (;;) {
+      EncodedFrame *frame;
+      {
+        MutexLock l(&mutex_);
+        while (running_ && queue_.empty()) mutex_.WaitOn(&queue_changed_);
+        if (queue_.empty()) return;
+        frame = queue_.front();  // Stays queued while in transfer.
+      }
+
+      RGB_TRACE_SPAN_ARG("PIO transfer", index_);
+      const std::vector<uint32_t> &words = frame->words[index_];
+      const int rc = TransferLarge(s_pio_state.pio, s_pio_state.sms[index_],
+                                   &words[0], words.size() * sizeof(words[0]));
+      if (rc != 0) {
+        fprintf(stderr, "RP1 PIO framebuffer transfer failed: %d\n", rc);
+        abort();
+      }
+
+      MutexLock l(&mutex_);
+      queue_.pop_front();
+      pthread_cond_broadcast(&queue_changed_);
+    }
+  }
+
+private:
+  const int index_;
+  Mutex mutex_;
+  pthread_cond_t queue_changed_;
+  std::deque<EncodedFrame*> queue_;  // Front is the one in transfer.
+  bool running_;
+};
+
 static void InitPinDirection(PIO pio, int sm, uint32_t used_mask) {
   for (uint32_t pin = 0; pin < kPioOutputPinCount; ++pin) {
     if ((used_mask & (1u << pin)) == 0) continue;
@@ -256,7 +536,7 @@ static void PrepareBitplaneTimings(int pwm_lsb_nanoseconds, int dither_bits,
                                    std::vector<int> *timings_out) {
   timings_out->clear();
   int timing_ns = pwm_lsb_nanoseconds;
-  for (int b = 0; b < Framebuffer::kBitPlanes; ++b) {
+  for (int b = 0; b < Framebuffer::kMaxBitPlanes; ++b) {
     timings_out->push_back(timing_ns);
     if (b >= dither_bits) timing_ns *= 2;
   }
@@ -280,9 +560,10 @@ static void PrepareBitplaneActiveWords(int pwm_lsb_nanoseconds, int dither_bits,
 
 static void ConfigureStateMachineOrDie(const HardwareMapping &mapping) {
   Rp1PioState &state = s_pio_state;
-  // One state machine drives the whole display. All GPIO samples are expanded
-  // on the CPU side; the PIO program's job is to issue clock edges and honor
-  // encoded delay commands at a stable cadence.
+  // One state machine at a time drives the whole display. All GPIO samples
+  // are expanded on the CPU side; the PIO program's job is to issue clock
+  // edges and honor encoded delay commands at a stable cadence. Several
+  // state machines only split the stream, each with its own FIFO and DMA.
   state.pio = pio0;
   if (PIO_IS_ERR(state.pio)) {
     fprintf(stderr, "Opening /dev/pio0 failed with error %d\n",
@@ -290,55 +571,83 @@ static void ConfigureStateMachineOrDie(const HardwareMapping &mapping) {
     abort();
   }
 
-  state.sm = pio_claim_unused_sm(state.pio, true);
-  if (state.sm < 0) {
-    fprintf(stderr, "Could not claim an unused RP1 PIO state machine.\n");
-    abort();
+  // They take turns by double row, and the last row hands back to the first
+  // state machine for the next frame.
+  int count = state.requested_state_machines;
+  while (state.double_rows % count != 0) --count;
+  if (state.requested_state_machines > 1) {
+    // Not verified on hardware yet, so say what is actually used.
+    fprintf(stderr, "Experimental: using %d RP1 PIO state machine%s "
+            "(--led-rp1-pio-sm=%d, %d double rows).\n", count,
+            count > 1 ? "s" : "", state.requested_state_machines,
+            state.double_rows);
   }
-
-  const int xfer_rc = pio_sm_config_xfer(state.pio, state.sm, PIO_DIR_TO_SM,
-                                         kMaxTransferBytes, 3);
-  if (xfer_rc != 0) {
-    fprintf(stderr, "RP1 PIO DMA configuration failed: %d\n", xfer_rc);
-    abort();
+  state.sms.clear();
+  for (int i = 0; i < count; ++i) {
+    const int sm = pio_claim_unused_sm(state.pio, true);
+    if (sm < 0) {
+      fprintf(stderr, "Could not claim an unused RP1 PIO state machine.\n");
+      abort();
+    }
+    const int xfer_rc = pio_sm_config_xfer(state.pio, sm, PIO_DIR_TO_SM,
+                                           kMaxTransferBytes, 3);
+    if (xfer_rc != 0) {
+      fprintf(stderr, "RP1 PIO DMA configuration failed: %d\n", xfer_rc);
+      abort();
+    }
+    state.sms.push_back(sm);
+  }
+  state.handover_command.clear();
+  for (int i = 0; i < count; ++i) {
+    state.handover_command.push_back(
+        HandoverCommand(state.sms[(i + 1) % count]));
   }
 
-  static const struct pio_program kProgram = {
-      protomatter,
+  int wrap_target, wrap, handover_wait;
+  BuildProgram(state.pixels_per_word, &state.program, &wrap_target, &wrap,
+               &handover_wait);
+  const struct pio_program program = {
+      &state.program[0],
       32,
       -1,
       0,
   };
-  const uint offset = pio_add_program(state.pio, &kProgram);
+  const uint offset = pio_add_program(state.pio, &program);
   if (offset == PIO_ORIGIN_INVALID) {
     fprintf(stderr, "Loading the HUB75 RP1 PIO program failed.\n");
     abort();
   }
 
-  pio_sm_clear_fifos(state.pio, state.sm);
-  pio_sm_set_clkdiv(state.pio, state.sm, 1.0f);
-
   pio_sm_config config = pio_get_default_sm_config();
-  sm_config_set_wrap(&config, offset + protomatter_wrap_target,
-                     offset + protomatter_wrap);
+  sm_config_set_wrap(&config, offset + wrap_target, offset + wrap);
   // The config API expects the full encoded side-set field width. For
   // ".side_set 1 opt", that means 1 data bit plus the optional-enable bit.
-  const uint encoded_sideset_bits =
-      protomatter_sideset_pin_count + (protomatter_sideset_enable ? 1u : 0u);
-  sm_config_set_sideset(&config, encoded_sideset_bits,
-                        protomatter_sideset_enable, false);
+  sm_config_set_sideset(&config, 2, true, false);
   sm_config_set_out_shift(&config, false, true, 32);
   sm_config_set_fifo_join(&config, PIO_FIFO_JOIN_TX);
   sm_config_set_clkdiv(&config, clock_get_hz(clk_sys) / TargetPioClockHz());
-  sm_config_set_out_pins(&config, 0, kPioOutputPinCount);
+  if (state.pixels_per_word > 1) {
+    sm_config_set_out_pins(&config, state.out_pin_base, 32);
+  } else {
+    sm_config_set_out_pins(&config, 0, kPioOutputPinCount);
+  }
 
   const unsigned clock_pin = __builtin_ctz(mapping.clock);
   sm_config_set_sideset_pins(&config, clock_pin);
 
-  pio_sm_init(state.pio, state.sm, offset, &config);
-  InitPinDirection(state.pio, state.sm, state.used_mask);
-  pio_sm_set_enabled(state.pio, state.sm, true);
-  pio_sm_set_pins_with_mask(state.pio, state.sm, state.output_enable_bit,
+  uint32_t sm_mask = 0;
+  for (int i = 0; i < count; ++i) {
+    const int sm = state.sms[i];
+    pio_sm_clear_fifos(state.pio, sm);
+    pio_sm_set_clkdiv(state.pio, sm, 1.0f);
+    pio_sm_exec(state.pio, sm, pio_encode_irq_clear(false, sm));
+    pio_sm_init(state.pio, sm,
+                offset + (i == 0 ? wrap_target : handover_wait), &config);
+    sm_mask |= 1u << sm;
+  }
+  InitPinDirection(state.pio, state.sms[0], state.used_mask);
+  pio_enable_sm_in_sync_mask(state.pio, sm_mask);
+  pio_sm_set_pins_with_mask(state.pio, state.sms[0], state.output_enable_bit,
                             state.used_mask);
 }
 
@@ -346,17 +655,23 @@ static void SendRawWordsOrDie(const std::vector<uint32_t> &pins) {
   if (pins.empty()) return;
 
   Rp1PioState &state = s_pio_state;
+  for (size_t i = 0; i < state.transfer_threads.size(); ++i) {
+    state.transfer_threads[i]->WaitIdle();
+  }
   // Panel init sequences reuse the same command format as the refresh loop,
   // but always run with OE blanked so the panel does not flash partial data.
+  // Sent as repeat commands, which always set all pins.
   std::vector<uint32_t> buffer;
-  buffer.reserve(pins.size() + 3);
-  AppendDataHeader(&buffer, pins.size());
-  for (size_t i = 0; i < pins.size(); ++i) {
-    buffer.push_back(pins[i] | state.output_enable_bit);
+  for (size_t i = 0; i < pins.size(); /**/) {
+    size_t end = i + 1;
+    while (end < pins.size() && pins[end] == pins[i]) ++end;
+    AppendRepeat(&buffer, pins[i] | state.output_enable_bit, end - i);
+    i = end;
   }
   AppendDelay(&buffer, state.output_enable_bit, 0);
 
-  const int rc = TransferLarge(state.pio, state.sm, &buffer[0],
+  // The first state machine has the turn between frames.
+  const int rc = TransferLarge(state.pio, state.sms[0], &buffer[0],
                                buffer.size() * sizeof(buffer[0]));
   if (rc != 0) {
     fprintf(stderr, "RP1 PIO transfer failed during panel init: %d\n", rc);
@@ -448,11 +763,14 @@ void Rp1PioSetGpioSlowdown(int slowdown) {
   s_pio_state.gpio_slowdown = slowdown <= 1 ? 1 : slowdown;
 }
 
-bool Rp1PioIsActive() { return s_pio_state.active; }
+void Rp1PioSetStateMachines(int count) {
+  s_pio_state.requested_state_machines =
+    std::max(1, std::min(count, kMaxStateMachines));
+}
 
-void Rp1PioInitOrDie(const HardwareMapping &mapping, int double_rows, int parallel,
-                     int pwm_lsb_nanoseconds, int dither_bits,
-                     int row_address_type) {
+static void Rp1PioInitOrDie(const HardwareMapping &mapping, int double_rows,
+                            int parallel, int pwm_lsb_nanoseconds,
+                            int dither_bits, int row_address_type) {
   Rp1PioState &state = s_pio_state;
   if (state.active) return;
 
@@ -462,6 +780,10 @@ void Rp1PioInitOrDie(const HardwareMapping &mapping, int double_rows, int parall
   state.latch_bit = mapping.strobe;
   state.used_mask = BuildUsedMask(mapping, state.double_rows, parallel,
                                   row_address_type);
+  state.pixels_per_word = ChoosePixelsPerWord(mapping, parallel,
+                                              &state.out_pin_base);
+  state.packed_pin_mask = (state.pixels_per_word > 1)
+    ? (1u << (32 / state.pixels_per_word)) - 1 : 0;
 
   if (!FitsInPioWord(state.used_mask)) {
     fprintf(stderr,
@@ -486,12 +808,14 @@ void Rp1PioInitOrDie(const HardwareMapping &mapping, int double_rows, int parall
 
   PrepareBitplaneActiveWords(pwm_lsb_nanoseconds, dither_bits,
                              &state.bitplane_active_words);
+  state.encoded_frames.resize(Framebuffer::kMaxBitPlanes * kEncodedFrameSlots);
+  state.last_slot.assign(Framebuffer::kMaxBitPlanes, 0);
   ConfigureStateMachineOrDie(mapping);
   state.active = true;
 }
 
-void Rp1PioInitializePanels(const HardwareMapping &mapping,
-                            const char *panel_type, int columns) {
+static void Rp1PioInitializePanels(const HardwareMapping &mapping,
+                                   const char *panel_type, int columns) {
   if (!s_pio_state.active || panel_type == NULL || *panel_type == '\0') return;
 
   if (strncasecmp(panel_type, "fm6126", 6) == 0) {
@@ -507,106 +831,313 @@ void Rp1PioInitializePanels(const HardwareMapping &mapping,
   }
 }
 
-void Rp1PioDumpFramebuffer(Framebuffer *framebuffer, int pwm_low_bit) {
-  if (!s_pio_state.active || framebuffer == NULL) return;
+// If a run of equal samples worth a repeat command starts at "start",
+// returns its end, otherwise "start". Unless at the end, runs end where a
+// data command can follow: one full sample, then whole packed words.
+static int RepeatEnd(const uint32_t *samples, int count, int start) {
+  const int pixels_per_word = s_pio_state.pixels_per_word;
+  int end = start + 1;
+  while (end < count && samples[end] == samples[start]) ++end;
+  if (end < count) {
+    end -= (pixels_per_word - (count - 1 - end) % pixels_per_word)
+      % pixels_per_word;
+  }
+  return (end - start >= kMinRepeatWords * pixels_per_word) ? end : start;
+}
 
+// Append the commands clocking out "count" samples. The first "lit" clocks
+// show the previous bitplane; repeat commands and splitting data commands
+// cost a few PIO clocks, so they are only used once the sample switching it
+// off is out, where it doesn't change how long the row is lit.
+static void AppendSamples(const uint32_t *samples, int count, int lit,
+                          std::vector<uint32_t> *out) {
+  const int pixels_per_word = s_pio_state.pixels_per_word;
+  const int first_split = (lit > 0) ? lit + 1 : 0;
+  int start = 0;
+  while (start < count) {
+    int end = (start >= first_split)
+      ? RepeatEnd(samples, count, start) : start;
+    if (end > start) {
+      AppendRepeat(out, samples[start], end - start);
+    } else {
+      // Up to where a repeat command is worth it.
+      end = start + (pixels_per_word > 1 ? 1 + pixels_per_word : 1);
+      while (end < count
+             && (end < first_split
+                 || RepeatEnd(samples, count, end) == end)) {
+        end += pixels_per_word;
+      }
+      AppendData(out, samples + start, end - start);
+    }
+    start = end;
+  }
+}
+
+// Append the commands showing the planes [start_bit, bit_planes) of the
+// double row shown at "row_loop".
+static void EncodeRow(const Framebuffer *framebuffer, int row_loop,
+                      int start_bit, std::vector<uint32_t> *out) {
   Rp1PioState &state = s_pio_state;
-  // The framebuffer already contains per-column color GPIO bits. This pass only
-  // adds row-address selection, latch/OE sequencing, and the active-time delay
-  // that gives each PWM bitplane its brightness weight.
   const HardwareMapping &h = framebuffer->hardware_mapping();
-  const int start_bit =
-      std::max(pwm_low_bit, Framebuffer::kBitPlanes - framebuffer->pwmbits());
+  const int bit_planes = framebuffer->bit_planes();
   const int double_rows = framebuffer->double_rows();
   const int columns = framebuffer->columns();
   const int scan_mode = framebuffer->scan_mode();
 
-  const int plane_count = Framebuffer::kBitPlanes - start_bit;
-  state.transfer_buffer.clear();
-  state.transfer_buffer.reserve(
-      double_rows * plane_count * (columns + 8) + 8);
-
+  const int display_row = DisplayRowFromLoop(row_loop, double_rows, scan_mode);
+  const uint32_t current_addr =
+      CalcRowAddressBits(h, state.row_address_type, display_row);
+  // Still showing the last plane of the previous row; the very first row
+  // has nothing to overlap with.
   uint32_t previous_addr = CalcRowAddressBits(
       h, state.row_address_type,
-      DisplayRowFromLoop(double_rows - 1, double_rows, scan_mode));
-  int previous_active_words = 0;
+      DisplayRowFromLoop((row_loop + double_rows - 1) % double_rows,
+                         double_rows, scan_mode));
+  int previous_active_words = (row_loop > 0 && start_bit < bit_planes)
+    ? state.bitplane_active_words[bit_planes - 1] : 0;
+
+  // After the first full sample, packed words need a multiple of
+  // pixels_per_word clocks; the extra ones go first, so they are shifted out
+  // past the end of the chain.
+  const int pixels_per_word = state.pixels_per_word;
+  const int padding = (pixels_per_word - (columns - 1) % pixels_per_word)
+    % pixels_per_word;
+  const int clocks = padding + columns;
+  state.samples.resize(clocks);
+  uint32_t *const samples = &state.samples[0];
+
+  for (int bit = start_bit; bit < bit_planes; ++bit) {
+    const gpio_bits_t *row_data = framebuffer->RowDataAt(display_row, bit);
+    for (int i = 0; i < clocks; ++i) {
+      const int col = std::max(0, i - padding);
+      samples[i] = static_cast<uint32_t>(row_data[col]) | previous_addr;
+      if (i >= previous_active_words) {
+        samples[i] |= state.output_enable_bit;
+      }
+    }
+    AppendSamples(samples, clocks, previous_active_words, out);
+
+    const int remaining_overlap_words = previous_active_words - clocks;
+    if (remaining_overlap_words > 0) {
+      AppendDelay(out, previous_addr,
+                  remaining_overlap_words * kClocksPerDataWord);
+    }
+
+    if (current_addr != previous_addr) {
+      AppendDelay(out, current_addr | state.output_enable_bit,
+                  kPostAddressDelayClocks);
+    }
+    AppendDelay(out, current_addr | state.output_enable_bit | state.latch_bit,
+                0);
+
+    previous_addr = current_addr;
+    previous_active_words = state.bitplane_active_words[bit];
+  }
+}
+
+static bool SameLayout(const EncodedFrame &frame,
+                       const Framebuffer *framebuffer) {
+  return frame.columns == framebuffer->columns()
+    && frame.bit_planes == framebuffer->bit_planes()
+    && frame.scan_mode == framebuffer->scan_mode()
+    && (int)frame.band_version.size() == framebuffer->double_rows()
+    && frame.words.size() == s_pio_state.sms.size();
+}
+
+// Version of the double row to remember once encoded. Rows that are being
+// drawn on are encoded on every refresh until the next MarkClean() gives
+// them a new version.
+static uint64_t EncodableVersion(const Framebuffer *framebuffer, int row) {
+  return framebuffer->dirty_planes(row) == 0
+    ? framebuffer->band_version(row) : 0;
+}
 
+static bool IsUpToDate(const EncodedFrame &frame,
+                       const Framebuffer *framebuffer) {
+  if (!SameLayout(frame, framebuffer)) return false;
+  for (int row = 0; row < framebuffer->double_rows(); ++row) {
+    const uint64_t version = EncodableVersion(framebuffer, row);
+    if (version == 0 || version != frame.band_version[row]) return false;
+  }
+  return true;
+}
+
+// Bring the streams in "frame" up to date with the framebuffer content. The
+// size of a row depends on its content, so the streams are put together
+// anew, with rows that didn't change copied over.
+static void UpdateEncodedFrame(const Framebuffer *framebuffer, int start_bit,
+                               EncodedFrame *frame) {
+  RGB_TRACE_SPAN("UpdateEncodedFrame");
+  Rp1PioState &state = s_pio_state;
+  const HardwareMapping &h = framebuffer->hardware_mapping();
+  const int bit_planes = framebuffer->bit_planes();
+  const int double_rows = framebuffer->double_rows();
+  const int scan_mode = framebuffer->scan_mode();
+
+  const int sm_count = state.sms.size();
+  if (!SameLayout(*frame, framebuffer)) {
+    frame->words.assign(sm_count, std::vector<uint32_t>());
+    frame->row_begin.assign(double_rows, 0);
+    frame->row_end.assign(double_rows, 0);
+    frame->band_version.assign(double_rows, 0);
+  }
+
+  std::vector<std::vector<uint32_t> > &streams = state.next_words;
+  std::vector<size_t> &row_begin = state.next_row_begin;
+  std::vector<size_t> &row_end = state.next_row_end;
+  streams.resize(sm_count);
+  for (int i = 0; i < sm_count; ++i) streams[i].clear();
+  row_begin.resize(double_rows);
+  row_end.resize(double_rows);
   for (int row_loop = 0; row_loop < double_rows; ++row_loop) {
     const int display_row =
         DisplayRowFromLoop(row_loop, double_rows, scan_mode);
-    const uint32_t current_addr =
-        CalcRowAddressBits(h, state.row_address_type, display_row);
-
-    for (int bit = start_bit; bit < Framebuffer::kBitPlanes; ++bit) {
-      const gpio_bits_t *row_data = framebuffer->RowDataAt(display_row, bit);
-      AppendDataHeader(&state.transfer_buffer, columns);
-
-      int remaining_overlap_words = previous_active_words;
-      for (int col = 0; col < columns; ++col) {
-        uint32_t pins = static_cast<uint32_t>(row_data[col]) | previous_addr;
-        if (remaining_overlap_words <= 0) {
-          pins |= state.output_enable_bit;
-        }
-        state.transfer_buffer.push_back(pins);
-        if (remaining_overlap_words > 0) --remaining_overlap_words;
+    const uint64_t version = EncodableVersion(framebuffer, display_row);
+    const int sm_index = row_loop % sm_count;
+    std::vector<uint32_t> &words = streams[sm_index];
+    row_begin[row_loop] = words.size();
+    if (version == 0 || version != frame->band_version[display_row]) {
+      EncodeRow(framebuffer, row_loop, start_bit, &words);
+    } else {
+      const std::vector<uint32_t> &old_words = frame->words[sm_index];
+      words.insert(words.end(),
+                   old_words.begin() + frame->row_begin[row_loop],
+                   old_words.begin() + frame->row_end[row_loop]);
+    }
+    row_end[row_loop] = words.size();
+    frame->band_version[display_row] = version;
+
+    if (row_loop == double_rows - 1) {
+      const uint32_t last_addr = CalcRowAddressBits(
+          h, state.row_address_type,
+          DisplayRowFromLoop(double_rows - 1, double_rows, scan_mode));
+      if (start_bit < bit_planes) {
+        AppendDelay(&words, last_addr,
+                    state.bitplane_active_words[bit_planes - 1]
+                    * kClocksPerDataWord);
       }
+      AppendDelay(&words, last_addr | state.output_enable_bit, 0);
+    }
+    if (sm_count > 1) words.push_back(state.handover_command[sm_index]);
+  }
 
-      if (remaining_overlap_words > 0) {
-        AppendDelay(&state.transfer_buffer, previous_addr,
-                    remaining_overlap_words * kClocksPerDataWord);
-      }
+  frame->words.swap(streams);
+  frame->row_begin.swap(row_begin);
+  frame->row_end.swap(row_end);
+  frame->columns = framebuffer->columns();
+  frame->bit_planes = bit_planes;
+  frame->scan_mode = scan_mode;
+}
 
-      if (current_addr != previous_addr) {
-        AppendDelay(&state.transfer_buffer,
-                    current_addr | state.output_enable_bit,
-                    kPostAddressDelayClocks);
-      }
-      AppendDelay(&state.transfer_buffer,
-                  current_addr | state.output_enable_bit | state.latch_bit, 0);
+static void Rp1PioDumpFramebuffer(const Framebuffer *framebuffer,
+                                  int pwm_low_bit) {
+  if (!s_pio_state.active || framebuffer == NULL) return;
 
-      previous_addr = current_addr;
-      previous_active_words = state.bitplane_active_words[bit];
+  Rp1PioState &state = s_pio_state;
+  std::vector<TransferThread*> &threads = state.transfer_threads;
+  if (threads.empty()) {
+    // Started from the refresh thread, they would inherit its priority and
+    // compete with it for its core. They mostly wait for the DMA to finish,
+    // so keep them realtime, but just below, on the other cores.
+    for (size_t i = 0; i < state.sms.size(); ++i) {
+      threads.push_back(new TransferThread(i));
+      threads.back()->Start(98, (1<<0) | (1<<1) | (1<<2));
     }
   }
 
-  if (previous_active_words > 0) {
-    AppendDelay(&state.transfer_buffer, previous_addr,
-                previous_active_words * kClocksPerDataWord);
+  // The framebuffer already contains per-column color GPIO bits. This pass only
+  // adds row-address selection, latch/OE sequencing, and the active-time delay
+  // that gives each PWM bitplane its brightness weight.
+  const int start_bit =
+      std::max(pwm_low_bit,
+               framebuffer->bit_planes() - framebuffer->pwmbits());
+  EncodedFrame *frames = &state.encoded_frames[start_bit * kEncodedFrameSlots];
+  int &slot = state.last_slot[start_bit];
+  if (!IsUpToDate(frames[slot], framebuffer)) {
+    // Update the other copy; the last one might still be in transfer.
+    slot = (slot + 1) % kEncodedFrameSlots;
+    for (size_t i = 0; i < threads.size(); ++i) {
+      threads[i]->WaitReleased(&frames[slot]);
+    }
+    UpdateEncodedFrame(framebuffer, start_bit, &frames[slot]);
   }
-  AppendDelay(&state.transfer_buffer, previous_addr | state.output_enable_bit,
-              0);
-
-  const int rc = TransferLarge(state.pio, state.sm, &state.transfer_buffer[0],
-                               state.transfer_buffer.size()
-                                   * sizeof(state.transfer_buffer[0]));
-  if (rc != 0) {
-    fprintf(stderr, "RP1 PIO framebuffer transfer failed: %d\n", rc);
-    abort();
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->Submit(&frames[slot]);
   }
 }
 
-void Rp1PioDeinit() {
+static void Rp1PioDeinit() {
   Rp1PioState &state = s_pio_state;
   if (!state.active) return;
 
-  pio_sm_set_enabled(state.pio, state.sm, false);
-  pio_sm_clear_fifos(state.pio, state.sm);
-  ReleasePinDirection(state.pio, state.sm, state.used_mask);
-  pio_sm_unclaim(state.pio, state.sm);
+  for (size_t i = 0; i < state.transfer_threads.size(); ++i) {
+    delete state.transfer_threads[i];
+  }
+  state.transfer_threads.clear();
+  for (size_t i = 0; i < state.sms.size(); ++i) {
+    pio_sm_set_enabled(state.pio, state.sms[i], false);
+    pio_sm_clear_fifos(state.pio, state.sms[i]);
+  }
+  ReleasePinDirection(state.pio, state.sms[0], state.used_mask);
+  for (size_t i = 0; i < state.sms.size(); ++i) {
+    pio_sm_unclaim(state.pio, state.sms[i]);
+  }
   pio_close(state.pio);
 
   state.active = false;
   state.panel_init_warned = false;
   state.pio = NULL;
-  state.sm = -1;
+  state.requested_state_machines = 1;
+  state.sms.clear();
+  state.handover_command.clear();
   state.row_address_type = 0;
   state.double_rows = 0;
   state.gpio_slowdown = 1;
   state.output_enable_bit = 0;
   state.latch_bit = 0;
   state.used_mask = 0;
+  state.pixels_per_word = 1;
+  state.out_pin_base = 0;
+  state.packed_pin_mask = 0;
+  state.program.clear();
   state.bitplane_active_words.clear();
-  state.transfer_buffer.clear();
+  state.encoded_frames.clear();
+  state.last_slot.clear();
+  state.samples.clear();
+  state.next_words.clear();
+  state.next_row_begin.clear();
+  state.next_row_end.clear();
+}
+
+namespace {
+class Rp1PioOutputBackend : public OutputBackend {
+public:
+  explicit Rp1PioOutputBackend(const HardwareMapping &mapping)
+    : mapping_(mapping) {}
+  virtual ~Rp1PioOutputBackend() { Rp1PioDeinit(); }
+
+  virtual void InitializePanels(const char *panel_type, int columns) {
+    Rp1PioInitializePanels(mapping_, panel_type, columns);
+  }
+  virtual void DumpFramebuffer(const Framebuffer *framebuffer,
+                               int pwm_low_bit) {
+    Rp1PioDumpFramebuffer(framebuffer, pwm_low_bit);
+  }
+  virtual bool ExposesGPIO() const { return false; }
+
+private:
+  const HardwareMapping &mapping_;
+};
+}  // namespace
+
+OutputBackend *Rp1PioCreateOutputBackend(const HardwareMapping &mapping,
+                                         int double_rows, int parallel,
+                                         int pwm_lsb_nanoseconds,
+                                         int dither_bits,
+                                         int row_address_type) {
+  Rp1PioInitOrDie(mapping, double_rows, parallel, pwm_lsb_nanoseconds,
+                  dither_bits, row_address_type);
+  return new Rp1PioOutputBackend(mapping);
 }
 
 }  // namespace internal
@@ -20,6 +20,7 @@
 #include "../framebuffer-internal.h"
 #include "../gpio.h"
 #include "../hardware-mapping.h"
+#include "../output-backend.h"
 
 namespace rgb_matrix {
 namespace internal {
@@ -66,6 +67,7 @@ struct Rp1RioState {
   Rp1RioState()
       : active(false),
         panel_init_warned(false),
+        skip_empty_planes(false),
         map_base(NULL),
         gpio_regs(NULL),
         pad_regs(NULL),
@@ -85,6 +87,7 @@ struct Rp1RioState {
 
   bool active;
   bool panel_init_warned;
+  bool skip_empty_planes;
   // map_base spans one contiguous RP1 aperture containing GPIO control,
   // RIO data registers, and pad control registers.
   volatile uint32_t *map_base;
@@ -335,7 +338,7 @@ static void PrepareBitplaneTimings(int pwm_lsb_nanoseconds, int dither_bits,
                                    std::vector<int> *timings_out) {
   timings_out->clear();
   int timing_ns = pwm_lsb_nanoseconds;
-  for (int b = 0; b < Framebuffer::kBitPlanes; ++b) {
+  for (int b = 0; b < Framebuffer::kMaxBitPlanes; ++b) {
     timings_out->push_back(timing_ns);
     if (b >= dither_bits) timing_ns *= 2;
   }
@@ -411,11 +414,13 @@ static void ConfigureUsedPins() {
 
 static void WriteClockedWord(uint32_t pins) {
   Rp1RioState &state = s_rio_state;
-  // One framebuffer word corresponds to one panel clock period: present the
-  // GPIO data first, then raise the clock bit, then return to idle-low clock.
+  // One framebuffer word corresponds to one panel clock period. Two stores is
+  // the minimum for the two clock edges: the full write presents the data and
+  // returns the clock of the previous word to low, the set alias then raises
+  // the clock without touching the other pins.
   state.rio_out->Out = pins;
   ClockSetupDelay(state.gpio_slowdown);
-  state.rio_out->Out = pins | state.clock_bit;
+  state.rio_set->Out = state.clock_bit;
   ClockSetupDelay(state.gpio_slowdown);
 }
 
@@ -512,11 +517,9 @@ void Rp1RioSetGpioSlowdown(int slowdown) {
   s_rio_state.gpio_slowdown = slowdown <= 1 ? 1 : slowdown;
 }
 
-bool Rp1RioIsActive() { return s_rio_state.active; }
-
-void Rp1RioInitOrDie(const HardwareMapping &mapping, int double_rows,
-                     int parallel, int pwm_lsb_nanoseconds, int dither_bits,
-                     int row_address_type) {
+static void Rp1RioInitOrDie(const HardwareMapping &mapping, int double_rows,
+                            int parallel, int pwm_lsb_nanoseconds, int dither_bits,
+                            int row_address_type) {
   Rp1RioState &state = s_rio_state;
   if (state.active) return;
 
@@ -558,8 +561,8 @@ void Rp1RioInitOrDie(const HardwareMapping &mapping, int double_rows,
   state.active = true;
 }
 
-void Rp1RioInitializePanels(const HardwareMapping &mapping,
-                            const char *panel_type, int columns) {
+static void Rp1RioInitializePanels(const HardwareMapping &mapping,
+                                   const char *panel_type, int columns) {
   if (!s_rio_state.active || panel_type == NULL || *panel_type == '\0') return;
 
   if (strncasecmp(panel_type, "fm6126", 6) == 0) {
@@ -575,7 +578,8 @@ void Rp1RioInitializePanels(const HardwareMapping &mapping,
   }
 }
 
-void Rp1RioDumpFramebuffer(Framebuffer *framebuffer, int pwm_low_bit) {
+static void Rp1RioDumpFramebuffer(const Framebuffer *framebuffer,
+                                  int pwm_low_bit) {
   if (!s_rio_state.active || framebuffer == NULL) return;
 
   Rp1RioState &state = s_rio_state;
@@ -583,8 +587,9 @@ void Rp1RioDumpFramebuffer(Framebuffer *framebuffer, int pwm_low_bit) {
   // bits. The RIO dump loop layers row addresses and panel control timing on
   // top of those words and uses busy-waits to hold the PWM bitplane on-time.
   const HardwareMapping &h = framebuffer->hardware_mapping();
+  const int bit_planes = framebuffer->bit_planes();
   const int start_bit =
-      std::max(pwm_low_bit, Framebuffer::kBitPlanes - framebuffer->pwmbits());
+      std::max(pwm_low_bit, bit_planes - framebuffer->pwmbits());
   const int double_rows = framebuffer->double_rows();
   const int columns = framebuffer->columns();
   const int scan_mode = framebuffer->scan_mode();
@@ -599,8 +604,13 @@ void Rp1RioDumpFramebuffer(Framebuffer *framebuffer, int pwm_low_bit) {
         DisplayRowFromLoop(row_loop, double_rows, scan_mode);
     const uint32_t current_addr =
         CalcRowAddressBits(h, state.row_address_type, display_row);
+    const uint32_t skipped_planes = state.skip_empty_planes
+      ? framebuffer->empty_planes(display_row) : 0;
 
-    for (int bit = start_bit; bit < Framebuffer::kBitPlanes; ++bit) {
+    for (int bit = start_bit; bit < bit_planes; ++bit) {
+      // Left out entirely; the previous plane stays on while the next one
+      // is clocked in.
+      if (skipped_planes & (1u << bit)) continue;
       const gpio_bits_t *row_data = framebuffer->RowDataAt(display_row, bit);
 
       int remaining_overlap_words = previous_active_words;
@@ -618,13 +628,16 @@ void Rp1RioDumpFramebuffer(Framebuffer *framebuffer, int pwm_low_bit) {
         BusyWaitWords(remaining_overlap_words);
       }
 
-      state.rio_out->Out = current_addr | state.output_enable_bit;
-      ClockSetupDelay(state.gpio_slowdown);
+      // Give a new address time to settle; otherwise latching can start
+      // right away. The latch is released by the next full write, which is
+      // the first column of the next plane or the end of the frame.
+      if (current_addr != previous_addr) {
+        state.rio_out->Out = current_addr | state.output_enable_bit;
+        ClockSetupDelay(state.gpio_slowdown);
+      }
       state.rio_out->Out =
           current_addr | state.output_enable_bit | state.latch_bit;
       ClockSetupDelay(state.gpio_slowdown);
-      state.rio_out->Out = current_addr | state.output_enable_bit;
-      ClockSetupDelay(state.gpio_slowdown);
 
       previous_addr = current_addr;
       previous_active_words = state.bitplane_active_words[bit];
@@ -638,7 +651,7 @@ void Rp1RioDumpFramebuffer(Framebuffer *framebuffer, int pwm_low_bit) {
   state.rio_out->Out = previous_addr | state.output_enable_bit;
 }
 
-void Rp1RioDeinit() {
+static void Rp1RioDeinit() {
   Rp1RioState &state = s_rio_state;
   if (!state.active) return;
 
@@ -653,6 +666,7 @@ void Rp1RioDeinit() {
 
   state.active = false;
   state.panel_init_warned = false;
+  state.skip_empty_planes = false;
   state.map_base = NULL;
   state.gpio_regs = NULL;
   state.pad_regs = NULL;
@@ -671,5 +685,39 @@ void Rp1RioDeinit() {
   state.bitplane_active_words.clear();
 }
 
+namespace {
+class Rp1RioOutputBackend : public OutputBackend {
+public:
+  explicit Rp1RioOutputBackend(const HardwareMapping &mapping)
+    : mapping_(mapping) {}
+  virtual ~Rp1RioOutputBackend() { Rp1RioDeinit(); }
+
+  virtual void InitializePanels(const char *panel_type, int columns) {
+    Rp1RioInitializePanels(mapping_, panel_type, columns);
+  }
+  virtual void DumpFramebuffer(const Framebuffer *framebuffer,
+                               int pwm_low_bit) {
+    Rp1RioDumpFramebuffer(framebuffer, pwm_low_bit);
+  }
+  virtual void SetSkipEmptyPlanes(bool skip) {
+    s_rio_state.skip_empty_planes = skip;
+  }
+  virtual bool ExposesGPIO() const { return false; }
+
+private:
+  const HardwareMapping &mapping_;
+};
+}  // namespace
+
+OutputBackend *Rp1RioCreateOutputBackend(const HardwareMapping &mapping,
+                                         int double_rows, int parallel,
+                                         int pwm_lsb_nanoseconds,
+                                         int dither_bits,
+                                         int row_address_type) {
+  Rp1RioInitOrDie(mapping, double_rows, parallel, pwm_lsb_nanoseconds,
+                  dither_bits, row_address_type);
+  return new Rp1RioOutputBackend(mapping);
+}
+
 }  // namespace internal
 }  // namespace rgb_matrix
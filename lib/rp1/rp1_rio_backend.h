@@ -6,7 +6,7 @@ struct HardwareMapping;
 
 namespace rgb_matrix {
 namespace internal {
-class Framebuffer;
+class OutputBackend;
 
 // Internal Pi 5-family RP1 RIO renderer.
 //
@@ -20,14 +20,11 @@ bool Rp1RioBackendRequested();
 bool Rp1RioShouldActivate(const char *hardware_mapping, int row_address_type,
                           int parallel);
 void Rp1RioSetGpioSlowdown(int slowdown);
-bool Rp1RioIsActive();
-void Rp1RioInitOrDie(const HardwareMapping &mapping, int double_rows,
-                     int parallel, int pwm_lsb_nanoseconds, int dither_bits,
-                     int row_address_type);
-void Rp1RioInitializePanels(const HardwareMapping &mapping,
-                            const char *panel_type, int columns);
-void Rp1RioDumpFramebuffer(Framebuffer *framebuffer, int pwm_low_bit);
-void Rp1RioDeinit();
+OutputBackend *Rp1RioCreateOutputBackend(const HardwareMapping &mapping,
+                                         int double_rows, int parallel,
+                                         int pwm_lsb_nanoseconds,
+                                         int dither_bits,
+                                         int row_address_type);
 
 }  // namespace internal
 }  // namespace rgb_matrix
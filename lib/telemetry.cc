@@ -0,0 +1,93 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "telemetry.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace rgb_matrix {
+namespace internal {
+namespace {
+// Layout of the exported file. Readers check magic and version, and only
+// look at as much of the Telemetry as both sides know of.
+struct TelemetryFile {
+  char magic[8];       // "RGBTELEM", not 0-terminated.
+  uint32_t version;
+  uint32_t size;       // sizeof(Telemetry)
+  Telemetry telemetry;
+};
+static const uint32_t kTelemetryFileVersion = 1;
+
+// All counters are uint64_t, so they can be read and copied word by word.
+static const int kTelemetryWords = sizeof(Telemetry) / sizeof(uint64_t);
+static_assert(sizeof(Telemetry) % sizeof(uint64_t) == 0, "Only counters");
+
+Telemetry s_static_block;
+Telemetry *s_block = &s_static_block;
+}  // namespace
+
+Telemetry *TelemetryBlock() {
+  return __atomic_load_n(&s_block, __ATOMIC_ACQUIRE);
+}
+
+static void CopyTelemetry(const Telemetry *from, Telemetry *to) {
+  const uint64_t *in = reinterpret_cast<const uint64_t *>(from);
+  uint64_t *out = reinterpret_cast<uint64_t *>(to);
+  for (int i = 0; i < kTelemetryWords; ++i) {
+    out[i] = __atomic_load_n(&in[i], __ATOMIC_RELAXED);
+  }
+}
+
+void TelemetrySnapshot(Telemetry *out) {
+  CopyTelemetry(TelemetryBlock(), out);
+}
+
+bool TelemetryExport(const char *path) {
+  if (TelemetryBlock() != &s_static_block) {
+    fprintf(stderr, "Telemetry is already exported.\n");
+    return false;
+  }
+  const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("Can't create telemetry file");
+    return false;
+  }
+  void *mapped = MAP_FAILED;
+  if (ftruncate(fd, sizeof(TelemetryFile)) == 0) {
+    mapped = mmap(NULL, sizeof(TelemetryFile), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    perror("Can't map telemetry file");
+    return false;
+  }
+  TelemetryFile *file = static_cast<TelemetryFile *>(mapped);
+  memcpy(file->magic, "RGBTELEM", sizeof(file->magic));
+  file->version = kTelemetryFileVersion;
+  file->size = sizeof(Telemetry);
+  // What is recorded between the copy and the switch is lost; a few
+  // events at most.
+  CopyTelemetry(&s_static_block, &file->telemetry);
+  __atomic_store_n(&s_block, &file->telemetry, __ATOMIC_RELEASE);
+  return true;
+}
+
+}  // namespace internal
+}  // namespace rgb_matrix
@@ -0,0 +1,61 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef RPI_RGBMATRIX_TELEMETRY_H
+#define RPI_RGBMATRIX_TELEMETRY_H
+
+#include <stdint.h>
+
+#include "led-matrix.h"
+
+namespace rgb_matrix {
+namespace internal {
+typedef RGBMatrix::Telemetry Telemetry;
+typedef RGBMatrix::TelemetryHistogram TelemetryHistogram;
+
+// The process wide block everything is recorded into. All updates are
+// relaxed atomic additions, so they are safe from any thread and never wait;
+// readers see each value whole, but not necessarily all of them from the
+// same moment.
+Telemetry *TelemetryBlock();
+
+inline void TelemetryAdd(uint64_t *counter, uint64_t value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+inline void TelemetryRecord(TelemetryHistogram *histogram, uint32_t usec) {
+  static const int kLastBucket = RGBMatrix::kTelemetryBuckets - 1;
+  const int bucket = (usec == 0) ? 0 : 32 - __builtin_clz(usec);
+  TelemetryAdd(&histogram->count, 1);
+  TelemetryAdd(&histogram->total_usec, usec);
+  TelemetryAdd(&histogram->buckets[bucket < kLastBucket ? bucket : kLastBucket],
+               1);
+  uint64_t max = __atomic_load_n(&histogram->max_usec, __ATOMIC_RELAXED);
+  while (usec > max
+         && !__atomic_compare_exchange_n(&histogram->max_usec, &max,
+                                         (uint64_t)usec, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// Copy of the current values.
+void TelemetrySnapshot(Telemetry *out);
+
+// Move the block into a shared memory file at "path"; see
+// RGBMatrix::ExportTelemetry().
+bool TelemetryExport(const char *path);
+
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_TELEMETRY_H
@@ -0,0 +1,226 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "thread.h"
+
+namespace rgb_matrix {
+namespace internal {
+std::atomic<bool> s_tracing(false);
+
+namespace {
+// Last events of one thread. Only the owning thread writes; DumpTrace()
+// reads concurrently and drops what might have been overwritten meanwhile.
+// The words of an event are atomics so that such a read is merely stale.
+struct TraceRing {
+  // At a few hundred events per refresh, about half a second of the
+  // refresh thread; much more of everything else.
+  static const int kEvents = 1 << 16;
+
+  struct Event {
+    std::atomic<uintptr_t> name;
+    std::atomic<uint64_t> start_ns;
+    std::atomic<uint64_t> duration_and_arg;  // duration << 32 | arg
+  };
+
+  std::atomic<pid_t> tid;  // 0 while the ring was never used.
+  char thread_name[17];
+  std::atomic<uint64_t> written;  // Events ever written.
+  Event events[kEvents];
+};
+
+// Rings are not allocated on the way of a realtime thread such as the
+// refresh thread: SetTracing(true) prepares a few spares, faulted in
+// already, that such a thread takes without a lock on its first event.
+// Rings of threads that finished are used again.
+const int kSpareRings = 4;
+std::atomic<TraceRing *> s_spare_rings[kSpareRings];
+
+Mutex s_rings_mutex;
+std::vector<TraceRing *> s_rings;       // All of them, for DumpTrace().
+std::vector<TraceRing *> s_free_rings;  // Of threads that finished.
+pthread_key_t s_ring_key;
+pthread_once_t s_ring_key_once = PTHREAD_ONCE_INIT;
+__thread TraceRing *t_ring = NULL;
+__thread int t_realtime = -1;  // Thread is SCHED_FIFO/RR; -1: not known yet.
+
+// A ring not owned by any thread. Called with s_rings_mutex held.
+TraceRing *FreeRingLocked() {
+  if (!s_free_rings.empty()) {
+    TraceRing *const ring = s_free_rings.back();
+    s_free_rings.pop_back();
+    return ring;
+  }
+  TraceRing *const ring = new TraceRing();  // Zeroed, so all pages touched.
+  s_rings.push_back(ring);
+  return ring;
+}
+
+TraceRing *TakeSpareRing() {
+  for (int i = 0; i < kSpareRings; ++i) {
+    TraceRing *const ring = s_spare_rings[i].exchange(NULL);
+    if (ring) return ring;
+  }
+  return NULL;
+}
+
+// At thread exit, the ring goes back to the spares or the free list.
+void ReleaseRing(void *ring_ptr) {
+  TraceRing *ring = static_cast<TraceRing *>(ring_ptr);
+  for (int i = 0; i < kSpareRings; ++i) {
+    TraceRing *expected = NULL;
+    if (s_spare_rings[i].compare_exchange_strong(expected, ring)) return;
+  }
+  MutexLock l(&s_rings_mutex);
+  s_free_rings.push_back(ring);
+}
+
+void CreateRingKey() { pthread_key_create(&s_ring_key, &ReleaseRing); }
+
+// The ring for this thread to record to, or NULL if a realtime thread
+// finds no spare one.
+TraceRing *NewThreadRing() {
+  if (t_realtime < 0) {
+    const int policy = sched_getscheduler(0);
+    t_realtime = (policy == SCHED_FIFO || policy == SCHED_RR);
+  }
+  TraceRing *ring;
+  if (t_realtime) {
+    if ((ring = TakeSpareRing()) == NULL) return NULL;
+  } else {
+    MutexLock l(&s_rings_mutex);
+    ring = FreeRingLocked();
+  }
+  // Events of the previous owner are gone now.
+  ring->written.store(0, std::memory_order_relaxed);
+  memset(ring->thread_name, 0, sizeof(ring->thread_name));
+  prctl(PR_GET_NAME, ring->thread_name, 0, 0, 0);
+  ring->tid.store(syscall(SYS_gettid), std::memory_order_release);
+  pthread_setspecific(s_ring_key, ring);
+  return ring;
+}
+
+// Thread names are the only text from outside.
+void PrintJsonSafe(FILE *out, const char *str) {
+  for (; *str; ++str) {
+    fputc((*str == '"' || *str == '\\' || *str < ' ') ? '_' : *str, out);
+  }
+}
+}  // namespace
+
+uint64_t TraceNowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void TraceRecord(const char *name, uint64_t start_ns, uint64_t end_ns,
+                 int32_t arg) {
+  if (t_ring == NULL && (t_ring = NewThreadRing()) == NULL) return;
+  TraceRing *const ring = t_ring;
+  const uint64_t written = ring->written.load(std::memory_order_relaxed);
+  TraceRing::Event &event = ring->events[written % TraceRing::kEvents];
+  uint64_t duration_ns = end_ns - start_ns;
+  if (duration_ns > UINT32_MAX) duration_ns = UINT32_MAX;
+  event.name.store((uintptr_t)name, std::memory_order_relaxed);
+  event.start_ns.store(start_ns, std::memory_order_relaxed);
+  event.duration_and_arg.store(duration_ns << 32 | (uint32_t)arg,
+                               std::memory_order_relaxed);
+  ring->written.store(written + 1, std::memory_order_release);
+}
+
+void SetTracing(bool on) {
+  if (on) {
+    pthread_once(&s_ring_key_once, &CreateRingKey);
+    MutexLock l(&s_rings_mutex);
+    for (int i = 0; i < kSpareRings; ++i) {
+      if (s_spare_rings[i].load() != NULL) continue;
+      TraceRing *ring = FreeRingLocked();
+      TraceRing *expected = NULL;
+      if (!s_spare_rings[i].compare_exchange_strong(expected, ring)) {
+        s_free_rings.push_back(ring);  // A thread exiting was faster.
+      }
+    }
+  }
+  s_tracing.store(on);
+}
+
+bool DumpTrace(const char *filename) {
+  FILE *out = fopen(filename, "w");
+  if (out == NULL) {
+    perror("Can't write trace");
+    return false;
+  }
+  std::vector<TraceRing *> rings;
+  {
+    MutexLock l(&s_rings_mutex);
+    rings = s_rings;
+  }
+  const int pid = getpid();
+  const char *separator = "";
+  fprintf(out, "{\"traceEvents\":[\n");
+  for (size_t r = 0; r < rings.size(); ++r) {
+    const TraceRing *ring = rings[r];
+    const pid_t tid = ring->tid.load(std::memory_order_acquire);
+    if (tid == 0) continue;  // Spare, never used.
+    fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"", separator, pid, tid);
+    PrintJsonSafe(out, ring->thread_name);
+    fprintf(out, "\"}}");
+    separator = ",\n";
+
+    const uint64_t written = ring->written.load(std::memory_order_acquire);
+    const uint64_t first = written > (uint64_t)TraceRing::kEvents
+      ? written - TraceRing::kEvents : 0;
+    for (uint64_t i = first; i < written; ++i) {
+      const TraceRing::Event &event = ring->events[i % TraceRing::kEvents];
+      const char *name = (const char *)event.name.load(
+        std::memory_order_relaxed);
+      const uint64_t start_ns = event.start_ns.load(std::memory_order_relaxed);
+      const uint64_t duration_and_arg =
+        event.duration_and_arg.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      // Overwritten while we were looking?
+      if (ring->written.load(std::memory_order_relaxed) - i
+          > (uint64_t)TraceRing::kEvents) {
+        continue;
+      }
+      const int32_t arg = (int32_t)(duration_and_arg & 0xffffffff);
+      fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"rgb-matrix\",\"ph\":\"X\","
+              "\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+              name, pid, tid, start_ns / 1000.0,
+              (duration_and_arg >> 32) / 1000.0);
+      if (arg >= 0) fprintf(out, ",\"args\":{\"value\":%d}", arg);
+      fprintf(out, "}");
+    }
+  }
+  fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  return fclose(out) == 0;
+}
+
+}  // namespace internal
+}  // namespace rgb_matrix
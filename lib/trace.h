@@ -0,0 +1,85 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef RPI_RGBMATRIX_TRACE_H
+#define RPI_RGBMATRIX_TRACE_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+// Trace points of the refresh and render pipeline. While tracing is switched
+// on with RGBMatrix::SetTracing(), every thread passing one records a span
+// into a ring buffer of its own; RGBMatrix::DumpTrace() writes them out as
+// Chrome trace-event JSON.
+//
+// Switched off, a trace point costs a load and a branch. Compiled with
+// -DDISABLE_TRACING, there is nothing left of them.
+//
+//   RGB_TRACE_SPAN("name");             // Until the end of the scope.
+//   RGB_TRACE_SPAN_ARG("name", value);  // With a number, e.g. the row.
+//
+// Names need to be string literals.
+#ifdef DISABLE_TRACING
+#  define RGB_TRACE_SPAN(name) do {} while (0)
+#  define RGB_TRACE_SPAN_ARG(name, arg) do {} while (0)
+#else
+#  define RGB_TRACE_VAR2(line) rgb_trace_span_##line
+#  define RGB_TRACE_VAR(line) RGB_TRACE_VAR2(line)
+#  define RGB_TRACE_SPAN(name)                                          \
+  ::rgb_matrix::internal::TraceSpan RGB_TRACE_VAR(__LINE__)(name, -1)
+#  define RGB_TRACE_SPAN_ARG(name, arg)                                 \
+  ::rgb_matrix::internal::TraceSpan RGB_TRACE_VAR(__LINE__)(name, arg)
+#endif
+
+namespace rgb_matrix {
+namespace internal {
+extern std::atomic<bool> s_tracing;
+
+inline bool TracingEnabled() {
+  return s_tracing.load(std::memory_order_relaxed);
+}
+
+// CLOCK_MONOTONIC, the clock of the trace.
+uint64_t TraceNowNanos();
+
+// Append a span to the ring buffer of this thread. "arg" < 0 means none.
+void TraceRecord(const char *name, uint64_t start_ns, uint64_t end_ns,
+                 int32_t arg);
+
+class TraceSpan {
+public:
+  TraceSpan(const char *name, int32_t arg)
+    : name_(name), arg_(arg),
+      start_ns_(TracingEnabled() ? TraceNowNanos() : 0) {}
+  ~TraceSpan() {
+    // Spans that began before tracing was switched on are left out.
+    if (start_ns_) TraceRecord(name_, start_ns_, TraceNowNanos(), arg_);
+  }
+
+private:
+  const char *const name_;
+  const int32_t arg_;
+  const uint64_t start_ns_;
+};
+
+void SetTracing(bool on);
+
+// Write what is in the ring buffers of all threads as Chrome trace-event
+// JSON. Returns false if the file can't be written.
+bool DumpTrace(const char *filename);
+
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_TRACE_H
@@ -0,0 +1,101 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "worker-pool.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace rgb_matrix {
+namespace internal {
+// Don't use more than the three cores next to the refresh thread.
+static constexpr int kMaxParallelism = 3;
+static constexpr uint32_t kWorkerCpuMask = (1<<0) | (1<<1) | (1<<2);
+
+class WorkerPool::Worker : public Thread {
+public:
+  Worker(WorkerPool *pool, int part) : pool_(pool), part_(part) {}
+  virtual void Run() { pool_->WorkerLoop(part_); }
+
+private:
+  WorkerPool *const pool_;
+  const int part_;
+};
+
+WorkerPool *WorkerPool::Get() {
+  // Never deleted: the workers wait forever, so they can't be joined at exit.
+  static WorkerPool *const instance = new WorkerPool(
+    std::min((int)sysconf(_SC_NPROCESSORS_ONLN) - 1, kMaxParallelism) - 1);
+  return instance;
+}
+
+WorkerPool::WorkerPool(int workers)
+  : generation_(0), fn_(NULL), arg_(NULL), parts_(0), outstanding_(0) {
+  pthread_cond_init(&work_available_, NULL);
+  pthread_cond_init(&work_done_, NULL);
+  for (int i = 0; i < workers; ++i) {
+    Worker *worker = new Worker(this, i + 1);
+    worker->Start(0, kWorkerCpuMask);
+    workers_.push_back(worker);
+  }
+}
+
+void WorkerPool::Run(int parts, WorkFunction fn, void *arg) {
+  parts = std::min(parts, parallelism());
+  if (parts <= 1) {
+    if (parts == 1) fn(arg, 0);
+    return;
+  }
+
+  MutexLock run_lock(&run_mutex_);
+  {
+    MutexLock l(&mutex_);
+    fn_ = fn;
+    arg_ = arg;
+    parts_ = parts;
+    outstanding_ = parts - 1;
+    ++generation_;
+    pthread_cond_broadcast(&work_available_);
+  }
+
+  fn(arg, 0);
+
+  MutexLock l(&mutex_);
+  while (outstanding_ > 0) mutex_.WaitOn(&work_done_);
+}
+
+void WorkerPool::WorkerLoop(int part) {
+  uint64_t seen_generation = 0;
+  for (;;) {
+    WorkFunction fn;
+    void *arg;
+    {
+      MutexLock l(&mutex_);
+      while (generation_ == seen_generation) mutex_.WaitOn(&work_available_);
+      seen_generation = generation_;
+      if (part >= parts_) continue;  // Not needed this time.
+      fn = fn_;
+      arg = arg_;
+    }
+
+    fn(arg, part);
+
+    MutexLock l(&mutex_);
+    if (--outstanding_ == 0) pthread_cond_signal(&work_done_);
+  }
+}
+}  // namespace internal
+}  // namespace rgb_matrix
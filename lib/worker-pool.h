@@ -0,0 +1,66 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef RPI_RGBMATRIX_WORKER_POOL_H
+#define RPI_RGBMATRIX_WORKER_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "thread.h"
+
+namespace rgb_matrix {
+namespace internal {
+// A small set of persistent threads to split up bulk work such as frame
+// conversion. The workers are pinned to the cores that are not used by the
+// refresh thread (which lives on core 3).
+class WorkerPool {
+public:
+  typedef void (*WorkFunction)(void *arg, int part);
+
+  // The shared pool. Created on first use, lives until the program exits.
+  static WorkerPool *Get();
+
+  // Number of parts work can be split into: the workers plus the caller.
+  int parallelism() const { return (int)workers_.size() + 1; }
+
+  // Call fn(arg, part) for every part in [0, parts) and return once all of
+  // them are done. Part 0 runs in the calling thread. "parts" is capped to
+  // parallelism().
+  void Run(int parts, WorkFunction fn, void *arg);
+
+private:
+  class Worker;
+
+  explicit WorkerPool(int workers);
+  void WorkerLoop(int part);
+
+  std::vector<Worker*> workers_;
+
+  Mutex run_mutex_;   // One Run() at a time.
+
+  Mutex mutex_;
+  pthread_cond_t work_available_;
+  pthread_cond_t work_done_;
+  uint64_t generation_;
+  WorkFunction fn_;
+  void *arg_;
+  int parts_;
+  int outstanding_;
+};
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_WORKER_POOL_H
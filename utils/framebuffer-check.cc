@@ -0,0 +1,343 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Checks the refresh output on any machine, no LED panel needed: frames are
+// written into a Framebuffer, the refresh is recorded with the CaptureGPIO
+// and decoded again, which needs to give back the same picture. Uses the
+// library internals, so this is a tool for working on the library itself.
+//
+// CopyFrom() needs to pick up all changes without touching the change
+// tracking of the source. Shadow framebuffers need to keep content that is copied or deserialized
+// into them through later drawing.
+//
+// Also compares the bulk conversion of SetPixels() with setting the pixels
+// one by one, for the result and the time it takes.
+
+#include "framebuffer-internal.h"
+#include "gpio-capture.h"
+#include "hardware-mapping.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+using rgb_matrix::internal::CaptureCostModel;
+using rgb_matrix::internal::CaptureGPIO;
+using rgb_matrix::internal::DecodeCapture;
+using rgb_matrix::internal::Framebuffer;
+using rgb_matrix::internal::PixelDesignatorMap;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Render random frames, record their refresh with a "
+          "stand-in for the GPIO\nand check that it shows the same picture.\n");
+  fprintf(stderr, "Options:\n"
+          "\t-r <rows>       : Panel rows (Default: 32).\n"
+          "\t-c <columns>    : Columns of the chain (Default: 128).\n"
+          "\t-w <ns>         : Estimated time of one GPIO write on the "
+          "target (Default: 10).\n"
+          "\t-s <slowdown>   : Like --led-slowdown-gpio (Default: 1).\n"
+          "\t-n <frames>     : Frames to time SetPixels() with (Default: 50).\n");
+  return 1;
+}
+
+// Set "count" random pixels, and the same in "expected".
+static void DrawRandom(Framebuffer *frame, std::vector<uint8_t> *expected,
+                       int width, int height, int count) {
+  for (int i = 0; i < count; ++i) {
+    const int x = random() % width;
+    const int y = random() % height;
+    uint8_t *rgb = &(*expected)[(y * width + x) * 3];
+    rgb[0] = random(); rgb[1] = random(); rgb[2] = random();
+    frame->SetPixel(x, y, rgb[0], rgb[1], rgb[2]);
+  }
+}
+
+// Record one refresh of "frame" and check that it shows "expected".
+static bool CheckRefresh(Framebuffer *frame, CaptureGPIO *io,
+                         const std::vector<uint8_t> &expected,
+                         int rows, int columns, int parallel, int bit_planes) {
+  io->Reset();
+  frame->DumpToMatrix(0);
+  std::vector<uint8_t> decoded(expected.size());
+  if (!DecodeCapture(io->trace(), frame->hardware_mapping(), rows, columns,
+                     parallel, bit_planes, &decoded[0])) {
+    fprintf(stderr, "  can't decode the refresh\n");
+    return false;
+  }
+  for (size_t i = 0; i < expected.size(); ++i) {
+    if (decoded[i] != expected[i]) {
+      const int pixel = i / 3;
+      fprintf(stderr, "  pixel (%d,%d): channel %d is %d, expected %d\n",
+              pixel % columns, pixel / columns, (int)(i % 3),
+              decoded[i], expected[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static double NowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool SameContent(const Framebuffer *a, const Framebuffer *b) {
+  const char *a_data, *b_data;
+  size_t a_len, b_len;
+  a->Serialize(&a_data, &a_len);
+  b->Serialize(&b_data, &b_len);
+  return a_len == b_len && memcmp(a_data, b_data, a_len) == 0;
+}
+
+// Copy between framebuffers with changes on either side, clean or not.
+static bool CheckCopy(int rows, int columns, bool packed, int parallel) {
+  const int height = rows * parallel;
+  PixelDesignatorMap *mapper = NULL;
+  Framebuffer *source = new Framebuffer(rows, columns, parallel,
+                                        Framebuffer::kDefaultBitPlanes, 0,
+                                        "RGB", false, packed, &mapper);
+  Framebuffer *copy = new Framebuffer(rows, columns, parallel,
+                                      Framebuffer::kDefaultBitPlanes, 0,
+                                      "RGB", false, packed, &mapper);
+  std::vector<uint8_t> expected(columns * height * 3);
+  bool same = true;
+  for (int pass = 0; pass < 8; ++pass) {
+    DrawRandom(source, &expected, columns, height, pass == 0 ? 1000 : 5);
+    if (pass & 1) source->MarkClean();
+    if (pass & 2) DrawRandom(copy, &expected, columns, height, 5);
+    if (pass & 4) copy->MarkClean();
+    std::vector<uint32_t> dirty(source->double_rows());
+    for (int row = 0; row < source->double_rows(); ++row) {
+      dirty[row] = source->dirty_planes(row);
+    }
+    copy->CopyFrom(source);
+    same = same && SameContent(source, copy);
+    for (int row = 0; row < source->double_rows(); ++row) {
+      same = same && source->dirty_planes(row) == dirty[row];
+    }
+  }
+  printf("copy packed=%d parallel=%d: clean and dirty bands  %s\n",
+         packed, parallel, same ? "ok" : "FAIL");
+  delete source;
+  delete copy;
+  delete mapper;
+  return same;
+}
+
+// Copy and deserialize into a shadow framebuffer, then draw on it and on
+// the regular source in the same way: both need to end up the same.
+static bool CheckShadow(int rows, int columns, bool packed, int parallel) {
+  const int height = rows * parallel;
+  PixelDesignatorMap *mapper = NULL;
+  Framebuffer *regular = new Framebuffer(rows, columns, parallel,
+                                         Framebuffer::kDefaultBitPlanes, 0,
+                                         "RGB", false, packed, &mapper);
+  Framebuffer *shadow = new Framebuffer(rows, columns, parallel,
+                                        Framebuffer::kDefaultBitPlanes, 0,
+                                        "RGB", false, packed, &mapper);
+  shadow->EnableShadow();
+  std::vector<uint8_t> expected(columns * height * 3);
+  bool same = true;
+  for (int pass = 0; pass < 2; ++pass) {
+    DrawRandom(regular, &expected, columns, height, columns * height);
+    if (pass == 0) {
+      shadow->CopyFrom(regular);
+    } else {
+      const char *data;
+      size_t len;
+      regular->Serialize(&data, &len);
+      same = same && shadow->Deserialize(data, len);
+    }
+    for (int i = 0; i < 10; ++i) {
+      const int x = random() % columns;
+      const int y = random() % height;
+      regular->SetPixel(x, y, x, y, i);
+      shadow->SetPixel(x, y, x, y, i);
+    }
+    same = same && SameContent(regular, shadow);  // Not converted yet.
+    shadow->ConvertShadow();
+    same = same && SameContent(regular, shadow);
+  }
+  printf("shadow packed=%d parallel=%d: copy and deserialize  %s\n",
+         packed, parallel, same ? "ok" : "FAIL");
+  delete regular;
+  delete shadow;
+  delete mapper;
+  return same;
+}
+
+// Write random images with SetPixel() for each pixel, with SetPixels() row
+// by row, which converts on this thread, and with SetPixels() for the whole
+// image, which might use the worker threads. Returns false if the results
+// differ.
+static bool BenchmarkSetPixels(int rows, int columns, bool packed,
+                               int parallel, int frames) {
+  const int height = rows * parallel;
+  PixelDesignatorMap *mapper = NULL;
+  Framebuffer *by_pixel = new Framebuffer(rows, columns, parallel,
+                                          Framebuffer::kDefaultBitPlanes, 0,
+                                          "RGB", false, packed, &mapper);
+  Framebuffer *by_row = new Framebuffer(rows, columns, parallel,
+                                        Framebuffer::kDefaultBitPlanes, 0,
+                                        "RGB", false, packed, &mapper);
+  Framebuffer *by_image = new Framebuffer(rows, columns, parallel,
+                                          Framebuffer::kDefaultBitPlanes, 0,
+                                          "RGB", false, packed, &mapper);
+  std::vector<rgb_matrix::Color> image(columns * height);
+  double pixel_s = 0, row_s = 0, image_s = 0;
+  bool same = true;
+  for (int f = 0; f < frames; ++f) {
+    for (size_t i = 0; i < image.size(); ++i) {
+      image[i] = rgb_matrix::Color(random(), random(), random());
+    }
+    double start = NowSeconds();
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < columns; ++x) {
+        const rgb_matrix::Color &c = image[y * columns + x];
+        by_pixel->SetPixel(x, y, c.r, c.g, c.b);
+      }
+    }
+    pixel_s += NowSeconds() - start;
+
+    start = NowSeconds();
+    for (int y = 0; y < height; ++y) {
+      by_row->SetPixels(0, y, columns, 1, &image[y * columns]);
+    }
+    row_s += NowSeconds() - start;
+
+    start = NowSeconds();
+    by_image->SetPixels(0, 0, columns, height, &image[0]);
+    image_s += NowSeconds() - start;
+
+    same = same && SameContent(by_pixel, by_row)
+      && SameContent(by_pixel, by_image);
+  }
+  printf("%dx%d packed=%d: SetPixel() %.3fms  SetPixels() by row %.3fms, "
+         "whole image %.3fms per frame  %s\n",
+         columns, height, packed, pixel_s * 1e3 / frames,
+         row_s * 1e3 / frames, image_s * 1e3 / frames,
+         same ? "same" : "DIFFERENT");
+  delete by_pixel;
+  delete by_row;
+  delete by_image;
+  delete mapper;
+  return same;
+}
+
+// Returns the number of failed checks.
+static int CheckConfiguration(const CaptureCostModel &cost,
+                              int rows, int columns, bool packed,
+                              int parallel, int scan_mode, int bit_planes) {
+  const int height = rows * parallel;
+  PixelDesignatorMap *mapper = NULL;
+  Framebuffer *frame = new Framebuffer(rows, columns, parallel, bit_planes,
+                                       scan_mode, "RGB", false, packed,
+                                       &mapper);
+  // Linear color mapping, so that the decoded picture is the input.
+  frame->set_luminance_correct(false);
+  CaptureGPIO io(cost);
+  Framebuffer::InitCapture(&io, rows, parallel, 130, 0, 0);
+
+  printf("packed=%d parallel=%d scan-mode=%d bit-planes=%-2d ",
+         packed, parallel, scan_mode, bit_planes);
+  int failures = 0;
+  std::vector<uint8_t> expected(columns * height * 3, 0);
+
+  // The output treats rows differently depending on whether they are still
+  // being drawn on or got a version with MarkClean(); check all of these.
+  DrawRandom(frame, &expected, columns, height, columns * height);
+  if (!CheckRefresh(frame, &io, expected, rows, columns, parallel,
+                    bit_planes)) {
+    fprintf(stderr, "  ... all rows drawn on\n");
+    ++failures;
+  }
+  frame->MarkClean();
+  if (!CheckRefresh(frame, &io, expected, rows, columns, parallel,
+                    bit_planes)) {
+    fprintf(stderr, "  ... all rows clean\n");
+    ++failures;
+  }
+  const uint64_t writes = io.writes();
+  const uint64_t elapsed_ns = io.elapsed_ns();
+  DrawRandom(frame, &expected, columns, height, 5);
+  if (!CheckRefresh(frame, &io, expected, rows, columns, parallel,
+                    bit_planes)) {
+    fprintf(stderr, "  ... some rows drawn on\n");
+    ++failures;
+  }
+
+  printf("%s  %8llu writes  %7.3fms/refresh\n", failures ? "FAIL" : "ok  ",
+         (unsigned long long)writes, elapsed_ns / 1e6);
+  Framebuffer::ResetGlobals();
+  delete frame;
+  delete mapper;
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  int rows = 32;
+  int columns = 128;
+  int frames = 50;
+  CaptureCostModel cost;
+  cost.write_ns = 10;
+  cost.slowdown = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:c:w:s:n:")) != -1) {
+    switch (opt) {
+    case 'r': rows = atoi(optarg); break;
+    case 'c': columns = atoi(optarg); break;
+    case 'w': cost.write_ns = atoi(optarg); break;
+    case 's': cost.slowdown = atoi(optarg); break;
+    case 'n': frames = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (rows < 4 || rows > 64 || rows % 2 != 0 || columns < 1 || frames < 1) {
+    fprintf(stderr, "Invalid rows or columns.\n");
+    return usage(argv[0]);
+  }
+
+  Framebuffer::InitHardwareMapping("regular");
+  const int kBitPlanes[] = { 8, 11, 16 };
+  int failures = 0;
+  for (int packed = 0; packed < 2; ++packed) {
+    for (int parallel = 1; parallel <= 3; ++parallel) {
+      for (int scan_mode = 0; scan_mode < 2; ++scan_mode) {
+        for (int p = 0; p < 3; ++p) {
+          failures += CheckConfiguration(cost, rows, columns, packed,
+                                         parallel, scan_mode, kBitPlanes[p]);
+        }
+      }
+    }
+  }
+  for (int packed = 0; packed < 2; ++packed) {
+    if (!CheckCopy(rows, columns, packed, 2)) ++failures;
+    if (!CheckShadow(rows, columns, packed, 2)) ++failures;
+  }
+  for (int packed = 0; packed < 2; ++packed) {
+    if (!BenchmarkSetPixels(rows, columns, packed, 3, frames)) ++failures;
+  }
+  if (failures) fprintf(stderr, "%d checks failed.\n", failures);
+  return failures ? 1 : 0;
+}
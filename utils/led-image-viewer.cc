@@ -404,7 +404,8 @@ int main(int argc, char *argv[]) {
       file_info->params = filename_params[filename];
       file_info->content_stream = new rgb_matrix::MemStreamIO();
       file_info->is_multi_frame = image_sequence.size() > 1;
-      rgb_matrix::StreamWriter out(file_info->content_stream);
+      // Only kept in memory, so no need to stay readable by older versions.
+      rgb_matrix::StreamWriter out(file_info->content_stream, true);
       for (size_t i = 0; i < image_sequence.size(); ++i) {
         const Magick::Image &img = image_sequence[i];
         int64_t delay_time_us;